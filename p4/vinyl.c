@@ -4,6 +4,8 @@
  * Runs the main program and proccess all the commands. Also contains all the order aspects of the project.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -71,13 +73,15 @@ int main(int argc, char *argv[])
 void processCommands(Inventory *inventory) 
 {
     char *line = NULL;
+    //Read commands a block at a time, each line is only good until the next one is read
+    LineReader *in = makeLineReader(fileno(stdin));
     //Create a new order
     Order *order = createOrder(); 
 
     while (true) { 
         printf("cmd> ");
         fflush(stdout);
-        line = readLine(stdin);
+        line = nextLine(in, NULL);
         
         if (!line) 
         break; 
@@ -85,7 +89,6 @@ void processCommands(Inventory *inventory)
         printf("%s\n", line); 
 
         if (strcmp(line, "quit") == 0) {
-            free(line);
             break;
         } else if (strncmp(line, "list", LIST) == 0) {
             if (strncmp(line, "list genre ", LISTGENRE) == 0) {
@@ -129,12 +132,11 @@ void processCommands(Inventory *inventory)
         } else {
             printf("Invalid command\n");
         }
-        //freeing line after processing
-        free(line); 
         printf("\n");
     }
-    //free order at end
+    //free order and reader at end
     freeOrder(order);
+    freeLineReader(in);
 }
 
 /**
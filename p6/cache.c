@@ -0,0 +1,182 @@
+/**
+ * @file cache.c
+ * @author David Mond (dmmond)
+ * Picks the keys a bounded map throws out. Entries for the keys are kept in a ring, linked both
+ * ways through a sentinel, so one can be moved or taken out without looking for it. With LRU,
+ * a key that's used moves to the front of the ring and the victim is the one at the back. With
+ * CLOCK, a key that's used only has its bit set, and a hand goes around the ring clearing bits
+ * until it gets to a key whose bit was already clear, which is cheaper per use and close to LRU.
+*/
+
+#include "cache.h"
+#include "map.h"
+#include <stdlib.h>
+
+/** One key's place in the ring. */
+struct CacheEntryStruct {
+  /** Entries on either side, toward the front and toward the back. */
+  CacheEntry *prev, *next;
+
+  /** For CLOCK, true if the key's been used since the hand last went by. */
+  bool used;
+
+  /** The key, which belongs to whoever added the entry. */
+  char const *key;
+};
+
+/** Representation of a cache. */
+struct CacheStruct {
+  /** MAP_EVICT_LRU or MAP_EVICT_CLOCK. */
+  int policy;
+
+  /** Sentinel linking the front and back of the ring, which isn't a key. */
+  CacheEntry ring;
+
+  /** For CLOCK, next entry the hand looks at, which may be the sentinel. */
+  CacheEntry *hand;
+
+  /** Number of entries in the ring. */
+  int count;
+};
+
+/**
+* Make an empty cache
+* @param policy MAP_EVICT_LRU or MAP_EVICT_CLOCK
+* @return returns the new cache
+*/
+Cache *makeCache(int policy)
+{
+  Cache *c = malloc(sizeof(Cache));
+  c->policy = policy;
+  c->ring.prev = c->ring.next = &c->ring;
+  c->hand = &c->ring;
+  c->count = 0;
+  return c;
+}
+
+/**
+* Report a cache's policy
+* @param c cache to check
+* @return returns MAP_EVICT_LRU or MAP_EVICT_CLOCK
+*/
+int cachePolicy(Cache *c)
+{
+  return c->policy;
+}
+
+/**
+* Link an entry into the ring right before another one.
+* @param e entry to link in
+* @param at entry to put it in front of
+*/
+static void linkBefore(CacheEntry *e, CacheEntry *at)
+{
+  e->next = at;
+  e->prev = at->prev;
+  at->prev->next = e;
+  at->prev = e;
+}
+
+/**
+* Take an entry out of the ring.
+* @param e entry to unlink
+*/
+static void unlink(CacheEntry *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+/**
+* Add a key as the most recently used
+* @param c cache to add to
+* @param key key for the entry to point at
+* @return returns the new entry
+*/
+CacheEntry *cacheAdd(Cache *c, char const *key)
+{
+  CacheEntry *e = malloc(sizeof(CacheEntry));
+  e->key = key;
+  e->used = true;
+  c->count++;
+  //The front for LRU, or the last place the hand gets to for CLOCK
+  linkBefore(e, c->policy == MAP_EVICT_LRU ? c->ring.next : c->hand);
+  return e;
+}
+
+/**
+* Note that a key was used, by moving it to the front or setting its bit
+* @param c cache the entry is in
+* @param e entry for the key
+*/
+void cacheTouch(Cache *c, CacheEntry *e)
+{
+  if (c->policy == MAP_EVICT_CLOCK) {
+    e->used = true;
+    //Don't let the hand pick the key right after it was used
+    if (c->hand == e)
+      c->hand = e->next;
+  } else if (c->ring.next != e) {
+    unlink(e);
+    linkBefore(e, c->ring.next);
+  }
+}
+
+/**
+* Take a key out of the cache
+* @param c cache the entry is in
+* @param e entry to drop
+*/
+void cacheDrop(Cache *c, CacheEntry *e)
+{
+  if (c->hand == e)
+    c->hand = e->next;
+  unlink(e);
+  free(e);
+  c->count--;
+}
+
+/**
+* Pick the next key to throw out
+* @param c cache to pick from
+* @return returns the key, or NULL if there aren't any
+*/
+char const *cacheVictim(Cache *c)
+{
+  if (c->ring.next == &c->ring)
+    return NULL;
+  if (c->policy == MAP_EVICT_LRU)
+    return c->ring.prev->key;
+
+  //Give every used key another chance on the way around, at most one trip
+  while (c->hand == &c->ring || c->hand->used) {
+    c->hand->used = false;
+    c->hand = c->hand->next;
+  }
+  return c->hand->key;
+}
+
+/**
+* Report the memory in a cache's entries
+* @param c cache to measure
+* @return returns the bytes in the entries
+*/
+long cacheBytes(Cache *c)
+{
+  return c->count * (long) sizeof(CacheEntry);
+}
+
+/**
+* Free a cache and its entries
+* @param c cache to free
+*/
+void freeCache(Cache *c)
+{
+  CacheEntry *e = c->ring.next;
+  while (e != &c->ring) {
+    CacheEntry *next = e->next;
+    free(e);
+    e = next;
+  }
+  free(c);
+}
@@ -0,0 +1,71 @@
+/**
+ * @file cache.h
+ * @author David Mond (dmmond)
+ * Header file for cache.c, which picks the keys a map with a limited size throws out when it
+ * gets too big. map.c keeps an entry for each key and tells the cache whenever a key is used,
+ * and these functions are only meant to be called from there.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+/** Incomplete type for the keys of a bounded map, in the order they'd be thrown out. */
+typedef struct CacheStruct Cache;
+
+/** Incomplete type for one key's place in a cache. */
+typedef struct CacheEntryStruct CacheEntry;
+
+/** Make an empty cache.
+    @param policy MAP_EVICT_LRU or MAP_EVICT_CLOCK.
+    @return the new cache.
+*/
+Cache *makeCache( int policy );
+
+/** Report which policy a cache uses.
+    @param c Cache to check.
+    @return MAP_EVICT_LRU or MAP_EVICT_CLOCK.
+*/
+int cachePolicy( Cache *c );
+
+/** Add a key to the cache, as the one used most recently.
+    @param c Cache to add to.
+    @param key Key to add.  The cache only points at it, so it has to
+    stay put until the entry is dropped.
+    @return the key's entry.
+*/
+CacheEntry *cacheAdd( Cache *c, char const *key );
+
+/** Note that a key was just used.  This never allocates or walks the
+    cache, it only moves or marks the one entry.
+    @param c Cache the entry is in.
+    @param e Entry for the key.
+*/
+void cacheTouch( Cache *c, CacheEntry *e );
+
+/** Take a key out of the cache and free its entry.
+    @param c Cache the entry is in.
+    @param e Entry to drop.
+*/
+void cacheDrop( Cache *c, CacheEntry *e );
+
+/** Pick the key to throw out next.  It stays in the cache until the map
+    removes it and drops its entry.
+    @param c Cache to pick from.
+    @return the key the entry was added with, or NULL if it's empty.
+*/
+char const *cacheVictim( Cache *c );
+
+/** Report the memory a cache's entries use.
+    @param c Cache to measure.
+    @return the bytes in the entries, which grows and shrinks with the keys.
+*/
+long cacheBytes( Cache *c );
+
+/** Free a cache and all its entries.
+    @param c Cache to free.
+*/
+void freeCache( Cache *c );
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file cmdBench.c
+ * @author David Mond (dmmond)
+ * Benchmark for running command lines. Generates a big file of commands like the ones in
+ * input-10.txt, sets of short random keys to small numbers, mixed with doubles, strings, gets
+ * and pluses, then times running all of them through a session whose output is thrown away,
+ * and reports the lines per second and nanoseconds per line. Running it with a file name
+ * also writes the commands to that file, so the whole driver can be timed on them too.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "command.h"
+#include "map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** Default number of command lines to generate. */
+#define LINE_COUNT 1000000
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+/** Length of each key, the same as in input-10.txt. */
+#define KEY_LENGTH 5
+/** Numbers stored by set run from minus this to plus this. */
+#define NUMBER_RANGE 100
+/** Room for one generated command line. */
+#define LINE_LENGTH 64
+/** Out of 100 lines, this many set an integer. */
+#define MIX_INT 50
+/** Out of 100 lines, this many set a double. */
+#define MIX_DOUBLE 10
+/** Out of 100 lines, this many set a string. */
+#define MIX_STRING 10
+/** Out of 100 lines, this many are gets, and the rest add an integer with plus. */
+#define MIX_GET 20
+/** Percent scale for the command mix. */
+#define PERCENT 100
+/** Number of times to run all the lines, keeping the best time. */
+#define ROUNDS 3
+
+/**
+ * Get the current time from a monotonic clock.
+ * @return returns the time in nanoseconds
+ */
+static long long now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANOS + ts.tv_nsec;
+}
+
+/**
+ * Make one random key of lowercase letters.
+ * @param key buffer of at least KEY_LENGTH + 1 characters to fill in
+ */
+static void makeKey(char *key)
+{
+  for (int i = 0; i < KEY_LENGTH; i++)
+    key[i] = 'a' + rand() % 26;
+  key[KEY_LENGTH] = '\0';
+}
+
+/**
+ * Generate the command lines.
+ * @param count number of lines to make
+ * @param bytes filled in with the total length of the lines, counting their newlines
+ * @return returns a dynamically allocated array of dynamically allocated lines
+ */
+static char **makeLines(long count, long *bytes)
+{
+  char **lines = malloc(count * sizeof(char *));
+  char key[KEY_LENGTH + 1];
+  char line[LINE_LENGTH];
+  *bytes = 0;
+  for (long i = 0; i < count; i++) {
+    makeKey(key);
+    int number = rand() % (2 * NUMBER_RANGE + 1) - NUMBER_RANGE;
+    int op = rand() % PERCENT;
+    if (op < MIX_INT)
+      sprintf(line, "set %s %d", key, number);
+    else if (op < MIX_INT + MIX_DOUBLE)
+      sprintf(line, "set %s %d.%02d", key, number, rand() % NUMBER_RANGE);
+    else if (op < MIX_INT + MIX_DOUBLE + MIX_STRING)
+      sprintf(line, "set %s \"%s\"", key, key + 1);
+    else if (op < MIX_INT + MIX_DOUBLE + MIX_STRING + MIX_GET)
+      sprintf(line, "get %s", key);
+    else
+      sprintf(line, "plus %s %d", key, number);
+    lines[i] = strdup(line);
+    *bytes += strlen(line) + 1;
+  }
+  return lines;
+}
+
+/**
+ * Run all the lines through one session on a new map, with the output going nowhere.
+ * @param lines lines to run, which are copied first since the session cuts their words apart
+ * @param count number of lines
+ * @param out stream to throw the output away on
+ * @return returns the nanoseconds it took to run the lines
+ */
+static long long runLines(char **lines, long count, FILE *out)
+{
+  char **copies = malloc(count * sizeof(char *));
+  for (long i = 0; i < count; i++)
+    copies[i] = strdup(lines[i]);
+  Map *m = makeMap();
+  Session *s = makeSession(m, MAP_TRIE, 0, out);
+  long long start = now();
+  for (long i = 0; i < count; i++)
+    runLine(s, copies[i]);
+  sessionFlush(s);
+  long long elapsed = now() - start;
+  freeSession(s);
+  freeMap(m);
+  for (long i = 0; i < count; i++)
+    free(copies[i]);
+  free(copies);
+  return elapsed;
+}
+
+/**
+ * Run the benchmark.
+ * @param argc number of command-line arguments
+ * @param argv optional line count and a file to write the lines to
+ * @return returns exit success, or failure if the file can't be written
+ */
+int main(int argc, char *argv[])
+{
+  long count = argc > 1 ? atol(argv[1]) : LINE_COUNT;
+  if (count <= 0) {
+    fprintf(stderr, "usage: cmdBench [lines [file]]\n");
+    return EXIT_FAILURE;
+  }
+  srand(1);
+  long bytes;
+  char **lines = makeLines(count, &bytes);
+
+  //Write out the lines, so the driver can be timed on the same commands
+  if (argc > 2) {
+    FILE *fp = fopen(argv[2], "w");
+    if (!fp) {
+      fprintf(stderr, "Can't open %s\n", argv[2]);
+      return EXIT_FAILURE;
+    }
+    for (long i = 0; i < count; i++)
+      fprintf(fp, "%s\n", lines[i]);
+    fclose(fp);
+  }
+
+  FILE *out = fopen("/dev/null", "w");
+  long long best = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    long long elapsed = runLines(lines, count, out);
+    if (r == 0 || elapsed < best)
+      best = elapsed;
+  }
+  fclose(out);
+  printf("%ld lines, %ld bytes\n", count, bytes);
+  printf("%10.0f lines/s %10.1f ns/line %8.1f MB/s\n", (double) count * NANOS / best,
+         (double) best / count, (double) bytes * NANOS / best / 1e6);
+
+  for (long i = 0; i < count; i++)
+    free(lines[i]);
+  free(lines);
+  return EXIT_SUCCESS;
+}
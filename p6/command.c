@@ -0,0 +1,983 @@
+/**
+ * @file command.c
+ * @author David Mond (dmmond)
+ * Runs the commands the driver understands against a map. Each stream of commands gets its own
+ * session, which prints the same output the driver always has: the command echoed back, any
+ * result, a blank line and the next prompt. The driver runs one session on standard input and
+ * output, and the server runs one for each connection, all sharing the same map.
+ * Output collects in a buffer in the session, with values formatted right into it, and goes to
+ * the stream in big writes when the buffer fills or sessionFlush() is called.
+ * Each line is split into words in one pass, with the words pointing right into the line, and
+ * numbers are parsed straight out of their word, so running a command copies nothing.
+ * A set can give the key a time to live in seconds after its value. Every command removes a few
+ * keys whose time has run out, so they never pile up and no one command has to remove many.
+ * A session with SESSION_METRICS counts every command it runs and keeps a histogram of how many
+ * nanoseconds the map took for each set, get, remove and plus. A batch is timed as a whole, with
+ * each command in it getting an even share.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "command.h"
+#include "snapshot.h"
+#include "value.h"
+#include "histogram.h"
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+
+/** Length of buffer. */
+#define BUFFER 1024
+/** Bytes of output a session holds before writing them to its stream. */
+#define OUT_BUFFER 65536
+/** Most commands that get held back for one batch. */
+#define BATCH_MAX 1024
+/** Most expired keys removed before each command. */
+#define EXPIRE_PER_COMMAND 8
+/** Number of milliseconds in a second, for times to live. */
+#define MILLIS 1000
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+
+/** Index in commandNames of the set command, the first of the commands that get timed. */
+#define CMD_SET 0
+/** Index in commandNames of the get command. */
+#define CMD_GET 1
+/** Index in commandNames of the remove command. */
+#define CMD_REMOVE 2
+/** Index in commandNames of the plus command. */
+#define CMD_PLUS 3
+/** Number of commands that get timed. */
+#define TIMED_COMMANDS 4
+
+/** Names of the commands a session counts, with the timed ones first and anything that isn't
+    a command last. */
+static char const *const commandNames[] = {
+    "set", "get", "remove", "plus", "size", "memory", "stats", "keys", "scan", "save", "load",
+    "saveflat", "openflat", "count", "sum", "min", "max", "advance", "quit", "other"
+};
+
+/** Number of entries in commandNames. */
+#define COMMAND_TYPES ( (int) ( sizeof( commandNames ) / sizeof( commandNames[ 0 ] ) ) )
+
+/** Percentiles reported for each timed command. */
+static double const percentiles[] = { 50, 90, 99, 99.9 };
+
+/** Number of entries in percentiles. */
+#define PERCENTILE_COUNT ( (int) ( sizeof( percentiles ) / sizeof( percentiles[ 0 ] ) ) )
+
+/** Batch type when no commands are waiting. */
+#define BATCH_NONE 0
+/** Batch type for a run of set commands. */
+#define BATCH_SET 1
+/** Batch type for a run of get commands. */
+#define BATCH_GET 2
+
+/** Commands held back so they can run together as one batch. Their output is
+    printed when the batch runs, in the same order as if they'd run one at a time. */
+typedef struct {
+    /** Which command is being batched, or BATCH_NONE. */
+    int type;
+    /** Number of commands waiting. */
+    int count;
+    /** Each command line, to echo when the batch runs. */
+    char *lines[BATCH_MAX];
+    /** Key for each command, or NULL if the command doesn't look anything up. */
+    char *keys[BATCH_MAX];
+    /** For a set with a key, the value to store. */
+    Value vals[BATCH_MAX];
+    /** Number of times to print invalid for each command, before any result. */
+    int invalid[BATCH_MAX];
+} Batch;
+
+/** Result of getKey when there's no key on the line. */
+#define NO_KEY 0
+/** Result of getKey when the key was found. */
+#define KEY_OK 1
+/** Result of getKey when the key is too long. */
+#define KEY_TOO_LONG 2
+
+/** A word of a command line, pointing right into the line instead of being copied out. */
+typedef struct {
+    /** First character of the word. */
+    char *start;
+    /** Number of characters, zero if there was no word. */
+    size_t len;
+} Word;
+
+/**
+* Find the next word of a command line, i.e., the next run of characters that aren't
+* whitespace, the same words sscanf's %s would read.
+* @param p where to start looking
+* @param w filled in with the word, which is empty at the end of the line
+* @return returns the first character after the word
+*/
+static char *nextWord(char *p, Word *w)
+{
+    while (*p && isspace((unsigned char)*p)) {
+        p++;
+    }
+    w->start = p;
+    while (*p && !isspace((unsigned char)*p)) {
+        p++;
+    }
+    w->len = p - w->start;
+    return p;
+}
+
+/**
+* Check whether a word is the given command name.
+* @param w word to check
+* @param name name of the command
+* @return returns true if the word is exactly name
+*/
+static bool wordIs(Word const *w, char const *name)
+{
+    return strncmp(w->start, name, w->len) == 0 && name[w->len] == '\0';
+}
+
+/**
+* Null terminate a word right where it is in the line, so it can be used as a string.
+* Only for once the line has been echoed and all its words have been found.
+* @param w word to terminate
+* @return returns the word as a string
+*/
+static char *terminate(Word *w)
+{
+    w->start[w->len] = '\0';
+    return w->start;
+}
+
+/**
+* Parse the value given to a set or plus command, into a Value on the caller's stack.
+* Numbers are read in one pass by parseNumberInto().
+* @param v value to fill in
+* @param w value word from the command
+* @return returns false if the word isn't a valid value
+*/
+static bool parseValue(Value *v, Word const *w)
+{
+    char const *str = w->start;
+    //Either int or double
+    if (isdigit((unsigned char)str[0]) || str[0] == '-' || str[0] == '+') {
+        return parseNumberInto(v, str, w->len);
+    }
+    //If starts with a quote, its a string, and its only other quote has to end it
+    if (str[0] == '\"') {
+        char const *close = memchr(str + 1, '\"', w->len - 1);
+        if (!close || close != str + w->len - 1) {
+            return false;
+        }
+        initString(v, str + 1, w->len - 2);
+        return true;
+    }
+    return false;
+}
+
+/**
+* Parse a number of seconds, for a time to live or how far to move a test clock.
+* @param w word with the number
+* @param ms filled in with the milliseconds, rounded but never down to zero, or zero if the
+* number isn't more than zero and within MAP_TTL_MAX
+* @return returns false if the word isn't a number
+*/
+static bool parseSeconds(Word const *w, long long *ms)
+{
+    Value secs;
+    if (!parseNumberInto(&secs, w->start, w->len)) {
+        return false;
+    }
+    double d = valueType(&secs) == VALUE_INT ? integerOf(&secs) : doubleOf(&secs);
+    //Check the range before converting, since a huge double doesn't fit in a long long
+    *ms = 0;
+    if (d > 0 && d <= (double) MAP_TTL_MAX / MILLIS) {
+        *ms = (long long) (d * MILLIS + 0.5);
+        if (*ms == 0) {
+            *ms = 1;
+        }
+    }
+    return true;
+}
+
+/**
+* Count the characters in a key that aren't printable.
+* @param w key to check
+* @return returns the number of bad characters, each one gets its own invalid message
+*/
+static int badKeyChars(Word const *w)
+{
+    int bad = 0;
+    for (size_t i = 0; i < w->len; i++) {
+        if (!isprint((unsigned char)w->start[i])) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+/**
+* Find the key for a get command, which is the whole rest of the line after "get ".
+* @param line the command line
+* @param key filled in with the key
+* @return returns NO_KEY, KEY_OK or KEY_TOO_LONG
+*/
+static int getKey(char *line, Word *key)
+{
+    // Skip past get
+    size_t lineLen = strlen(line);
+    char *keyStart = line + (lineLen < strlen("get ") ? lineLen : strlen("get "));
+
+    // Skip any initial whitespace
+    while (*keyStart && isspace((unsigned char)*keyStart)) {
+        keyStart++;
+    }
+
+    // Invalid if its just get
+    if (*keyStart == '\0') {
+        return NO_KEY;
+    }
+
+    // Find the end of the key which is the end of the line.
+    char *keyEnd = keyStart;
+    while (*keyEnd && *keyEnd != '\n' && *keyEnd != '\r') {
+        keyEnd++;
+    }
+
+    // Keys have always been limited to what fit in a BUFFER
+    key->start = keyStart;
+    key->len = keyEnd - keyStart;
+    return key->len >= BUFFER - 1 ? KEY_TOO_LONG : KEY_OK;
+}
+
+/**
+* Make a dynamically allocated, null-terminated copy of a word.
+* @param w word to copy
+* @return returns the copy
+*/
+static char *copyWord(Word const *w)
+{
+    char *copy = malloc(w->len + 1);
+    memcpy(copy, w->start, w->len);
+    copy[w->len] = '\0';
+    return copy;
+}
+
+/**
+* Hold back a set or get command for the current batch.  The line is echoed later, so the
+* key is copied out instead of being terminated in place.
+* @param batch batch to add the command to
+* @param type BATCH_SET or BATCH_GET
+* @param line the command line, which is copied to echo later
+* @param key first word after the command
+* @param val second word after the command
+*/
+static void addToBatch(Batch *batch, int type, char *line, Word const *key, Word const *val)
+{
+    int i = batch->count++;
+    batch->type = type;
+    Word whole = { line, strlen(line) };
+    batch->lines[i] = copyWord(&whole);
+    batch->keys[i] = NULL;
+    batch->invalid[i] = 0;
+
+    if (type == BATCH_SET) {
+        if (val->len > 0) {
+            batch->invalid[i] = badKeyChars(key);
+            if (batch->invalid[i] == 0) {
+                if (parseValue(&batch->vals[i], val)) {
+                    batch->keys[i] = copyWord(key);
+                } else {
+                    batch->invalid[i] = 1;
+                }
+            }
+        }
+    } else {
+        Word getWord;
+        int result = getKey(line, &getWord);
+        if (result == NO_KEY) {
+            batch->invalid[i] = 1;
+        } else if (result == KEY_OK) {
+            batch->keys[i] = copyWord(&getWord);
+        }
+    }
+}
+
+/** Representation of a session. */
+struct SessionStruct {
+    /** Map the commands run against. */
+    Map *map;
+    /** Kind of map to make when loading a snapshot. */
+    int kind;
+    /** SESSION_ options for this session. */
+    int flags;
+    /** Where the output goes. */
+    FILE *out;
+    /** Set and get commands being held back, with SESSION_BATCH. */
+    Batch batch;
+    /** With SESSION_METRICS, how many times each command in commandNames has run. */
+    long counts[COMMAND_TYPES];
+    /** With SESSION_METRICS, nanoseconds spent in the map by each timed command, or all NULL. */
+    Histogram *latency[TIMED_COMMANDS];
+    /** With SESSION_TEST_CLOCK, the time the map expires keys by, in milliseconds. */
+    long long clock;
+    /** Number of bytes waiting in outBuf. */
+    size_t outLen;
+    /** Output that hasn't been written to out yet. */
+    char outBuf[OUT_BUFFER];
+};
+
+/**
+* Write any output the session is holding to its stream.
+* @param s session to flush
+*/
+void sessionFlush(Session *s)
+{
+    if (s->outLen > 0) {
+        fwrite(s->outBuf, 1, s->outLen, s->out);
+        s->outLen = 0;
+    }
+}
+
+/**
+* Add characters to the session's output, writing out what's buffered first if they don't fit.
+* @param s session to print to
+* @param str characters to add
+* @param len number of characters
+*/
+static void put(Session *s, char const *str, size_t len)
+{
+    if (s->outLen + len > OUT_BUFFER) {
+        sessionFlush(s);
+        //Too big to ever fit, so it goes straight to the stream
+        if (len > OUT_BUFFER) {
+            fwrite(str, 1, len, s->out);
+            return;
+        }
+    }
+    memcpy(s->outBuf + s->outLen, str, len);
+    s->outLen += len;
+}
+
+/**
+* Add a string to the session's output.
+* @param s session to print to
+* @param str string to add
+*/
+static void putString(Session *s, char const *str)
+{
+    put(s, str, strlen(str));
+}
+
+/**
+* Add a string and a newline to the session's output.
+* @param s session to print to
+* @param str string to add
+*/
+static void putLine(Session *s, char const *str)
+{
+    put(s, str, strlen(str));
+    put(s, "\n", 1);
+}
+
+/**
+* Add a printf-style line to the session's output, for the few that aren't just strings and values.
+* @param s session to print to
+* @param format printf format
+*/
+static void putFormat(Session *s, char const *format, ...)
+{
+    char text[BUFFER];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    put(s, text, len < (int) sizeof(text) ? len : (int) sizeof(text) - 1);
+}
+
+/**
+* Add a value and a newline to the session's output. The value is formatted right into the
+* buffer, after making room for it if there isn't enough left.
+* @param s session to print to
+* @param val value to print
+*/
+static void putValueLine(Session *s, Value const *val)
+{
+    size_t len = formatValue(val, s->outBuf + s->outLen, OUT_BUFFER - s->outLen);
+    if (len >= OUT_BUFFER - s->outLen) {
+        sessionFlush(s);
+        len = formatValue(val, s->outBuf, OUT_BUFFER);
+    }
+    if (len < OUT_BUFFER) {
+        s->outLen += len;
+    } else {
+        //A string longer than the whole buffer
+        char *valStr = valueToString(val);
+        putString(s, valStr);
+        free(valStr);
+    }
+    put(s, "\n", 1);
+}
+
+/**
+* Add a number and a newline to the session's output, printed like a value of the given type.
+* @param s session to print to
+* @param num number to print
+* @param type VALUE_INT or VALUE_DOUBLE
+*/
+static void putNumberLine(Session *s, double num, int type)
+{
+    Value val;
+    if (type == VALUE_INT) {
+        initInteger(&val, (int) num);
+    } else {
+        initDouble(&val, num);
+    }
+    putValueLine(s, &val);
+}
+
+/**
+* Look up a key and add its value and a newline to the session's output, formatting the value
+* right into the buffer while no other thread can change it.
+* @param s session to print to
+* @param key key to look up
+* @return returns false if the key isn't in the map
+*/
+static bool putFound(Session *s, char const *key)
+{
+    long len = mapFormat(s->map, key, s->outBuf + s->outLen, OUT_BUFFER - s->outLen);
+    if (len >= (long) (OUT_BUFFER - s->outLen)) {
+        sessionFlush(s);
+        len = mapFormat(s->map, key, s->outBuf, OUT_BUFFER);
+    }
+    if (len >= OUT_BUFFER) {
+        //A string longer than the whole buffer
+        char *valStr = mapGetString(s->map, key);
+        if (!valStr) {
+            return false;
+        }
+        putString(s, valStr);
+        free(valStr);
+    } else if (len >= 0) {
+        s->outLen += len;
+    } else {
+        return false;
+    }
+    put(s, "\n", 1);
+    return true;
+}
+
+/**
+* Get the current time from a monotonic clock.
+* @return returns the time in nanoseconds
+*/
+static long long now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (long long) NANOS + ts.tv_nsec;
+}
+
+/**
+* Start timing a call into the map, if the session is collecting metrics.
+* @param s session making the call
+* @return returns the time the call started, or zero if nothing's being timed
+*/
+static long long startTimer(Session *s)
+{
+    return s->latency[0] ? now() : 0;
+}
+
+/**
+* Finish timing a call into the map, sharing the time evenly between the commands it ran.
+* @param s session that made the call
+* @param cmd index of the command in commandNames, one of the timed ones
+* @param start what startTimer returned
+* @param count number of commands the call ran
+*/
+static void stopTimer(Session *s, int cmd, long long start, long count)
+{
+    if (s->latency[0] && count > 0) {
+        histogramRecord(s->latency[cmd], (now() - start) / count, count);
+    }
+}
+
+/**
+* Find which command a word names, for counting it.
+* @param w the command word
+* @return returns its index in commandNames, which is the last one for anything that isn't a command
+*/
+static int commandIndex(Word const *w)
+{
+    int i = 0;
+    while (i < COMMAND_TYPES - 1 && !wordIs(w, commandNames[i])) {
+        i++;
+    }
+    return i;
+}
+
+/**
+* Run the commands a session has held back in a batch, then print their output in order.
+* @param s session whose batch to run
+*/
+static void runBatch(Session *s)
+{
+    Batch *batch = &s->batch;
+    Map *m = s->map;
+    //Pack the commands that actually use the map together
+    char const *keys[BATCH_MAX];
+    Value *vals[BATCH_MAX];
+    int n = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->keys[i]) {
+            keys[n] = batch->keys[i];
+            //Sets move their values out of the batch, gets fill in what they found
+            if (batch->type == BATCH_SET) {
+                batch->vals[n] = batch->vals[i];
+            }
+            n++;
+        }
+    }
+    long long start = startTimer(s);
+    if (batch->type == BATCH_SET) {
+        mapSetBatch(m, keys, batch->vals, n);
+        stopTimer(s, CMD_SET, start, n);
+    } else {
+        mapGetBatch(m, keys, vals, n);
+        stopTimer(s, CMD_GET, start, n);
+    }
+
+    n = 0;
+    for (int i = 0; i < batch->count; i++) {
+        putLine(s, batch->lines[i]);
+        for (int j = 0; j < batch->invalid[i]; j++) {
+            putLine(s, "invalid");
+        }
+        if (batch->keys[i] && batch->type == BATCH_GET) {
+            Value *val = vals[n];
+            if (val) {
+                putValueLine(s, val);
+            } else {
+                putLine(s, "invalid");
+            }
+        }
+        if (batch->keys[i]) {
+            n++;
+        }
+        putString(s, "\n");
+        putString(s, "cmd> ");
+        free(batch->lines[i]);
+        free(batch->keys[i]);
+    }
+    batch->count = 0;
+    batch->type = BATCH_NONE;
+}
+
+/**
+* Clock for a map in a session with SESSION_TEST_CLOCK, which only moves when an advance command says.
+* @param ctx the session
+* @return returns the session's time in milliseconds
+*/
+static long long testClock(void *ctx)
+{
+    Session *s = ctx;
+    return s->clock;
+}
+
+/**
+* Give a map the session's test clock, if it has one.
+* @param s session the map belongs to
+* @param m map to give the clock to
+*/
+static void useClock(Session *s, Map *m)
+{
+    if (s->flags & SESSION_TEST_CLOCK) {
+        mapSetClock(m, testClock, s);
+    }
+}
+
+/**
+* Start a session and print its first prompt.
+* @param m map to run commands against
+* @param kind MAP_TRIE or MAP_HASH, for maps loaded from snapshots
+* @param flags SESSION_ options
+* @param out where to print the output
+* @return returns the new session
+*/
+Session *makeSession(Map *m, int kind, int flags, FILE *out)
+{
+    Session *s = malloc(sizeof(Session));
+    s->map = m;
+    s->kind = kind;
+    s->flags = flags;
+    s->out = out;
+    s->batch.type = BATCH_NONE;
+    s->batch.count = 0;
+    s->outLen = 0;
+    s->clock = 0;
+    useClock(s, m);
+    memset(s->counts, 0, sizeof(s->counts));
+    for (int i = 0; i < TIMED_COMMANDS; i++) {
+        s->latency[i] = flags & SESSION_METRICS ? makeHistogram() : NULL;
+    }
+    putString(s, "cmd> ");
+    return s;
+}
+
+/**
+* Run one command line and print its output, or hold it back for a batch.
+* @param s session to run the command in
+* @param line the command line, which may be changed but isn't kept
+* @return returns false if the command was quit
+*/
+bool runLine(Session *s, char *line)
+{
+    //Clear out a few keys whose time is up
+    mapExpire(s->map, EXPIRE_PER_COMMAND);
+
+    //Find the command and the three words after it, all in place in the line
+    Word command, key, val, ttl;
+    char *rest = nextWord(line, &command);
+    rest = nextWord(rest, &key);
+    rest = nextWord(rest, &val);
+    nextWord(rest, &ttl);
+    bool hasCommand = command.len > 0;
+    if (hasCommand && s->latency[0]) {
+        s->counts[commandIndex(&command)]++;
+    }
+
+    //Hold back sets and gets while they keep coming
+    if (s->flags & SESSION_BATCH) {
+        int type = BATCH_NONE;
+        if (hasCommand && wordIs(&command, "set") && ttl.len == 0 && !mapReadOnly(s->map)) {
+            type = BATCH_SET;
+        } else if (hasCommand && wordIs(&command, "get")) {
+            type = BATCH_GET;
+        }
+        if (s->batch.count > 0 && (type != s->batch.type || s->batch.count == BATCH_MAX)) {
+            runBatch(s);
+        }
+        if (type != BATCH_NONE) {
+            addToBatch(&s->batch, type, line, &key, &val);
+            return true;
+        }
+    }
+
+    putLine(s, line);
+
+    //The line has been echoed, so now its words can be cut apart into strings, except for a
+    //get, whose key runs to the end of the line
+    bool hasKey = key.len > 0;
+    bool hasVal = val.len > 0;
+    if (!wordIs(&command, "get")) {
+        if (hasVal) {
+            terminate(&val);
+        }
+        if (hasKey) {
+            terminate(&key);
+        }
+    }
+
+    //Commands
+    if (hasCommand) {
+        //Exit program
+        if (wordIs(&command, "quit")) {
+            return false;
+        //Get size
+        } 
+        else if (wordIs(&command, "size")) {
+            Value size;
+            initInteger(&size, mapSize(s->map));
+            putValueLine(s, &size);
+        //Report memory used by the trie
+        }
+        else if (wordIs(&command, "memory")) {
+            MapStats stats;
+            mapGetStats(s->map, &stats);
+            int nodes = 0;
+            for (int i = 0; i < MAP_NODE_TYPES; i++)
+                nodes += stats.nodes[i];
+            putFormat(s, "keys: %d\n", stats.keys);
+            putFormat(s, "nodes: %d (4: %d, 16: %d, 48: %d, 94: %d)\n", nodes,
+                   stats.nodes[0], stats.nodes[1], stats.nodes[2], stats.nodes[3]);
+            putFormat(s, "node bytes: %ld\n", stats.nodeBytes);
+            putFormat(s, "bytes per key: %.2f\n", stats.keys ? (double) stats.nodeBytes / stats.keys : 0.0);
+            putFormat(s, "pool: %ld chunks, %ld bytes\n", stats.chunks, stats.chunkBytes);
+            putFormat(s, "node allocs: %ld (%ld reused), node frees: %ld\n",
+                   stats.nodeAllocs, stats.nodeReuses, stats.nodeFrees);
+            //Only with -intern are there shared strings to report
+            InternStats strings;
+            getInternStats(&strings);
+            if (strings.refs > 0) {
+                putFormat(s, "interned strings: %ld (used by %ld values), %ld bytes, table %ld bytes\n",
+                       strings.strings, strings.refs, strings.bytes, strings.tableBytes);
+                putFormat(s, "bytes saved by interning: %ld\n", strings.savedBytes);
+            }
+        //Report how a map with a limit on its size or keys that expire is doing as a cache, and the metrics
+        }
+        else if (wordIs(&command, "stats")) {
+            MapCacheStats stats;
+            bool cache = mapCacheStats(s->map, &stats);
+            if (cache) {
+                //Without a limit on its size, the map only keeps track of keys that expire
+                if (stats.policy == MAP_EVICT_NONE) {
+                    putLine(s, "policy: none");
+                    putFormat(s, "keys: %d\n", stats.keys);
+                } else {
+                    long lookups = stats.hits + stats.misses;
+                    putFormat(s, "policy: %s\n", stats.policy == MAP_EVICT_CLOCK ? "clock" : "lru");
+                    putFormat(s, "max keys: %d, max bytes: %ld\n", stats.maxKeys, stats.maxBytes);
+                    putFormat(s, "keys: %d, bytes: %ld\n", stats.keys, stats.bytes);
+                    putFormat(s, "hits: %ld, misses: %ld, hit rate: %.2f\n", stats.hits, stats.misses,
+                           lookups ? (double) stats.hits / lookups : 0.0);
+                    putFormat(s, "evictions: %ld\n", stats.evictions);
+                }
+                putFormat(s, "expirations: %ld\n", stats.expirations);
+            }
+            //The metrics go straight to the stream, after everything before them
+            sessionFlush(s);
+            if (!sessionWriteMetrics(s, s->out) && !cache) {
+                putLine(s, "invalid");
+            }
+        //Set variable
+        } 
+        else if (wordIs(&command, "set")) {
+            if (hasVal) {
+                int bad = badKeyChars(&key);
+                for (int i = 0; i < bad; i++) {
+                    putLine(s, "invalid");
+                }
+                if (bad == 0) {
+                    //Numbers never leave the stack until they're copied into the map
+                    Value v;
+                    bool parsed = parseValue(&v, &val);
+                    //A number after the value is the time to live in seconds, and anything else
+                    //there is ignored, like it always was
+                    long long ms;
+                    if (parsed && ttl.len > 0 && parseSeconds(&ttl, &ms)) {
+                        //Out of range, the time to live is zero, which the map won't take
+                        long long start = startTimer(s);
+                        bool set = mapPutTTL(s->map, key.start, &v, ms);
+                        stopTimer(s, CMD_SET, start, 1);
+                        if (!set) {
+                            putLine(s, "invalid");
+                        }
+                    }
+                    else if (parsed && !mapReadOnly(s->map)) {
+                        long long start = startTimer(s);
+                        mapPut(s->map, key.start, &v);
+                        stopTimer(s, CMD_SET, start, 1);
+                    }
+                    else { 
+                        if (parsed) {
+                            clearValue(&v);
+                        }
+                        putLine(s, "invalid");
+                    }
+                }
+            }
+        } else if (wordIs(&command, "get")) {
+            Word getWord;
+            int result = getKey(line, &getWord);
+            if (result == NO_KEY) {
+                putLine(s, "invalid");
+            } else if (result == KEY_OK) {
+                // Format the value straight into the output while no other thread can change it
+                long long start = startTimer(s);
+                bool found = putFound(s, terminate(&getWord));
+                stopTimer(s, CMD_GET, start, 1);
+                if (!found) {
+                    putLine(s, "invalid");
+                }
+            }
+            //List the keys starting with an optional prefix
+        } else if (wordIs(&command, "keys")) {
+            MapCursor *c = mapIterate(s->map, hasKey ? key.start : NULL);
+            char const *k;
+            Value *v;
+            while (mapNext(c, &k, &v)) {
+                putLine(s, k);
+            }
+            freeMapCursor(c);
+            //Print the keys and values between two optional bounds
+        } else if (wordIs(&command, "scan")) {
+            MapCursor *c = mapRange(s->map, hasKey ? key.start : NULL, hasVal ? val.start : NULL);
+            char const *k;
+            Value *v;
+            while (mapNext(c, &k, &v)) {
+                putString(s, k);
+                put(s, " ", 1);
+                putValueLine(s, v);
+            }
+            freeMapCursor(c);
+            //Write the map to a snapshot file
+        } else if (wordIs(&command, "save")) {
+            if (!hasKey || !mapSave(s->map, key.start)) {
+                putLine(s, "invalid");
+            }
+            //Replace the map with the one in a snapshot file
+        } else if (wordIs(&command, "load")) {
+            Map *loaded = s->flags & SESSION_CONCURRENT ? makeConcurrentMap(s->kind) : makeMapOfKind(s->kind);
+            //Other sessions might be using a shared map, so it can't be replaced
+            if (!(s->flags & SESSION_SHARED) && hasKey && mapLoad(loaded, key.start)) {
+                freeMap(s->map);
+                s->map = loaded;
+                useClock(s, loaded);
+            } else {
+                freeMap(loaded);
+                putLine(s, "invalid");
+            }
+            //Write the map as a flat trie file
+        } else if (wordIs(&command, "saveflat")) {
+            if (!hasKey || !mapSaveFlat(s->map, key.start)) {
+                putLine(s, "invalid");
+            }
+            //Replace the map with a read-only one served from a flat trie file
+        } else if (wordIs(&command, "openflat")) {
+            Map *opened = NULL;
+            if (!(s->flags & SESSION_SHARED) && hasKey) {
+                opened = mapOpenFlat(key.start);
+            }
+            if (opened) {
+                freeMap(s->map);
+                s->map = opened;
+                useClock(s, opened);
+            } else {
+                putLine(s, "invalid");
+            }
+            //Handle remove command
+        } else if (wordIs(&command, "remove")) {
+            if (hasKey) {
+                if (mapReadOnly(s->map)) {
+                    putLine(s, "invalid");
+                } else {
+                    long long start = startTimer(s);
+                    mapRemove(s->map, key.start);
+                    stopTimer(s, CMD_REMOVE, start, 1);
+                }
+            }
+            // Handle Plus command
+        } else if (wordIs(&command, "plus")) {
+            if (hasVal) {
+                //The amount to add lives on the stack, so adding numbers doesn't allocate
+                Value addVal;
+                bool parsed = parseValue(&addVal, &val);
+
+                // The key has to be there with a value of the same type
+                long long start = startTimer(s);
+                bool added = parsed && mapPlus(s->map, key.start, &addVal);
+                if (parsed) {
+                    stopTimer(s, CMD_PLUS, start, 1);
+                }
+                if (!added) {
+                    putLine(s, "invalid");
+                }
+
+                //Free anything the temporary value holds, like a string
+                if (parsed) {
+                    clearValue(&addVal);
+                }
+            }
+            //Move the test clock forward some number of seconds
+        } else if (wordIs(&command, "advance")) {
+            long long ms;
+            if ((s->flags & SESSION_TEST_CLOCK) && hasKey && parseSeconds(&key, &ms) && ms > 0) {
+                s->clock += ms;
+            } else {
+                putLine(s, "invalid");
+            }
+            //Add up the keys with an optional prefix, or the numbers stored under them
+        } else if (wordIs(&command, "count") || wordIs(&command, "sum") ||
+                   wordIs(&command, "min") || wordIs(&command, "max")) {
+            MapAggregate agg;
+            mapAggregate(s->map, hasKey ? key.start : NULL, &agg);
+            if (wordIs(&command, "count")) {
+                putNumberLine(s, agg.keys, VALUE_INT);
+            } else if (wordIs(&command, "sum")) {
+                //Any doubles make the whole sum a double
+                if (agg.doubles > 0) {
+                    putNumberLine(s, agg.intSum + agg.doubleSum, VALUE_DOUBLE);
+                } else {
+                    putFormat(s, "%lld\n", agg.intSum);
+                }
+            } else if (agg.numbers == 0) {
+                putLine(s, "invalid");
+            } else if (wordIs(&command, "min")) {
+                putNumberLine(s, agg.min, agg.minType);
+            } else {
+                putNumberLine(s, agg.max, agg.maxType);
+            }
+        }
+    }
+    putString(s, "\n");
+    putString(s, "cmd> ");
+    return true;
+}
+
+/**
+* Write a session's metrics and its map's node counts as one line of JSON.
+* @param s session to report on
+* @param fp stream to write to
+* @return returns false if the session isn't collecting metrics
+*/
+bool sessionWriteMetrics(Session *s, FILE *fp)
+{
+    if (!s->latency[0]) {
+        return false;
+    }
+    if (s->batch.count > 0) {
+        runBatch(s);
+        sessionFlush(s);
+    }
+    fprintf(fp, "{\"commands\":{");
+    for (int i = 0; i < COMMAND_TYPES; i++) {
+        fprintf(fp, "%s\"%s\":%ld", i ? "," : "", commandNames[i], s->counts[i]);
+    }
+    fprintf(fp, "},\"latency_ns\":{");
+    for (int i = 0; i < TIMED_COMMANDS; i++) {
+        Histogram *h = s->latency[i];
+        fprintf(fp, "%s\"%s\":{\"count\":%ld,\"min\":%lld,\"mean\":%.1f", i ? "," : "",
+                commandNames[i], histogramCount(h), histogramMin(h), histogramMean(h));
+        for (int j = 0; j < PERCENTILE_COUNT; j++) {
+            fprintf(fp, ",\"p%g\":%lld", percentiles[j], histogramPercentile(h, percentiles[j]));
+        }
+        fprintf(fp, ",\"max\":%lld}", histogramMax(h));
+    }
+    MapStats stats;
+    mapGetStats(s->map, &stats);
+    fprintf(fp, "},\"map\":{\"keys\":%d,\"nodes\":{\"4\":%d,\"16\":%d,\"48\":%d,\"94\":%d}",
+            stats.keys, stats.nodes[0], stats.nodes[1], stats.nodes[2], stats.nodes[3]);
+    fprintf(fp, ",\"node_bytes\":%ld,\"chunks\":%ld,\"chunk_bytes\":%ld", stats.nodeBytes,
+            stats.chunks, stats.chunkBytes);
+    fprintf(fp, ",\"node_allocs\":%ld,\"node_reuses\":%ld,\"node_frees\":%ld}}\n",
+            stats.nodeAllocs, stats.nodeReuses, stats.nodeFrees);
+    return true;
+}
+
+/**
+* Get the map a session is using, which may have been replaced by a load.
+* @param s session to check
+* @return returns the map
+*/
+Map *sessionMap(Session *s)
+{
+    return s->map;
+}
+
+/**
+* End a session, running anything still held back first and writing out all its output.
+* The map is left alone.
+* @param s session to end
+*/
+void freeSession(Session *s)
+{
+    if (s->batch.count > 0) {
+        runBatch(s);
+    }
+    sessionFlush(s);
+    for (int i = 0; i < TIMED_COMMANDS; i++) {
+        freeHistogram(s->latency[i]);
+    }
+    free(s);
+}
@@ -0,0 +1,87 @@
+/**
+ * @file command.h
+ * @author David Mond (dmmond)
+ * Header file for command.c, runs streams of driver commands against a map.
+*/
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include "map.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+/** Session option to make concurrent maps when loading snapshots. */
+#define SESSION_CONCURRENT 1
+
+/** Session option to run runs of set or get commands together as batches. */
+#define SESSION_BATCH 2
+
+/** Session option for a map that can't be replaced by load or openflat, because other
+    sessions are using it too, its changes are being logged or it has a limit on its size. */
+#define SESSION_SHARED 4
+
+/** Session option to count every command run and time the map calls made
+    by sets, gets, removes and pluses, for the stats command and
+    sessionWriteMetrics(). */
+#define SESSION_METRICS 8
+
+/** Session option to have the map expire keys by a clock that starts at zero
+    and only moves when an advance command says how many seconds go by, so
+    runs with keys that expire come out the same every time. */
+#define SESSION_TEST_CLOCK 16
+
+/** Incomplete type for a stream of commands being run. */
+typedef struct SessionStruct Session;
+
+/** Start a session and print the first prompt.  A session's output is
+    held in a buffer until it fills up, sessionFlush() is called or the
+    session ends.
+    @param m Map to run the commands against.  The session doesn't own it.
+    @param kind MAP_TRIE or MAP_HASH, for maps loaded from snapshot files.
+    @param flags Any of the SESSION_ options, or'ed together.
+    @param out Where to print the output.
+    @return pointer to the new session.
+*/
+Session *makeSession( Map *m, int kind, int flags, FILE *out );
+
+/** Run one command.  The command is echoed, followed by its output, a
+    blank line and the next prompt.  With SESSION_BATCH, sets and gets may
+    be held back and printed later, still in order.
+    @param s Session to run the command in.
+    @param line Command line without its newline.  The session may change
+    its characters while running it, but doesn't keep it or free it.
+    @return false if the command was quit.
+*/
+bool runLine( Session *s, char *line );
+
+/** Write out any output the session is holding.  The stream itself isn't
+    flushed.
+    @param s Session to flush.
+*/
+void sessionFlush( Session *s );
+
+/** Write the counts and latencies a session with SESSION_METRICS has
+    collected, along with the node and allocator counts for its map, as
+    one line of JSON.  Commands still held back are run first, so they're
+    counted.  The stats command prints the same line.
+    @param s Session to report on.
+    @param fp Stream to write to.
+    @return false if the session isn't collecting metrics.
+*/
+bool sessionWriteMetrics( Session *s, FILE *fp );
+
+/** Get the map a session is running against.  A load or openflat command
+    replaces the session's map, after freeing the old one.
+    @param s Session to check.
+    @return the session's map.
+*/
+Map *sessionMap( Session *s );
+
+/** End a session, running and printing any commands still held back.
+    The session's map isn't freed.
+    @param s Session to end.
+*/
+void freeSession( Session *s );
+
+#endif
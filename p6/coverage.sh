@@ -12,11 +12,68 @@ make
 rm -f *.gcda
 
 echo "Running test inputs given with the starter"
-for i in 01 02 03 04 05 06 07 08 09 10 11
+for i in 01 02 03 04 05 06 07 08 09 10 11 12
 do
     echo "./driver < input-$i.txtt"
     ./driver < input-$i.txt > output.txt
 done
+echo "./driver -intern < input-13.txt"
+./driver -intern < input-13.txt > output.txt
+echo "./driver -maxkeys 3 < input-14.txt"
+./driver -maxkeys 3 < input-14.txt > output.txt
+echo "./driver -maxkeys 3 -evict clock < input-15.txt"
+./driver -maxkeys 3 -evict clock < input-15.txt > output.txt
+rm -f test.log
+for i in 16 17
+do
+    echo "./driver -maxkeys 2 -log test.log < input-$i.txt"
+    ./driver -maxkeys 2 -log test.log < input-$i.txt > output.txt
+done
+rm -f test.log
+echo "./driver -testclock < input-18.txt"
+./driver -testclock < input-18.txt > output.txt
+rm -f test.log
+for i in 20 21
+do
+    echo "./driver -log test.log -testclock < input-$i.txt"
+    ./driver -log test.log -testclock < input-$i.txt > output.txt
+done
+rm -f test.log
+echo "./driver -metrics metrics.txt < input-19.txt"
+./driver -metrics metrics.txt < input-19.txt > output.txt
+rm -f metrics.txt
+for i in 22 23
+do
+    echo "./driver < input-$i.txt"
+    ./driver < input-$i.txt > output.txt
+done
+rm -f test.snap
+rm -f test.flat
+echo "./driver < input-24.txt"
+./driver < input-24.txt > output.txt
+echo "./driver -flat test.flat < input-25.txt"
+./driver -flat test.flat < input-25.txt > output.txt
+rm -f test.flat
+echo "./driver < input-26.txt"
+./driver < input-26.txt > output.txt
+for i in 06 12 22
+do
+    echo "./driver -hash < input-$i.txt"
+    ./driver -hash < input-$i.txt > output.txt
+done
+for i in 06 12 22 23
+do
+    echo "./driver -concurrent < input-$i.txt"
+    ./driver -concurrent < input-$i.txt > output.txt
+done
+rm -f test.snap
+rm -f test.log
+for i in 27 28 29
+do
+    echo "./driver -log test.log < input-$i.txt"
+    ./driver -log test.log < input-$i.txt > output.txt
+done
+rm -f test.log
 
 # Run the student-generated test cases.
 list=$(echo my-input-*.txt)
@@ -3,20 +3,80 @@
  * @author David Mond (dmmond)
  * Main part of the program, reads from standard in and makes a map that can use many commands.
  * These commands can set variables, get variables, remove, or add. driver.c handles all this logic and returns with exit success or failure.
+ * Flags:
+ *   -hash                 store the map in a hash table instead of a trie
+ *   -batch                run consecutive sets or gets together through the batch functions
+ *   -concurrent           use the thread-safe striped map
+ *   -intern               store each different string value once
+ *   -flat file            open a flat trie file as a read-only map
+ *   -log file             rebuild the map from a write-ahead log and log every change
+ *   -durability level     how often the log reaches disk: buffered, group (default) or sync
+ *   -server socket        serve many clients over a Unix domain socket instead of standard input
+ *   -threads n            number of workers for -server
+ *   -maxkeys n            make the map a cache that holds at most n keys
+ *   -maxbytes n           make the map a cache that holds at most n bytes
+ *   -evict policy         which keys a cache evicts: lru (default) or clock
+ *   -metrics file         count commands, time map calls and write them to the file as JSON
+ *   -testclock            expire keys only when an advance command moves the clock
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "map.h"
-#include "value.h"
+#include "command.h"
+#include "server.h"
 #include "input.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <unistd.h>
+
+/** Default number of worker threads for the server. */
+#define SERVER_THREADS 8
 
-/** Length of buffer. */
-#define BUFFER 1024
-/** Number for sscanf matches. */
-#define ARG 2
+/** Message for command-line arguments the driver doesn't understand. */
+#define USAGE "usage: driver [-hash] [-batch] [-concurrent] [-intern] [-flat file] [-log file [-durability buffered|group|sync]] [-server socket [-threads n]] [-maxkeys n] [-maxbytes n] [-evict lru|clock] [-metrics file] [-testclock]\n"
+
+/**
+* Turn the name of a durability level into one of the MAP_LOG_ levels.
+* @param name name of the level
+* @return returns the level, or -1 if the name isn't a level
+*/
+static int parseDurability(char const *name)
+{
+    if (strcmp(name, "buffered") == 0)
+        return MAP_LOG_BUFFERED;
+    if (strcmp(name, "group") == 0)
+        return MAP_LOG_GROUP;
+    if (strcmp(name, "sync") == 0)
+        return MAP_LOG_SYNC;
+    return -1;
+}
+
+/**
+* Turn the name of an eviction policy into one of the MAP_EVICT_ policies.
+* @param name name of the policy
+* @return returns the policy, or -1 if the name isn't a policy
+*/
+static int parsePolicy(char const *name)
+{
+    if (strcmp(name, "lru") == 0)
+        return MAP_EVICT_LRU;
+    if (strcmp(name, "clock") == 0)
+        return MAP_EVICT_CLOCK;
+    return -1;
+}
+
+/**
+* Tell the user the log has failed, so changes since then won't survive a restart.
+* @param logFile name of the log file
+* @param err error the log failed with
+*/
+static void reportLog(char const *logFile, int err)
+{
+    fflush(stdout);
+    fprintf(stderr, "Can't write %s: %s\n", logFile, strerror(err));
+}
 
 /** Main method that handles all commands for the map. Returns an integer for exit success or failure.
 * @param argc number of arguments that is being passed
@@ -26,130 +86,135 @@
 int main(int argc, char *argv[]) 
 {
     FILE *fp = stdin;
-    //Create the map
-    Map *m = makeMap();
+    //Pick the map implementation and batching from the command line
+    int kind = MAP_TRIE;
+    bool batching = false;
+    bool concurrent = false;
+    char const *flatFile = NULL;
+    char const *socketPath = NULL;
+    int threads = SERVER_THREADS;
+    char const *logFile = NULL;
+    int durability = MAP_LOG_GROUP;
+    int maxKeys = 0;
+    long maxBytes = 0;
+    int policy = MAP_EVICT_LRU;
+    char const *metricsFile = NULL;
+    bool testClock = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-hash") == 0) {
+            kind = MAP_HASH;
+        } else if (strcmp(argv[i], "-batch") == 0) {
+            batching = true;
+        } else if (strcmp(argv[i], "-concurrent") == 0) {
+            concurrent = true;
+        } else if (strcmp(argv[i], "-intern") == 0) {
+            setStringInterning(true);
+        } else if (strcmp(argv[i], "-flat") == 0 && i + 1 < argc) {
+            flatFile = argv[++i];
+        } else if (strcmp(argv[i], "-server") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-log") == 0 && i + 1 < argc) {
+            logFile = argv[++i];
+        } else if (strcmp(argv[i], "-durability") == 0 && i + 1 < argc && parseDurability(argv[i + 1]) >= 0) {
+            durability = parseDurability(argv[++i]);
+        } else if (strcmp(argv[i], "-maxkeys") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            maxKeys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-maxbytes") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            maxBytes = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-evict") == 0 && i + 1 < argc && parsePolicy(argv[i + 1]) >= 0) {
+            policy = parsePolicy(argv[++i]);
+        } else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } else if (strcmp(argv[i], "-testclock") == 0) {
+            testClock = true;
+        } else {
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+    }
+    //Only a plain trie can be a cache, and only the driver's own session collects metrics
+    bool bounded = maxKeys > 0 || maxBytes > 0;
+    if ((bounded && (kind == MAP_HASH || concurrent || flatFile || socketPath)) || (metricsFile && socketPath)) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    //Serve clients over a socket, sharing one thread-safe map between them
+    if (socketPath) {
+        Map *m = makeConcurrentMap(kind);
+        if (logFile && !mapOpenLog(m, logFile, durability)) {
+            fprintf(stderr, "Can't open %s\n", logFile);
+            freeMap(m);
+            return EXIT_FAILURE;
+        }
+        int status = runServer(socketPath, threads, m, kind);
+        int logError = mapCloseLog(m);
+        if (logError)
+            reportLog(logFile, logError);
+        freeMap(m);
+        return logError ? EXIT_FAILURE : status;
+    }
+
+    //Create the map, or open it read-only from a flat trie file
+    Map *m = flatFile ? mapOpenFlat(flatFile) : concurrent ? makeConcurrentMap(kind) : makeMapOfKind(kind);
+    if (!m) {
+        fprintf(stderr, "Can't open %s\n", flatFile);
+        return EXIT_FAILURE;
+    }
+    //Limit the map before anything goes into it, even from its log
+    if (bounded)
+        mapSetCapacity(m, maxKeys, maxBytes, policy);
+    //Open the metrics file up front, so a bad name is caught before any commands run
+    FILE *metrics = metricsFile ? fopen(metricsFile, "w") : NULL;
+    if (metricsFile && !metrics) {
+        fprintf(stderr, "Can't open %s\n", metricsFile);
+        freeMap(m);
+        return EXIT_FAILURE;
+    }
+    int flags = (concurrent ? SESSION_CONCURRENT : 0) | (batching ? SESSION_BATCH : 0) | (logFile || bounded ? SESSION_SHARED : 0) |
+                (metrics ? SESSION_METRICS : 0) | (testClock ? SESSION_TEST_CLOCK : 0);
+    Session *s = makeSession(m, kind, flags, stdout);
+    //Rebuild the map from its log once the session has given it its clock, since the log has
+    //deadlines for keys that expire. After this, load and openflat can't swap in an unlogged map
+    if (logFile && !mapOpenLog(m, logFile, durability)) {
+        fprintf(stderr, "Can't open %s\n", logFile);
+        freeSession(s);
+        if (metrics)
+            fclose(metrics);
+        freeMap(m);
+        return EXIT_FAILURE;
+    }
+    bool interactive = isatty(fileno(fp));
+    LineReader *in = makeLineReader(fileno(fp));
     char *line;
-    printf("cmd> ");
+    bool logFailed = false;
     //Keep processing commands while you can read a line
-    while ((line = readLine(fp)) != NULL) {
-        printf("%s\n", line);
-
-        char command[BUFFER];
-        char key[BUFFER];
-        char valueStr[BUFFER];
-        //Commands
-        if (sscanf(line, "%99s", command) == 1) {
-            //Exit program
-            if (strcmp(command, "quit") == 0) {
-                free(line);
-                break;
-            //Get size
-            } 
-            else if (strcmp(command, "size") == 0) {
-                printf("%d\n", mapSize(m));
-            //Set variable
-            } 
-            else if (strcmp(command, "set") == 0) {
-                if (sscanf(line, "%*s %1024s %1023s", key, valueStr) == ARG){
-                    bool valid = true;
-                    for (int i = 0; key[i]; i++) {
-                        if (!isprint((unsigned char)key[i])) {
-                            valid = false;
-                            printf("invalid\n");
-                            continue;
-                        }
-                    }
-                    Value *val = NULL;
-                    if(valid) {
-                        //Either int or double
-                        if (isdigit(valueStr[0]) || valueStr[0] == '-' || valueStr[0] == '+') {
-                            val = parseInteger(valueStr) ?: parseDouble(valueStr);
-                            //If starts with a quote, its a string
-                        } 
-                        else if (valueStr[0] == '\"') {
-                            val = parseString(valueStr);
-                        }
-                        if (val) {
-                            mapSet(m, key, val);
-                        }
-                        else { 
-                            printf("invalid\n");
-                        }
-                    }
-                }
-            } else if (strcmp(command, "get") == 0) {
-                // Skip past get
-                char *keyStart = line + strlen("get ");
-                
-                // Skip any initial whitespace
-                while (*keyStart && isspace((unsigned char)*keyStart)) {
-                    keyStart++;
-                }
-
-                // Invalid if its just get
-                if (*keyStart == '\0') {
-                    printf("invalid\n");
-                } else {
-                    // Find the end of the key which is the end of the line.
-                    char *keyEnd = keyStart;
-                    while (*keyEnd && *keyEnd != '\n' && *keyEnd != '\r') {
-                        keyEnd++;
-                    }
-
-                    // Compute the key length
-                    size_t keyLen = keyEnd - keyStart;
-
-                    if (keyLen < sizeof(key) - 1) {
-                        // Copy the key and null terminate it
-                        memcpy(key, keyStart, keyLen);
-                        key[keyLen] = '\0';
-
-                        Value *val = mapGet(m, key);
-                        if (val) {
-                            // Convert the value to a string and print it
-                            char *valStr = val->toString(val);
-                            printf("%s\n", valStr);
-                            free(valStr);
-                        } else {
-                            printf("invalid\n");
-                        }
-                    }
-                }
-                //Handle remove command
-            } else if (strcmp(command, "remove") == 0) {
-                if (sscanf(line, "%*s %1023s", key) == 1) {
-                    mapRemove(m, key);
-                }
-                // Handle Plus command
-            } else if (strcmp(command, "plus") == 0) {
-                if (sscanf(line, "%*s %1023s %1023s", key, valueStr) == ARG) {
-                    Value *val1 = mapGet(m, key);
-                    Value *addVal = NULL;
-                    if (isdigit(valueStr[0]) || valueStr[0] == '-' || valueStr[0] == '+' || valueStr[0] == ' ') {
-                        addVal = parseInteger(valueStr) ? : parseDouble(valueStr);
-                    } else if (valueStr[0] == '\"') {
-                        addVal = parseString(valueStr);
-                    }
-
-                    // Check if both values are not NULL and are the same type
-                    if (val1 && addVal && val1->toString == addVal->toString) {
-                        val1->plus(val1, addVal);
-                    } else {
-                        printf("invalid\n");
-                    }
-
-                    //Free the temporary value created for addition
-                    if (addVal) {
-                        destroyValue(addVal);
-                    }
-                }
-            }
+    do {
+        //Someone typing the commands needs to see each prompt before typing the next one
+        if (interactive) {
+            sessionFlush(s);
+            fflush(stdout);
         }
-        printf("\n");
-        printf("cmd> ");
-        free(line);
-    }
+        //Say so as soon as changes stop making it into the log
+        if (logFile && !logFailed && mapLogError(sessionMap(s))) {
+            logFailed = true;
+            sessionFlush(s);
+            reportLog(logFile, mapLogError(sessionMap(s)));
+        }
+    } while ((line = nextLine(in, NULL)) != NULL && runLine(s, line));
+    freeLineReader(in);
 
+    //Anything still held back runs when the input ends, before the metrics are written
+    if (metrics) {
+        sessionWriteMetrics(s, metrics);
+        fclose(metrics);
+    }
+    m = sessionMap(s);
+    freeSession(s);
+    int logError = mapCloseLog(m);
+    if (logError && !logFailed)
+        reportLog(logFile, logError);
     freeMap(m);
-    return EXIT_SUCCESS;
+    return logError ? EXIT_FAILURE : EXIT_SUCCESS;
 }
\ No newline at end of file
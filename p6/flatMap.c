@@ -0,0 +1,633 @@
+/**
+ * @file flatMap.c
+ * @author David Mond (dmmond)
+ * Read-only trie stored as one flat block of bytes, used as the flat backend for a Map.
+ * Nothing in the file is a pointer: nodes find their children through byte offsets from the
+ * start of the file, so the file is mapped into memory and searched right where it is, with
+ * nothing to build first. Processes that open the same file share its pages.
+ *
+ * Every number is stored little-endian. The file starts with a header:
+ *   magic "P6FT", then 4-byte words for the version, the key count, the offset of the root
+ *   node (0 if there are no keys) and the offset of the value table
+ * Then come the nodes, each starting on a 4-byte boundary, with every child before its parent:
+ *   4-byte value index plus one (0 for no value), 4-byte label length, 1-byte child count,
+ *   the label, the children's symbols in order, padding to a 4-byte boundary, then a 4-byte
+ *   offset for each child
+ * The value table has a 4-byte offset for each key's value, in key order, followed by the
+ * values themselves: a type byte, then a 4-byte integer, an 8-byte double, or a 4-byte length
+ * and the characters of a string. Values are only turned into Value objects when they're
+ * first looked up.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "flatMap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Characters every flat trie file starts with. */
+#define MAGIC "P6FT"
+/** Length of the magic string. */
+#define MAGIC_LEN 4
+/** Version of the file layout written by this code. */
+#define VERSION 1
+/** Where the version is in the header. */
+#define VERSION_AT 4
+/** Where the key count is in the header. */
+#define COUNT_AT 8
+/** Where the root node's offset is in the header. */
+#define ROOT_AT 12
+/** Where the value table's offset is in the header. */
+#define VALUES_AT 16
+/** Bytes in the header. */
+#define HEADER_LEN 20
+/** Bytes in a word, and the alignment of every node. */
+#define WORD 4
+/** Bytes at the start of a node before its label. */
+#define NODE_FIXED 9
+/** Where the label length is in a node. */
+#define LABEL_LEN_AT 4
+/** Where the child count is in a node. */
+#define CHILD_COUNT_AT 8
+/** Most children a node can have, one for each symbol a key can use. */
+#define MAX_CHILDREN ( '~' - '!' + 1 )
+/** Bytes in a stored double. */
+#define DOUBLE_BYTES 8
+/** Bits in a byte. */
+#define BYTE_BITS 8
+/** Initial capacity of the write buffer. */
+#define BUFFER_START 4096
+/** Initial number of frames for the walk in flatSorted(). */
+#define STACK_START 64
+
+/** Representation of an open flat trie. */
+struct FlatMapStruct {
+  /** The mapped file. */
+  unsigned char const *data;
+
+  /** Size of the file. */
+  size_t size;
+
+  /** Number of keys. */
+  uint32_t count;
+
+  /** Offset of the root node, or 0 if there are no keys. */
+  uint32_t root;
+
+  /** Offset of the value table, which is also where the nodes end. */
+  uint32_t values;
+
+  /** Value for each key, built the first time it's looked up and empty until then. */
+  Value *vals;
+};
+
+/** Fields of a node, read out of the file. */
+typedef struct {
+  /** Index of the node's value plus one, or 0 if it has none. */
+  uint32_t val;
+
+  /** Length of the node's label. */
+  uint32_t labelLen;
+
+  /** Number of children. */
+  int childCount;
+
+  /** The label, which isn't null terminated. */
+  char const *label;
+
+  /** Symbol for each child, in increasing order. */
+  unsigned char const *sym;
+
+  /** Offset of each child, one word each. */
+  unsigned char const *child;
+} FlatNode;
+
+/**
+* Read a little-endian word.
+* @param p where the word is
+* @return returns the word
+*/
+static uint32_t readWord(unsigned char const *p)
+{
+  return p[0] | (uint32_t) p[1] << BYTE_BITS | (uint32_t) p[2] << (2 * BYTE_BITS) |
+         (uint32_t) p[3] << (3 * BYTE_BITS);
+}
+
+/**
+* Work out how much room a node takes up.
+* @param labelLen length of the node's label
+* @param childCount number of children
+* @return returns the bytes used by the node, including the padding before its child offsets
+*/
+static size_t nodeBytes(size_t labelLen, int childCount)
+{
+  size_t before = NODE_FIXED + labelLen + childCount;
+  return (before + WORD - 1) / WORD * WORD + (size_t) childCount * WORD;
+}
+
+/**
+* Read the node at an offset, making sure it lies inside the node part of the file.
+* @param f trie to read from
+* @param off offset of the node
+* @param n filled in with the node's fields
+* @return returns false if the offset doesn't hold a valid node
+*/
+static bool readNode(FlatMap const *f, uint32_t off, FlatNode *n)
+{
+  if (off < HEADER_LEN || off % WORD != 0 || off >= f->values || f->values - off < NODE_FIXED)
+    return false;
+  unsigned char const *p = f->data + off;
+  n->val = readWord(p);
+  n->labelLen = readWord(p + LABEL_LEN_AT);
+  n->childCount = p[CHILD_COUNT_AT];
+  if (n->val > f->count || n->labelLen > f->values - off ||
+      nodeBytes(n->labelLen, n->childCount) > f->values - off)
+    return false;
+  n->label = (char const *) p + NODE_FIXED;
+  n->sym = p + NODE_FIXED + n->labelLen;
+  n->child = p + nodeBytes(n->labelLen, n->childCount) - (size_t) n->childCount * WORD;
+  return true;
+}
+
+/**
+* Find the child for a symbol with a binary search.
+* @param n node to look in
+* @param sym symbol to look for
+* @return returns the child's offset, or 0 if there's no child for the symbol
+*/
+static uint32_t findChild(FlatNode const *n, unsigned char sym)
+{
+  int lo = 0, hi = n->childCount;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (n->sym[mid] < sym)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < n->childCount && n->sym[lo] == sym)
+    return readWord(n->child + (size_t) lo * WORD);
+  return 0;
+}
+
+/**
+* Check that a node's label matches the start of a key.
+* @param n node whose label to check
+* @param key rest of the key being looked up
+* @return returns true if the key starts with the whole label
+*/
+static bool matchLabel(FlatNode const *n, char const *key)
+{
+  for (uint32_t i = 0; i < n->labelLen; i++)
+    if (key[i] == '\0' || key[i] != n->label[i])
+      return false;
+  return true;
+}
+
+/**
+* Get the value for a key index, building it from the file the first time.
+* @param f trie the value is in
+* @param index index of the key
+* @return returns the value, or NULL if the file's copy of it is bad
+*/
+static Value *valueAt(FlatMap *f, uint32_t index)
+{
+  Value *v = &f->vals[index];
+  if (!valueEmpty(v))
+    return v;
+
+  size_t off = readWord(f->data + f->values + (size_t) index * WORD);
+  if (off >= f->size)
+    return NULL;
+  unsigned char const *p = f->data + off;
+  size_t left = f->size - off - 1;
+  int type = *p++;
+  if (type == VALUE_INT && left >= WORD) {
+    initInteger(v, (int32_t) readWord(p));
+  } else if (type == VALUE_DOUBLE && left >= DOUBLE_BYTES) {
+    uint64_t bits = readWord(p) | (uint64_t) readWord(p + WORD) << (WORD * BYTE_BITS);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    initDouble(v, d);
+  } else if (type == VALUE_STRING && left >= WORD && readWord(p) <= left - WORD) {
+    initString(v, (char const *) p + WORD, readWord(p));
+  } else {
+    return NULL;
+  }
+  return v;
+}
+
+/**
+* Open a flat trie file
+* @param path name of the file
+* @return returns the open trie, or NULL if the file isn't a flat trie
+*/
+FlatMap *openFlatMap(char const *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < HEADER_LEN || (uint64_t) st.st_size > UINT32_MAX) {
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  FlatMap *f = malloc(sizeof(FlatMap));
+  f->data = data;
+  f->size = st.st_size;
+  f->count = readWord(f->data + COUNT_AT);
+  f->root = readWord(f->data + ROOT_AT);
+  f->values = readWord(f->data + VALUES_AT);
+  f->vals = NULL;
+  //The value table has to fit after the nodes
+  if (memcmp(f->data, MAGIC, MAGIC_LEN) != 0 || readWord(f->data + VERSION_AT) != VERSION ||
+      f->values < HEADER_LEN || f->values > f->size ||
+      f->count > (f->size - f->values) / WORD || (f->count > 0) != (f->root != 0)) {
+    closeFlatMap(f);
+    return NULL;
+  }
+  f->vals = calloc(f->count + 1, sizeof(Value));
+  return f;
+}
+
+/**
+* Report the number of keys
+* @param f trie to check
+* @return returns the number of keys
+*/
+int flatCount(FlatMap *f)
+{
+  return f->count;
+}
+
+/**
+* Look up a key, following one node per loop iteration
+* @param f trie to look in
+* @param key key to look for
+* @return returns the value, or NULL if the key isn't there
+*/
+Value *flatGet(FlatMap *f, char const *key)
+{
+  uint32_t off = f->root;
+  FlatNode n;
+  while (off && readNode(f, off, &n)) {
+    //The whole label has to match
+    if (!matchLabel(&n, key))
+      return NULL;
+    key += n.labelLen;
+    if (*key == '\0')
+      return n.val ? valueAt(f, n.val - 1) : NULL;
+    uint32_t child = findChild(&n, *key);
+    //Children always come before their parent, so a bad file can't send us in circles
+    if (child >= off)
+      return NULL;
+    off = child;
+    key++;
+  }
+  return NULL;
+}
+
+/** One node on the path of the walk in flatSorted(). */
+typedef struct {
+  /** The node. */
+  FlatNode node;
+
+  /** Offset of the node. */
+  uint32_t off;
+
+  /** Next child to visit, or -1 if the node's own value hasn't been visited yet. */
+  int next;
+
+  /** Length of the key up to the end of the node's label. */
+  size_t len;
+} FlatFrame;
+
+/**
+* Make sure a key buffer has room for a key of the given length, plus a null terminator.
+* @param key buffer to grow
+* @param cap capacity of the buffer
+* @param len length of key that needs to fit
+*/
+static void reserve(char **key, size_t *cap, size_t len)
+{
+  if (len + 1 > *cap) {
+    while (len + 1 > *cap)
+      *cap *= 2;
+    *key = realloc(*key, *cap);
+  }
+}
+
+/**
+* Check whether everything under a node could be wanted by a walk.
+* @param key key up to the end of the node's label
+* @param len length of that key
+* @param prefix required prefix, or NULL
+* @param low smallest wanted key, or NULL
+* @return returns false if no key under the node can have the prefix or be at least low
+*/
+static bool wanted(char const *key, size_t len, char const *prefix, char const *low)
+{
+  if (prefix) {
+    size_t plen = strlen(prefix);
+    if (strncmp(key, prefix, len < plen ? len : plen) != 0)
+      return false;
+  }
+  //Unless the key so far leads toward low, every key down here is either all smaller or all bigger
+  if (low && strncmp(low, key, len) != 0 && strcmp(key, low) < 0)
+    return false;
+  return true;
+}
+
+/**
+* Collect the pairs a cursor should visit, in order
+* @param f trie to look in
+* @param prefix required key prefix, or NULL
+* @param low smallest key, or NULL
+* @param high largest key, or NULL
+* @param count set to the number of pairs found
+* @param text set to the block holding the keys
+* @return returns the sorted pairs
+*/
+HashPair *flatSorted(FlatMap *f, char const *prefix, char const *low, char const *high,
+                     int *count, char **text)
+{
+  HashPair *pairs = malloc((f->count + 1) * sizeof(HashPair));
+  size_t *start = malloc((f->count + 1) * sizeof(size_t));
+  size_t textLen = 0, textCap = BUFFER_START;
+  *text = malloc(textCap);
+  int n = 0;
+
+  //Key for the current node
+  size_t keyCap = BUFFER_START;
+  char *key = malloc(keyCap);
+  int top = 0, cap = STACK_START;
+  FlatFrame *stack = malloc(cap * sizeof(FlatFrame));
+
+  FlatNode root;
+  if (f->root && readNode(f, f->root, &root)) {
+    reserve(&key, &keyCap, root.labelLen);
+    memcpy(key, root.label, root.labelLen);
+    key[root.labelLen] = '\0';
+    if (wanted(key, root.labelLen, prefix, low))
+      stack[top++] = (FlatFrame) { root, f->root, -1, root.labelLen };
+  }
+
+  while (top > 0 && n < (int) f->count) {
+    FlatFrame *fr = &stack[top - 1];
+    if (fr->next < 0) {
+      //Visit the node's own value before its children
+      fr->next = 0;
+      key[fr->len] = '\0';
+      if (!fr->node.val || (prefix && fr->len < strlen(prefix)) || (low && strcmp(key, low) < 0))
+        continue;
+      //Everything after this is bigger too
+      if (high && strcmp(key, high) > 0)
+        break;
+      Value *v = valueAt(f, fr->node.val - 1);
+      if (!v)
+        continue;
+      reserve(text, &textCap, textLen + fr->len);
+      memcpy(*text + textLen, key, fr->len + 1);
+      start[n] = textLen;
+      pairs[n++].val = v;
+      textLen += fr->len + 1;
+      continue;
+    }
+
+    if (fr->next == fr->node.childCount) {
+      top--;
+      continue;
+    }
+    int i = fr->next++;
+    uint32_t off = readWord(fr->node.child + (size_t) i * WORD);
+    FlatNode child;
+    if (off >= fr->off || !readNode(f, off, &child))
+      continue;
+
+    //Extend the key with the branch symbol and the child's label
+    size_t len = fr->len + 1 + child.labelLen;
+    reserve(&key, &keyCap, len);
+    key[fr->len] = fr->node.sym[i];
+    memcpy(key + fr->len + 1, child.label, child.labelLen);
+    key[len] = '\0';
+    if (!wanted(key, len, prefix, low))
+      continue;
+    if (top == cap) {
+      cap *= 2;
+      stack = realloc(stack, cap * sizeof(FlatFrame));
+    }
+    stack[top++] = (FlatFrame) { child, off, -1, len };
+  }
+
+  //The keys are all in place now, so they can't move any more
+  for (int i = 0; i < n; i++)
+    pairs[i].key = *text + start[i];
+  free(stack);
+  free(key);
+  free(start);
+  *count = n;
+  return pairs;
+}
+
+/**
+* Measure the trie
+* @param f trie to measure
+* @return returns the size of the file plus the value table
+*/
+long flatBytes(FlatMap *f)
+{
+  return sizeof(FlatMap) + f->size + (f->count + 1) * sizeof(Value);
+}
+
+/**
+* Close a trie, freeing every value that was built from it
+* @param f trie to close
+*/
+void closeFlatMap(FlatMap *f)
+{
+  if (f->vals) {
+    for (uint32_t i = 0; i < f->count; i++)
+      clearValue(&f->vals[i]);
+    free(f->vals);
+  }
+  munmap((void *) f->data, f->size);
+  free(f);
+}
+
+/** Growable block of bytes for building a file. */
+typedef struct {
+  /** The bytes. */
+  unsigned char *data;
+
+  /** Number of bytes used, and room for. */
+  size_t len, cap;
+} Buffer;
+
+/**
+* Make room for more bytes at the end of a buffer.
+* @param b buffer to grow
+* @param more number of bytes needed
+* @return returns where the new bytes go
+*/
+static unsigned char *extend(Buffer *b, size_t more)
+{
+  if (b->len + more > b->cap) {
+    while (b->len + more > b->cap)
+      b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  unsigned char *p = b->data + b->len;
+  memset(p, 0, more);
+  b->len += more;
+  return p;
+}
+
+/**
+* Store a little-endian word.
+* @param p where to put it
+* @param x word to store
+*/
+static void putWord(unsigned char *p, uint32_t x)
+{
+  for (int i = 0; i < WORD; i++)
+    p[i] = x >> (i * BYTE_BITS);
+}
+
+/**
+* Write the node for a range of sorted keys, after writing all of its children. The keys
+* in the range all start with the same depth characters.
+* @param b buffer to write to
+* @param keys sorted keys
+* @param lo index of the first key in the range
+* @param hi index just past the last key in the range
+* @param depth number of characters already handled by the node's ancestors
+* @return returns the offset of the node
+*/
+static uint32_t writeNode(Buffer *b, char **keys, int lo, int hi, size_t depth)
+{
+  //Keys are sorted, so the first and last share the prefix of the whole range
+  char const *first = keys[lo], *last = keys[hi - 1];
+  size_t end = depth;
+  while (first[end] && first[end] == last[end])
+    end++;
+
+  uint32_t val = 0;
+  int i = lo;
+  if (first[end] == '\0')
+    val = ++i;
+
+  //Children are written first, grouped by the symbol after the label
+  unsigned char sym[MAX_CHILDREN];
+  uint32_t child[MAX_CHILDREN];
+  int count = 0;
+  while (i < hi) {
+    int j = i + 1;
+    while (j < hi && keys[j][end] == keys[i][end])
+      j++;
+    sym[count] = keys[i][end];
+    child[count++] = writeNode(b, keys, i, j, end + 1);
+    i = j;
+  }
+
+  size_t labelLen = end - depth;
+  uint32_t off = b->len;
+  unsigned char *p = extend(b, nodeBytes(labelLen, count));
+  putWord(p, val);
+  putWord(p + LABEL_LEN_AT, labelLen);
+  p[CHILD_COUNT_AT] = count;
+  memcpy(p + NODE_FIXED, first + depth, labelLen);
+  memcpy(p + NODE_FIXED + labelLen, sym, count);
+  p += nodeBytes(labelLen, count) - (size_t) count * WORD;
+  for (int k = 0; k < count; k++)
+    putWord(p + (size_t) k * WORD, child[k]);
+  return off;
+}
+
+/**
+* Add a value to the end of a buffer.
+* @param b buffer to write to
+* @param v value to write
+*/
+static void writeValue(Buffer *b, Value const *v)
+{
+  int type = valueType(v);
+  *extend(b, 1) = type;
+  if (type == VALUE_INT) {
+    putWord(extend(b, WORD), (uint32_t) integerOf(v));
+  } else if (type == VALUE_DOUBLE) {
+    double d = doubleOf(v);
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    unsigned char *p = extend(b, DOUBLE_BYTES);
+    putWord(p, (uint32_t) bits);
+    putWord(p + WORD, (uint32_t) (bits >> (WORD * BYTE_BITS)));
+  } else {
+    char const *str = stringOf(v);
+    size_t len = stringLength(v);
+    putWord(extend(b, WORD), len);
+    memcpy(extend(b, len), str, len);
+  }
+}
+
+/**
+* Write a flat trie file from the pairs a cursor visits
+* @param c cursor over the pairs, in order
+* @param count number of pairs
+* @param path name of the file to write
+* @return returns true if the whole file was written
+*/
+bool writeFlatMap(MapCursor *c, int count, char const *path)
+{
+  //Copy out the keys, since the cursor only holds one at a time
+  char **keys = malloc((count + 1) * sizeof(char *));
+  Value **vals = malloc((count + 1) * sizeof(Value *));
+  char const *key;
+  Value *val;
+  int n = 0;
+  while (n < count && mapNext(c, &key, &val)) {
+    keys[n] = malloc(strlen(key) + 1);
+    strcpy(keys[n], key);
+    vals[n++] = val;
+  }
+
+  Buffer b = { malloc(BUFFER_START), 0, BUFFER_START };
+  unsigned char *header = extend(&b, HEADER_LEN);
+  memcpy(header, MAGIC, MAGIC_LEN);
+  uint32_t root = n ? writeNode(&b, keys, 0, n, 0) : 0;
+
+  uint32_t values = b.len;
+  extend(&b, (size_t) n * WORD);
+  for (int i = 0; i < n; i++) {
+    putWord(b.data + values + (size_t) i * WORD, b.len);
+    writeValue(&b, vals[i]);
+  }
+  putWord(b.data + VERSION_AT, VERSION);
+  putWord(b.data + COUNT_AT, n);
+  putWord(b.data + ROOT_AT, root);
+  putWord(b.data + VALUES_AT, values);
+
+  bool ok = false;
+  FILE *fp = b.len <= UINT32_MAX ? fopen(path, "wb") : NULL;
+  if (fp) {
+    ok = fwrite(b.data, 1, b.len, fp) == b.len;
+    ok = fclose(fp) == 0 && ok;
+  }
+
+  for (int i = 0; i < n; i++)
+    free(keys[i]);
+  free(keys);
+  free(vals);
+  free(b.data);
+  return ok;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file flatMap.h
+ * @author David Mond (dmmond)
+ * Header file for flatMap.c, a read-only trie stored as one flat, pointer-free block in a file.
+ * map.c uses it for maps opened with mapOpenFlat(), and these functions are only meant to be
+ * called from there.
+*/
+
+#ifndef FLATMAP_H
+#define FLATMAP_H
+
+#include "map.h"
+#include "hashMap.h"
+#include "value.h"
+#include <stdbool.h>
+
+/** Incomplete type for an open flat trie. */
+typedef struct FlatMapStruct FlatMap;
+
+/** Write the pairs a cursor visits as a flat trie file.
+    @param c Cursor over the pairs to write, which must visit them in order.
+    @param count Number of pairs the cursor will visit.
+    @param path Name of the file to write.
+    @return true if the whole file was written.
+*/
+bool writeFlatMap( MapCursor *c, int count, char const *path );
+
+/** Open a flat trie file by mapping it into memory.
+    @param path Name of the file to open.
+    @return the open trie, or NULL if the file can't be mapped or isn't a flat trie.
+*/
+FlatMap *openFlatMap( char const *path );
+
+/** Report the number of keys in a flat trie.
+    @param f Trie to check.
+    @return number of keys.
+*/
+int flatCount( FlatMap *f );
+
+/** Look up the value for a key.  Values are only built from the file the
+    first time they're looked up.
+    @param f Trie to look in.
+    @param key Key to look for.
+    @return the value, still owned by the trie, or NULL if the key isn't there.
+*/
+Value *flatGet( FlatMap *f, char const *key );
+
+/** Collect the pairs that match a prefix and fall in a range, sorted by key.
+    @param f Trie to look in.
+    @param prefix Only include keys with this prefix, or NULL.
+    @param low Smallest key to include, or NULL.
+    @param high Largest key to include, or NULL.
+    @param count Set to the number of pairs returned.
+    @param text Set to the block holding all the returned keys, for the caller to free.
+    @return dynamically allocated array of pairs, for the caller to free.
+*/
+HashPair *flatSorted( FlatMap *f, char const *prefix, char const *low, char const *high,
+                      int *count, char **text );
+
+/** Report the memory used by a flat trie.
+    @param f Trie to measure.
+    @return size of the mapped file plus the table of built values.
+*/
+long flatBytes( FlatMap *f );
+
+/** Unmap a flat trie and free the values built from it.
+    @param f Trie to close.
+*/
+void closeFlatMap( FlatMap *f );
+
+#endif
@@ -0,0 +1,289 @@
+/**
+ * @file hashMap.c
+ * @author David Mond (dmmond)
+ * Open-addressing hash table with Robin Hood probing, used as the hash backend for a Map.
+ * Each slot keeps the key's hash, so most mismatches are caught without comparing strings,
+ * and entries that are far from their home slot take spots from entries that are closer to
+ * theirs, which keeps every probe sequence short even when the table is nearly full.
+*/
+
+#include "hashMap.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Number of slots in a new table, always a power of two. */
+#define START_SLOTS 16
+
+/** The table grows once it's more than LOAD_NUM / LOAD_DEN full. */
+#define LOAD_NUM 7
+/** Denominator for the maximum load factor. */
+#define LOAD_DEN 8
+
+/** Starting value for the FNV-1a hash. */
+#define FNV_OFFSET 2166136261u
+/** Multiplier for the FNV-1a hash. */
+#define FNV_PRIME 16777619u
+
+/** One slot in the table. */
+typedef struct {
+  /** Key stored here, or NULL if the slot is empty. */
+  char *key;
+
+  /** Value for the key, stored right in the slot. */
+  Value val;
+
+  /** Hash of the key. */
+  unsigned int hash;
+} Slot;
+
+/** Representation of a hash table. */
+struct HashTableStruct {
+  /** Array of slots. */
+  Slot *slots;
+
+  /** Number of slots, a power of two. */
+  int cap;
+
+  /** Number of keys in the table. */
+  int count;
+
+  /** Bytes used to store copies of the keys. */
+  long keyBytes;
+};
+
+/**
+* Hash a key with FNV-1a.
+* @param key key to hash
+* @return returns the hash code
+*/
+static unsigned int hashKey(char const *key)
+{
+  unsigned int h = FNV_OFFSET;
+  for (; *key; key++) {
+    h ^= (unsigned char) *key;
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+/**
+* How far a slot's entry is from the slot its hash maps to.
+* @param t table the slot is in
+* @param i index of the slot
+* @return returns the probe distance
+*/
+static int probeDist(HashTable const *t, int i)
+{
+  return (i - (int) (t->slots[i].hash & (t->cap - 1))) & (t->cap - 1);
+}
+
+/**
+* Make a new table.
+* @return returns the empty table
+*/
+HashTable *makeHashTable()
+{
+  HashTable *t = malloc(sizeof(HashTable));
+  t->cap = START_SLOTS;
+  t->slots = calloc(t->cap, sizeof(Slot));
+  t->count = 0;
+  t->keyBytes = 0;
+  return t;
+}
+
+/**
+* Put an entry into a table that's known not to have its key, using Robin Hood placement.
+* @param t table to add to
+* @param s entry to add
+*/
+static void placeSlot(HashTable *t, Slot s)
+{
+  int mask = t->cap - 1;
+  int i = s.hash & mask;
+  int dist = 0;
+  while (t->slots[i].key) {
+    //Take the spot from an entry that's closer to home than we are
+    int other = probeDist(t, i);
+    if (other < dist) {
+      Slot tmp = t->slots[i];
+      t->slots[i] = s;
+      s = tmp;
+      dist = other;
+    }
+    i = (i + 1) & mask;
+    dist++;
+  }
+  t->slots[i] = s;
+}
+
+/**
+* Double the number of slots and put every entry back in.
+* @param t table to grow
+*/
+static void grow(HashTable *t)
+{
+  Slot *old = t->slots;
+  int oldCap = t->cap;
+  t->cap *= 2;
+  t->slots = calloc(t->cap, sizeof(Slot));
+  for (int i = 0; i < oldCap; i++)
+    if (old[i].key)
+      placeSlot(t, old[i]);
+  free(old);
+}
+
+/**
+* Find the slot holding a key.
+* @param t table to look in
+* @param key key to look for
+* @param hash hash of the key
+* @return returns the slot index, or -1 if the key isn't there
+*/
+static int findSlot(HashTable const *t, char const *key, unsigned int hash)
+{
+  int mask = t->cap - 1;
+  int i = hash & mask;
+  //An entry closer to home than we've probed means our key would have been placed before it
+  for (int dist = 0; t->slots[i].key && probeDist(t, i) >= dist; dist++) {
+    if (t->slots[i].hash == hash && strcmp(t->slots[i].key, key) == 0)
+      return i;
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+/**
+* Add or replace a key's value.
+* @param t table to add to
+* @param key key to add, which gets copied
+* @param val value for the key, which is moved into the table
+* @return returns true if the key is new
+*/
+bool hashSet(HashTable *t, char const *key, Value *val)
+{
+  unsigned int hash = hashKey(key);
+  int i = findSlot(t, key, hash);
+  if (i >= 0) {
+    moveValue(&t->slots[i].val, val);
+    return false;
+  }
+
+  if ((long) (t->count + 1) * LOAD_DEN > (long) t->cap * LOAD_NUM)
+    grow(t);
+  size_t len = strlen(key) + 1;
+  char *copy = malloc(len);
+  memcpy(copy, key, len);
+  Slot slot = { .key = copy, .hash = hash };
+  moveValue(&slot.val, val);
+  placeSlot(t, slot);
+  t->count++;
+  t->keyBytes += len;
+  return true;
+}
+
+/**
+* Look up a key.
+* @param t table to look in
+* @param key key to look for
+* @return returns the value, or NULL if it's not there
+*/
+Value *hashGet(HashTable *t, char const *key)
+{
+  int i = findSlot(t, key, hashKey(key));
+  return i >= 0 ? &t->slots[i].val : NULL;
+}
+
+/**
+* Remove a key, shifting the entries after it back a spot so no tombstone is needed.
+* @param t table to remove from
+* @param key key to remove
+* @return returns true if the key was there
+*/
+bool hashRemove(HashTable *t, char const *key)
+{
+  int i = findSlot(t, key, hashKey(key));
+  if (i < 0)
+    return false;
+
+  t->keyBytes -= strlen(t->slots[i].key) + 1;
+  free(t->slots[i].key);
+  clearValue(&t->slots[i].val);
+  t->count--;
+
+  //Pull back entries that aren't in their home slot
+  int mask = t->cap - 1;
+  int next = (i + 1) & mask;
+  while (t->slots[next].key && probeDist(t, next) > 0) {
+    t->slots[i] = t->slots[next];
+    i = next;
+    next = (next + 1) & mask;
+  }
+  t->slots[i] = (Slot) { .key = NULL };
+  return true;
+}
+
+/**
+* Compare two pairs by key, for qsort.
+* @param a pointer to the first pair
+* @param b pointer to the second pair
+* @return returns negative, zero or positive like strcmp
+*/
+static int comparePairs(void const *a, void const *b)
+{
+  return strcmp(((HashPair const *) a)->key, ((HashPair const *) b)->key);
+}
+
+/**
+* Collect and sort the entries a cursor should visit. A hash table has no order to
+* walk, so unlike the trie this has to look at every slot up front.
+* @param t table to look in
+* @param prefix required key prefix, or NULL
+* @param low smallest key, or NULL
+* @param high largest key, or NULL
+* @param count set to the number of pairs found
+* @return returns the sorted pairs
+*/
+HashPair *hashSorted(HashTable *t, char const *prefix, char const *low, char const *high, int *count)
+{
+  HashPair *pairs = malloc((t->count + 1) * sizeof(HashPair));
+  size_t prefixLen = prefix ? strlen(prefix) : 0;
+  int n = 0;
+  for (int i = 0; i < t->cap; i++) {
+    char const *key = t->slots[i].key;
+    if (!key)
+      continue;
+    if (prefix && strncmp(key, prefix, prefixLen) != 0)
+      continue;
+    if ((low && strcmp(key, low) < 0) || (high && strcmp(key, high) > 0))
+      continue;
+    pairs[n++] = (HashPair) { key, &t->slots[i].val };
+  }
+  qsort(pairs, n, sizeof(HashPair), comparePairs);
+  *count = n;
+  return pairs;
+}
+
+/**
+* Measure the table.
+* @param t table to measure
+* @return returns the bytes used by the table, its slots and its keys
+*/
+long hashBytes(HashTable *t)
+{
+  return sizeof(HashTable) + t->cap * sizeof(Slot) + t->keyBytes;
+}
+
+/**
+* Free a table and everything in it.
+* @param t table to free
+*/
+void freeHashTable(HashTable *t)
+{
+  for (int i = 0; i < t->cap; i++)
+    if (t->slots[i].key) {
+      free(t->slots[i].key);
+      clearValue(&t->slots[i].val);
+    }
+  free(t->slots);
+  free(t);
+}
@@ -0,0 +1,76 @@
+/**
+ * @file hashMap.h
+ * @author David Mond (dmmond)
+ * Header file for hashMap.c, an open-addressing hash table that map.c can use instead of the trie.
+ * The functions here are only meant to be called from map.c.
+*/
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "value.h"
+#include <stdbool.h>
+
+/** Incomplete type for the hash table representation. */
+typedef struct HashTableStruct HashTable;
+
+/** A key and its value, as handed out by hashSorted(). */
+typedef struct {
+  /** Key, still owned by the table. */
+  char const *key;
+
+  /** Value, still owned by the table. */
+  Value *val;
+} HashPair;
+
+/** Make an empty hash table.
+    @return pointer to the new table.
+*/
+HashTable *makeHashTable();
+
+/** Add a key / value pair or replace the value for a key that's already there.
+    The table makes its own copy of the key and moves the value into the key's slot.
+    @param t Table to add to.
+    @param key Key to add.
+    @param val Value to associate with the key, which is left empty.
+    @return true if the key is new, false if an old value was replaced.
+*/
+bool hashSet( HashTable *t, char const *key, Value *val );
+
+/** Look up the value for a key.
+    @param t Table to look in.
+    @param key Key to look for.
+    @return the value, which is only good until the table next changes, or
+    NULL if the key isn't in the table.
+*/
+Value *hashGet( HashTable *t, char const *key );
+
+/** Remove a key and free its value.
+    @param t Table to remove from.
+    @param key Key to remove.
+    @return true if the key was in the table.
+*/
+bool hashRemove( HashTable *t, char const *key );
+
+/** Collect the pairs that match a prefix and fall in a range, sorted by key.
+    @param t Table to look in.
+    @param prefix Only include keys with this prefix, or NULL.
+    @param low Smallest key to include, or NULL.
+    @param high Largest key to include, or NULL.
+    @param count Set to the number of pairs returned.
+    @return dynamically allocated array of pairs, for the caller to free.
+*/
+HashPair *hashSorted( HashTable *t, char const *prefix, char const *low, char const *high, int *count );
+
+/** Report the memory used by the table's slots and keys.
+    @param t Table to measure.
+    @return number of bytes used, not counting values.
+*/
+long hashBytes( HashTable *t );
+
+/** Free a hash table, along with all of its keys and values.
+    @param t Table to free.
+*/
+void freeHashTable( HashTable *t );
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * @file histogram.c
+ * @author David Mond (dmmond)
+ * Histograms in the style of HdrHistogram. Small values each get their own bucket. Past that,
+ * every power of two is split into the same number of buckets, so a bucket is never wider than a
+ * 64th of the values in it and the whole range of a long long fits in a few thousand buckets.
+ * Recording a value only has to find its top bit to know its bucket, and the count, total,
+ * smallest and largest values are kept exactly on the side.
+*/
+
+#include "histogram.h"
+#include <stdlib.h>
+
+/** Number of bits of a value kept when picking its bucket. */
+#define SUB_BITS 7
+
+/** Values below this each get their own bucket. */
+#define SUB_COUNT ( 1 << SUB_BITS )
+
+/** Number of buckets each power of two past SUB_COUNT is split into. */
+#define HALF_COUNT ( SUB_COUNT / 2 )
+
+/** Highest bit a value can have set. */
+#define TOP_BIT 62
+
+/** Number of buckets, enough for values up to the largest long long. */
+#define BUCKETS ( SUB_COUNT + ( TOP_BIT - SUB_BITS + 1 ) * HALF_COUNT )
+
+/** Representation of a histogram. */
+struct HistogramStruct {
+  /** Number of values recorded in each bucket. */
+  long counts[ BUCKETS ];
+
+  /** Number of values recorded. */
+  long count;
+
+  /** Total of the values recorded. */
+  double total;
+
+  /** Smallest and largest values recorded. */
+  long long min, max;
+};
+
+/**
+* Find the highest bit set in a value.
+* @param v value, which isn't zero
+* @return returns the bit number, counting from zero
+*/
+static int topBit(unsigned long long v)
+{
+#ifdef __GNUC__
+  return 63 - __builtin_clzll(v);
+#else
+  int bit = 0;
+  while (v >>= 1)
+    bit++;
+  return bit;
+#endif
+}
+
+/**
+* Find the bucket a value goes in.
+* @param v value, which isn't negative
+* @return returns the bucket index
+*/
+static int bucketOf(long long v)
+{
+  if (v < SUB_COUNT)
+    return v;
+  //Keep the top SUB_BITS - 1 bits below the top bit, which pick a bucket within the power of two
+  int shift = topBit(v) - (SUB_BITS - 1);
+  return SUB_COUNT + (shift - 1) * HALF_COUNT + (int) ((v >> shift) - HALF_COUNT);
+}
+
+/**
+* Find the largest value that goes in a bucket.
+* @param i bucket index
+* @return returns the value
+*/
+static long long highestIn(int i)
+{
+  if (i < SUB_COUNT)
+    return i;
+  int shift = (i - SUB_COUNT) / HALF_COUNT + 1;
+  long long sub = HALF_COUNT + (i - SUB_COUNT) % HALF_COUNT;
+  //Worked out so the top bucket doesn't overflow
+  return (sub << shift) + ((1LL << shift) - 1);
+}
+
+/**
+* Make an empty histogram
+* @return returns the new histogram
+*/
+Histogram *makeHistogram()
+{
+  return calloc(1, sizeof(Histogram));
+}
+
+/**
+* Record copies of a value
+* @param h histogram to record in
+* @param value value to record
+* @param count number of copies
+*/
+void histogramRecord(Histogram *h, long long value, long count)
+{
+  if (count <= 0)
+    return;
+  if (value < 0)
+    value = 0;
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (h->count == 0 || value > h->max)
+    h->max = value;
+  h->counts[bucketOf(value)] += count;
+  h->count += count;
+  h->total += (double) value * count;
+}
+
+/**
+* Report how many values were recorded
+* @param h histogram to check
+* @return returns the count
+*/
+long histogramCount(Histogram const *h)
+{
+  return h->count;
+}
+
+/**
+* Report the smallest value recorded
+* @param h histogram to check
+* @return returns the smallest value
+*/
+long long histogramMin(Histogram const *h)
+{
+  return h->min;
+}
+
+/**
+* Report the largest value recorded
+* @param h histogram to check
+* @return returns the largest value
+*/
+long long histogramMax(Histogram const *h)
+{
+  return h->max;
+}
+
+/**
+* Report the average value recorded
+* @param h histogram to check
+* @return returns the average
+*/
+double histogramMean(Histogram const *h)
+{
+  return h->count ? h->total / h->count : 0.0;
+}
+
+/**
+* Find a percentile by adding up the buckets until enough values are covered
+* @param h histogram to check
+* @param percent percent of the values
+* @return returns the percentile
+*/
+long long histogramPercentile(Histogram const *h, double percent)
+{
+  if (h->count == 0)
+    return 0;
+  //The rank of the value wanted, counting from one
+  long rank = (long) (percent / 100 * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+  long seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      long long high = highestIn(i);
+      return high < h->max ? (high > h->min ? high : h->min) : h->max;
+    }
+  }
+  return h->max;
+}
+
+/**
+* Free a histogram
+* @param h histogram to free
+*/
+void freeHistogram(Histogram *h)
+{
+  free(h);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file histogram.h
+ * @author David Mond (dmmond)
+ * Header file for histogram.c, which records how values like latencies in nanoseconds are spread
+ * out, with a fixed number of buckets that keep every value to within a couple of percent.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/** Incomplete type for a histogram. */
+typedef struct HistogramStruct Histogram;
+
+/** Make an empty histogram.
+    @return the new histogram.
+*/
+Histogram *makeHistogram();
+
+/** Record some number of copies of a value.  This takes constant time and
+    never allocates.
+    @param h Histogram to record in.
+    @param value Value to record, where anything below zero counts as zero.
+    @param count Number of times to record it.
+*/
+void histogramRecord( Histogram *h, long long value, long count );
+
+/** Report how many values have been recorded.
+    @param h Histogram to check.
+    @return number of values.
+*/
+long histogramCount( Histogram const *h );
+
+/** Report the smallest value recorded, exactly.
+    @param h Histogram to check.
+    @return the smallest value, or zero if nothing's been recorded.
+*/
+long long histogramMin( Histogram const *h );
+
+/** Report the largest value recorded, exactly.
+    @param h Histogram to check.
+    @return the largest value, or zero if nothing's been recorded.
+*/
+long long histogramMax( Histogram const *h );
+
+/** Report the average of the values recorded, exactly.
+    @param h Histogram to check.
+    @return the average, or zero if nothing's been recorded.
+*/
+double histogramMean( Histogram const *h );
+
+/** Find the value that the given percent of the values recorded are at or
+    below, to within the precision of the bucket it's in.
+    @param h Histogram to check.
+    @param percent Percent of the values, from 0 to 100.
+    @return the largest value that could be in the bucket the percentile
+    falls in, but never more than the largest value recorded, or zero if
+    nothing's been recorded.
+*/
+long long histogramPercentile( Histogram const *h, double percent );
+
+/** Free a histogram.
+    @param h Histogram to free.
+*/
+void freeHistogram( Histogram *h );
+
+#endif
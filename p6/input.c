@@ -2,52 +2,134 @@
  * @file input.c
  * @author David Mond (dmmond)
  * Reads in input from the given input stream.
+ * Input is read in big blocks into one buffer, which is reused for every line. Lines are found
+ * with memchr and handed out right where they are in the buffer, so reading a line doesn't
+ * allocate or copy anything unless it runs off the end of the buffer.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
-#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "input.h"
 
-//Size of buffer
-#define SIZE 128
+//Size of each block read from the file, and the starting size of the buffer
+#define BLOCK 65536
+
+/** Representation of a line reader. */
+struct LineReaderStruct {
+    /** File being read. */
+    int fd;
+    /** Characters read from the file, with room for one null terminator past them. */
+    char *buf;
+    /** Number of characters buf has room for. */
+    size_t cap;
+    /** Start of the characters that haven't been handed out yet. */
+    size_t start;
+    /** End of the characters read so far. */
+    size_t end;
+    /** Characters from start up to here are known not to have a newline. */
+    size_t scanned;
+    /** True once the file has been read to the end. */
+    bool eof;
+};
+
+/**
+ * Make a reader for the lines of an open file.
+ * @param fd file descriptor to read from
+ * @return returns the new reader
+*/
+LineReader *makeLineReader(int fd)
+{
+    LineReader *r = (LineReader *)malloc(sizeof(LineReader));
+    r->fd = fd;
+    r->cap = BLOCK;
+    r->buf = (char *)malloc(r->cap);
+    r->start = 0;
+    r->end = 0;
+    r->scanned = 0;
+    r->eof = false;
+    return r;
+}
+
+/**
+ * Read another block from the file onto the end of the buffer. The characters still waiting
+ * are moved to the front first, and the buffer doubles when a line fills the whole thing.
+ * @param r reader to fill
+ * @return returns false at the end of the file
+*/
+static bool fill(LineReader *r)
+{
+    //Slide what's left to the front, it's usually just part of a line
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->scanned -= r->start;
+        r->start = 0;
+    }
+    //Keep a byte free for the null terminator
+    if (r->cap - r->end <= 1) {
+        r->cap *= 2;
+        r->buf = (char *)realloc(r->buf, r->cap);
+    }
+    ssize_t got;
+    do {
+        got = read(r->fd, r->buf + r->end, r->cap - 1 - r->end);
+    } while (got < 0 && errno == EINTR);
+    //An error ends the input just like the end of the file
+    if (got <= 0) {
+        r->eof = true;
+        return false;
+    }
+    r->end += got;
+    return true;
+}
 
 /**
- * This function reads a single line of input from the given input stream and returns it as a string inside a block of dynamically allocated memory.
- * @param fp File to read the input in from.
- * @return returns a character that is a string inside of a block of dynamically allocated memory.
+ * Get the next line of input, pointing into the reader's buffer.
+ * @param r reader to get the line from
+ * @param len filled in with the length of the line, if not NULL
+ * @return returns the line, or NULL at the end of the input
 */
-char *readLine(FILE *fp) {
-    const int initialSize = SIZE;
-    char *buffer = (char *)malloc(initialSize * sizeof(char));
-    int position = 0; 
-    while (1) {
-        //Read a character from the file
-        int c = fgetc(fp);
-        //Check for end of line or end of file
-        if (c == '\n' || c == EOF) {
-            //Null-terminate the string
-            buffer[position] = '\0';
-            //Check for immediate EOF and empty line
-            if (c == EOF && position == 0) {  
-                free(buffer);
+char *nextLine(LineReader *r, size_t *len)
+{
+    char *newline;
+    //Keep reading until there's a whole line, only looking at each character once
+    while ((newline = memchr(r->buf + r->scanned, '\n', r->end - r->scanned)) == NULL) {
+        r->scanned = r->end;
+        if (r->eof || !fill(r)) {
+            //The last line doesn't have to end with a newline, but an empty one isn't a line
+            if (r->start == r->end) {
                 return NULL;
-            } else {
-                //Return the line
-                return buffer;
             }
-        } else {
-            //Store the character in the buffer
-            buffer[position] = c;
-        }
-        //Move to the next position in the buffer
-        position++;
-
-        //Check if the buffer needs to be enlarged
-        if (position >= initialSize) {
-            int newSize = initialSize + position;
-            char *newBuffer = (char *)realloc(buffer, newSize * sizeof(char));
-            //Point to the new buffer
-            buffer = newBuffer;
+            newline = r->buf + r->end;
+            break;
         }
     }
-}
\ No newline at end of file
+
+    //Hand out the line and move past it
+    char *line = r->buf + r->start;
+    *newline = '\0';
+    if (len) {
+        *len = newline - line;
+    }
+    r->start = newline - r->buf;
+    if (r->start < r->end) {
+        r->start++;
+    }
+    r->scanned = r->start;
+    return line;
+}
+
+/**
+ * Free a reader and its buffer.
+ * @param r reader to free
+*/
+void freeLineReader(LineReader *r)
+{
+    free(r->buf);
+    free(r);
+}
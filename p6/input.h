@@ -1,15 +1,40 @@
 /**
  * @file input.h
  * @author David Mond (dmmond)
- * Declaration of the function for reading input lines.
+ * Declarations for reading input lines in big blocks.
  */
 
+#ifndef INPUT_H
+#define INPUT_H
 
-#include <stdio.h>
+#include <stddef.h>
+
+/** Incomplete type for a reader that hands out the lines of a file one at a time. */
+typedef struct LineReaderStruct LineReader;
+
+/**
+ * Make a reader for the lines of an open file.  The file is read a big block at a time with
+ * read(), which hands back whatever has arrived so far, so a terminal or a socket still gets
+ * each line as soon as it's typed or sent.
+ * @param fd file descriptor to read from, which the reader doesn't close.
+ * @return returns the new reader.
+*/
+LineReader *makeLineReader(int fd);
 
 /**
- * This function reads a single line of input from the given input stream and returns it as a string inside a block of dynamically allocated memory.
- * @param fp File to read the input in from.
- * @return returns a character that is a string inside of a block of dynamically allocated memory.
+ * Get the next line of input, without its newline.  The line isn't copied: it points right
+ * into the reader's buffer, and it's only good until the next call.  The caller may change
+ * its characters, but must not free it.
+ * @param r reader to get the line from.
+ * @param len if not NULL, filled in with the length of the line.
+ * @return returns the null-terminated line, or NULL at the end of the input.
 */
-char *readLine(FILE *fp);
\ No newline at end of file
+char *nextLine(LineReader *r, size_t *len);
+
+/**
+ * Free a reader and its buffer.
+ * @param r reader to free.
+*/
+void freeLineReader(LineReader *r);
+
+#endif
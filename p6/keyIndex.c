@@ -0,0 +1,243 @@
+/**
+ * @file keyIndex.c
+ * @author David Mond (dmmond)
+ * Side table from keys to the records map.c keeps about them outside the trie. It's an
+ * open-addressing table with Robin Hood probing, laid out like the one in hashMap.c, except that
+ * each slot only points at its record. Records are allocated one at a time, so growing the table
+ * never moves them and the key in a record can be pointed at for as long as the record lives.
+*/
+
+#include "keyIndex.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Number of slots in a new table, always a power of two. */
+#define START_SLOTS 16
+
+/** The table grows once it's more than LOAD_NUM / LOAD_DEN full. */
+#define LOAD_NUM 7
+/** Denominator for the maximum load factor. */
+#define LOAD_DEN 8
+
+/** Starting value for the FNV-1a hash. */
+#define FNV_OFFSET 2166136261u
+/** Multiplier for the FNV-1a hash. */
+#define FNV_PRIME 16777619u
+
+/** One slot in the table. */
+typedef struct {
+  /** Record stored here, or NULL if the slot is empty. */
+  KeyRecord *rec;
+
+  /** Hash of the record's key. */
+  unsigned int hash;
+} Slot;
+
+/** Representation of an index. */
+struct KeyIndexStruct {
+  /** Array of slots. */
+  Slot *slots;
+
+  /** Number of slots, a power of two. */
+  int cap;
+
+  /** Number of records in the table. */
+  int count;
+
+  /** Bytes in the records, keys included. */
+  long bytes;
+};
+
+/**
+* Hash a key with FNV-1a.
+* @param key key to hash
+* @return returns the hash code
+*/
+static unsigned int hashKey(char const *key)
+{
+  unsigned int h = FNV_OFFSET;
+  for (; *key; key++) {
+    h ^= (unsigned char) *key;
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+/**
+* How far a slot's record is from the slot its hash maps to.
+* @param x index the slot is in
+* @param i index of the slot
+* @return returns the probe distance
+*/
+static int probeDist(KeyIndex const *x, int i)
+{
+  return (i - (int) (x->slots[i].hash & (x->cap - 1))) & (x->cap - 1);
+}
+
+/**
+* Make a new index.
+* @return returns the empty index
+*/
+KeyIndex *makeKeyIndex()
+{
+  KeyIndex *x = malloc(sizeof(KeyIndex));
+  x->cap = START_SLOTS;
+  x->slots = calloc(x->cap, sizeof(Slot));
+  x->count = 0;
+  x->bytes = 0;
+  return x;
+}
+
+/**
+* Put a record into a table that's known not to have its key, using Robin Hood placement.
+* @param x index to add to
+* @param s slot to add
+*/
+static void placeSlot(KeyIndex *x, Slot s)
+{
+  int mask = x->cap - 1;
+  int i = s.hash & mask;
+  int dist = 0;
+  while (x->slots[i].rec) {
+    //Take the spot from a record that's closer to home than we are
+    int other = probeDist(x, i);
+    if (other < dist) {
+      Slot tmp = x->slots[i];
+      x->slots[i] = s;
+      s = tmp;
+      dist = other;
+    }
+    i = (i + 1) & mask;
+    dist++;
+  }
+  x->slots[i] = s;
+}
+
+/**
+* Double the number of slots and put every record back in.
+* @param x index to grow
+*/
+static void grow(KeyIndex *x)
+{
+  Slot *old = x->slots;
+  int oldCap = x->cap;
+  x->cap *= 2;
+  x->slots = calloc(x->cap, sizeof(Slot));
+  for (int i = 0; i < oldCap; i++)
+    if (old[i].rec)
+      placeSlot(x, old[i]);
+  free(old);
+}
+
+/**
+* Find the slot holding a key's record.
+* @param x index to look in
+* @param key key to look for
+* @param hash hash of the key
+* @return returns the slot index, or -1 if the key isn't there
+*/
+static int findSlot(KeyIndex const *x, char const *key, unsigned int hash)
+{
+  int mask = x->cap - 1;
+  int i = hash & mask;
+  //A record closer to home than we've probed means our key would have been placed before it
+  for (int dist = 0; x->slots[i].rec && probeDist(x, i) >= dist; dist++) {
+    if (x->slots[i].hash == hash && strcmp(x->slots[i].rec->key, key) == 0)
+      return i;
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+/**
+* Look up a key's record
+* @param x index to look in
+* @param key key to look for
+* @return returns the record, or NULL if there isn't one
+*/
+KeyRecord *indexFind(KeyIndex *x, char const *key)
+{
+  int i = findSlot(x, key, hashKey(key));
+  return i >= 0 ? x->slots[i].rec : NULL;
+}
+
+/**
+* Get a key's record, adding an empty one if it's new
+* @param x index to look in
+* @param key key to look for, which gets copied into a new record
+* @return returns the record
+*/
+KeyRecord *indexAdd(KeyIndex *x, char const *key)
+{
+  unsigned int hash = hashKey(key);
+  int i = findSlot(x, key, hash);
+  if (i >= 0)
+    return x->slots[i].rec;
+
+  if ((long) (x->count + 1) * LOAD_DEN > (long) x->cap * LOAD_NUM)
+    grow(x);
+  size_t len = strlen(key) + 1;
+  KeyRecord *r = malloc(sizeof(KeyRecord) + len);
+  r->entry = NULL;
+  r->timer = NULL;
+  memcpy(r->key, key, len);
+  placeSlot(x, (Slot) { r, hash });
+  x->count++;
+  x->bytes += sizeof(KeyRecord) + len;
+  return r;
+}
+
+/**
+* Remove a record, shifting the records after it back a spot so no tombstone is needed.
+* @param x index the record is in
+* @param r record to remove
+*/
+void indexRemove(KeyIndex *x, KeyRecord *r)
+{
+  int i = findSlot(x, r->key, hashKey(r->key));
+  x->bytes -= sizeof(KeyRecord) + strlen(r->key) + 1;
+  free(r);
+  x->count--;
+
+  //Pull back records that aren't in their home slot
+  int mask = x->cap - 1;
+  int next = (i + 1) & mask;
+  while (x->slots[next].rec && probeDist(x, next) > 0) {
+    x->slots[i] = x->slots[next];
+    i = next;
+    next = (next + 1) & mask;
+  }
+  x->slots[i] = (Slot) { NULL, 0 };
+}
+
+/**
+* Report the number of records
+* @param x index to check
+* @return returns the number of records
+*/
+int indexSize(KeyIndex *x)
+{
+  return x->count;
+}
+
+/**
+* Report the memory in the records
+* @param x index to measure
+* @return returns the bytes in the records and their keys
+*/
+long indexBytes(KeyIndex *x)
+{
+  return x->bytes;
+}
+
+/**
+* Free an index and its records
+* @param x index to free
+*/
+void freeKeyIndex(KeyIndex *x)
+{
+  for (int i = 0; i < x->cap; i++)
+    free(x->slots[i].rec);
+  free(x->slots);
+  free(x);
+}
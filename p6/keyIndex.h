@@ -0,0 +1,73 @@
+/**
+ * @file keyIndex.h
+ * @author David Mond (dmmond)
+ * Header file for keyIndex.c, a side table that keeps what map.c needs to know about a key outside
+ * the trie, like its place in a cache or its timer. Each key is copied once, into its record, and everything
+ * else that needs the key points at that copy. These functions are only meant to be called from map.c.
+*/
+
+#ifndef KEYINDEX_H
+#define KEYINDEX_H
+
+#include "cache.h"
+#include "timer.h"
+
+/** Incomplete type for the table of records. */
+typedef struct KeyIndexStruct KeyIndex;
+
+/** What the map keeps about one key, outside the trie. */
+typedef struct {
+  /** The key's place in the map's cache, or NULL if it doesn't have one. */
+  CacheEntry *entry;
+
+  /** Timer for when the key expires, or NULL if it doesn't. */
+  Timer *timer;
+
+  /** The key, which stays put until the record is removed. */
+  char key[];
+} KeyRecord;
+
+/** Make an empty index.
+    @return the new index.
+*/
+KeyIndex *makeKeyIndex();
+
+/** Look up the record for a key.
+    @param x Index to look in.
+    @param key Key to look for.
+    @return the record, or NULL if the key doesn't have one.
+*/
+KeyRecord *indexFind( KeyIndex *x, char const *key );
+
+/** Get the record for a key, adding an empty one if it doesn't have one yet.
+    @param x Index to look in.
+    @param key Key to look for, which the index copies into a new record.
+    @return the record.
+*/
+KeyRecord *indexAdd( KeyIndex *x, char const *key );
+
+/** Remove a record and free it, along with its copy of the key.
+    @param x Index the record is in.
+    @param r Record to remove.
+*/
+void indexRemove( KeyIndex *x, KeyRecord *r );
+
+/** Report how many keys have records.
+    @param x Index to check.
+    @return the number of records.
+*/
+int indexSize( KeyIndex *x );
+
+/** Report the memory the records use, which grows and shrinks with the
+    keys, not counting the table they're found through.
+    @param x Index to measure.
+    @return the bytes in the records and their keys.
+*/
+long indexBytes( KeyIndex *x );
+
+/** Free an index and every record in it.
+    @param x Index to free.
+*/
+void freeKeyIndex( KeyIndex *x );
+
+#endif
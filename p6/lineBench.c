@@ -0,0 +1,160 @@
+/**
+ * @file lineBench.c
+ * @author David Mond (dmmond)
+ * Benchmark for reading input lines. Writes a big file of command lines like the ones in
+ * input-10.txt, then times reading every line of it three ways: with the line reader, with
+ * getline, and one fgetc at a time into a new block for each line, the way lines used to be
+ * read. Reports the lines per second and megabytes per second for each, and removes the file.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "input.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** Default size of the file to read, in megabytes. */
+#define MEGABYTES 256
+/** Bytes in a megabyte. */
+#define MEGABYTE ( 1024L * 1024L )
+/** Default name for the file. */
+#define FILE_NAME "lineBench.txt"
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+/** Length of each key, the same as in input-10.txt. */
+#define KEY_LENGTH 5
+/** Numbers stored by set run from minus this to plus this. */
+#define NUMBER_RANGE 100
+/** Starting size of the block for each line read with fgetc. */
+#define SIZE 128
+
+/**
+ * Get the current time from a monotonic clock.
+ * @return returns the time in nanoseconds
+ */
+static long long now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANOS + ts.tv_nsec;
+}
+
+/**
+ * Print how fast one way of reading went.
+ * @param name name of the way the lines were read
+ * @param lines number of lines read
+ * @param bytes number of bytes read
+ * @param start time the reading started
+ */
+static void report(char const *name, long lines, long bytes, long long start)
+{
+  long long elapsed = now() - start;
+  printf("%-8s %10ld lines %12.0f lines/s %8.1f MB/s\n", name, lines,
+         (double) lines * NANOS / elapsed, (double) bytes * NANOS / elapsed / MEGABYTE);
+}
+
+/**
+ * Write a file of random set commands.
+ * @param name name of the file
+ * @param size number of bytes to write, roughly
+ * @return returns the number of bytes written, or -1 if the file can't be written
+ */
+static long writeFile(char const *name, long size)
+{
+  FILE *fp = fopen(name, "w");
+  if (!fp)
+    return -1;
+  long bytes = 0;
+  char key[KEY_LENGTH + 1];
+  while (bytes < size) {
+    for (int i = 0; i < KEY_LENGTH; i++)
+      key[i] = 'a' + rand() % 26;
+    key[KEY_LENGTH] = '\0';
+    bytes += fprintf(fp, "set %s %d\n", key, rand() % (2 * NUMBER_RANGE + 1) - NUMBER_RANGE);
+  }
+  fclose(fp);
+  return bytes;
+}
+
+/**
+ * Read a line one character at a time into a new block, like readLine used to.
+ * @param fp file to read from
+ * @return returns the dynamically allocated line, or NULL at the end of the file
+ */
+static char *fgetcLine(FILE *fp)
+{
+  char *buffer = malloc(SIZE);
+  int position = 0;
+  int c;
+  while ((c = fgetc(fp)) != '\n' && c != EOF) {
+    buffer[position++] = c;
+    if (position >= SIZE)
+      buffer = realloc(buffer, SIZE + position);
+  }
+  buffer[position] = '\0';
+  if (c == EOF && position == 0) {
+    free(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+/**
+ * Run the benchmark.
+ * @param argc number of command-line arguments
+ * @param argv optional size in megabytes and file name
+ * @return returns exit success, or failure if the file can't be written
+ */
+int main(int argc, char *argv[])
+{
+  long size = (argc > 1 ? atol(argv[1]) : MEGABYTES) * MEGABYTE;
+  char const *name = argc > 2 ? argv[2] : FILE_NAME;
+  srand(1);
+  long bytes = writeFile(name, size);
+  if (bytes < 0) {
+    fprintf(stderr, "Can't open %s\n", name);
+    return EXIT_FAILURE;
+  }
+  printf("%ld bytes\n", bytes);
+
+  //The line reader, handing out lines right where they are in its buffer
+  int fd = open(name, O_RDONLY);
+  LineReader *r = makeLineReader(fd);
+  long lines = 0;
+  long long start = now();
+  while (nextLine(r, NULL))
+    lines++;
+  report("reader", lines, bytes, start);
+  freeLineReader(r);
+  close(fd);
+
+  //getline, which reuses one block but copies every line into it
+  FILE *fp = fopen(name, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  lines = 0;
+  start = now();
+  while (getline(&line, &cap, fp) >= 0)
+    lines++;
+  report("getline", lines, bytes, start);
+  free(line);
+  fclose(fp);
+
+  //One character at a time, with a new block for each line
+  fp = fopen(name, "r");
+  lines = 0;
+  start = now();
+  while ((line = fgetcLine(fp)) != NULL) {
+    lines++;
+    free(line);
+  }
+  report("fgetc", lines, bytes, start);
+  fclose(fp);
+
+  remove(name);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+/**
+ * @file loadgen.c
+ * @author David Mond (dmmond)
+ * Load generator for the driver's server mode. Starts a number of client threads, each with
+ * its own connection, that send get and set commands one at a time and wait for each reply.
+ * Reports the requests per second all the clients managed together and the latency
+ * percentiles of the individual requests.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** Default number of clients. */
+#define CLIENTS 8
+/** Default number of requests each client sends. */
+#define REQUESTS 10000
+/** Default percent of requests that are sets, the rest are gets. */
+#define SET_PERCENT 10
+/** Number of different keys the requests use. */
+#define KEY_COUNT 1000
+/** Percent scale for the request mix. */
+#define PERCENT 100
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+/** Nanoseconds in a microsecond, for printing latencies. */
+#define MICROS 1000.0
+/** Length of the buffer for building a request. */
+#define LINE 64
+/** Length of the buffer for reading replies. */
+#define REPLY 4096
+/** Every reply ends with the next prompt. */
+#define PROMPT "cmd> "
+
+/** Everything one client thread needs. */
+typedef struct {
+  /** Name of the server's socket. */
+  char const *path;
+
+  /** Number of requests to send. */
+  int requests;
+
+  /** Percent of requests that are sets. */
+  int setPercent;
+
+  /** Seed for this client's random numbers. */
+  unsigned int seed;
+
+  /** Filled in with the latency of each request, in nanoseconds. */
+  long long *latency;
+
+  /** Set to false if the client couldn't talk to the server. */
+  bool ok;
+} Client;
+
+/**
+ * Get the current time from a monotonic clock.
+ * @return returns the time in nanoseconds
+ */
+static long long now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANOS + ts.tv_nsec;
+}
+
+/**
+ * Read until the server's next prompt.
+ * @param fd connection to read from
+ * @return returns false if the server hung up first
+ */
+static bool readReply(int fd)
+{
+  char buf[REPLY];
+  size_t promptLen = strlen(PROMPT);
+  //Only the end of what's been read matters, so keep the last few characters
+  char tail[sizeof(PROMPT)] = "";
+  size_t tailLen = 0;
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      return false;
+    for (ssize_t i = 0; i < n; i++) {
+      if (tailLen == promptLen) {
+        memmove(tail, tail + 1, promptLen - 1);
+        tailLen--;
+      }
+      tail[tailLen++] = buf[i];
+    }
+    if (tailLen == promptLen && memcmp(tail, PROMPT, promptLen) == 0)
+      return true;
+  }
+}
+
+/**
+ * Client thread, sends its requests one at a time and times each one.
+ * @param arg the thread's Client
+ * @return returns NULL
+ */
+static void *client(void *arg)
+{
+  Client *c = arg;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  c->ok = fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && readReply(fd);
+
+  char line[LINE];
+  for (int i = 0; c->ok && i < c->requests; i++) {
+    int key = rand_r(&c->seed) % KEY_COUNT;
+    if (rand_r(&c->seed) % PERCENT < c->setPercent)
+      snprintf(line, sizeof(line), "set key%d %d\n", key, i);
+    else
+      snprintf(line, sizeof(line), "get key%d\n", key);
+    long long start = now();
+    c->ok = write(fd, line, strlen(line)) == (ssize_t) strlen(line) && readReply(fd);
+    c->latency[i] = now() - start;
+  }
+  if (fd >= 0) {
+    if (c->ok && write(fd, "quit\n", strlen("quit\n")) < 0)
+      c->ok = false;
+    close(fd);
+  }
+  return NULL;
+}
+
+/**
+ * Compare two latencies, for qsort.
+ * @param a pointer to the first latency
+ * @param b pointer to the second latency
+ * @return returns negative, zero or positive
+ */
+static int compareLatency(void const *a, void const *b)
+{
+  long long x = *(long long const *) a, y = *(long long const *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Run the load generator.
+ * @param argc number of command-line arguments
+ * @param argv socket name, then optional client count, requests per client and set percent
+ * @return returns exit success if every client finished
+ */
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: loadgen socket [clients [requests [set-percent]]]\n");
+    return EXIT_FAILURE;
+  }
+  int clients = argc > 2 ? atoi(argv[2]) : CLIENTS;
+  int requests = argc > 3 ? atoi(argv[3]) : REQUESTS;
+  int setPercent = argc > 4 ? atoi(argv[4]) : SET_PERCENT;
+  if (clients < 1 || requests < 1) {
+    fprintf(stderr, "Need at least one client and one request\n");
+    return EXIT_FAILURE;
+  }
+
+  long total = (long) clients * requests;
+  long long *latency = malloc(total * sizeof(long long));
+  Client *c = malloc(clients * sizeof(Client));
+  pthread_t *t = malloc(clients * sizeof(pthread_t));
+  long long start = now();
+  for (int i = 0; i < clients; i++) {
+    c[i] = (Client) { argv[1], requests, setPercent, i + 1, latency + (long) i * requests, false };
+    pthread_create(&t[i], NULL, client, &c[i]);
+  }
+  bool ok = true;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(t[i], NULL);
+    ok = ok && c[i].ok;
+  }
+  long long elapsed = now() - start;
+
+  if (ok) {
+    qsort(latency, total, sizeof(long long), compareLatency);
+    printf("%d clients, %ld requests, %d%% sets\n", clients, total, setPercent);
+    printf("%.0f requests/s\n", (double) total * NANOS / elapsed);
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           latency[total / 2] / MICROS, latency[total * 9 / 10] / MICROS,
+           latency[total * 99 / 100] / MICROS, latency[total * 999 / 1000] / MICROS,
+           latency[total - 1] / MICROS);
+  } else {
+    fprintf(stderr, "Couldn't talk to the server at %s\n", argv[1]);
+  }
+  free(t);
+  free(c);
+  free(latency);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
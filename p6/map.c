@@ -2,11 +2,58 @@
  * @file map.c
  * @author David Mond (dmmond)
  * Contains all the map functions. Can make a map, get the map size, set a map, remove a map, and more.
+ * The map is a trie built from a family of adaptive nodes (4, 16, 48 and full 94-child nodes), so a
+ * node only pays for the children it actually has. Nodes grow into the next size when they fill up
+ * and shrink back down when enough children are removed. Chains of nodes with a single child
+ * and no value are compressed into one node with an edge label (Patricia style), and removing
+ * a key frees or merges the nodes it leaves behind, so the trie only holds what the live keys need.
+ * Nodes come from a pool owned by the map, which carves them out of large chunks and recycles
+ * freed nodes through a free list for each node size.
+ * A map can also be made with a hash table from hashMap.c instead of the trie, in which case
+ * the functions here just hand the work off to the table. A map opened with mapOpenFlat() is
+ * a read-only trie served straight out of a file by flatMap.c.
+ * A map made with makeConcurrentMap() is split into stripes, one for each symbol a key can start
+ * with (plus one for the empty key). Each stripe is an ordinary map with its own reader-writer
+ * lock, so any number of threads can read at once and writers only hold up the stripe they change.
+ * A map with a log from mapOpenLog() hands every change to wal.c before (or, when it's only known
+ * afterward whether anything changed, right after) making it.
+ * Every trie node with children keeps a count of the keys under it, with the totals, smallest and
+ * largest of their numbers, and a leaf's figures come straight from its value. A change only touches
+ * the nodes on the path it already walked to its key, which are adjusted on the way back up by the
+ * difference between the old and new value, so mapAggregate() can read the figures for a prefix
+ * right off the node where the prefix ends.
+ * A map with a limit from mapSetCapacity() is a cache. Each key in it has a record in a side table
+ * from keyIndex.c, which holds the one copy of the key outside the trie and the key's entry in
+ * cache.c, so the trie's nodes don't carry anything for the cache. Sets that take the map over its
+ * limit remove the keys the cache picks until it's back under. The bytes it's limited to are kept
+ * up to date as nodes, labels, string values and records come and go. Replaying a log doesn't throw
+ * anything out until it's done, since the removes the log has are the evictions that happened.
+ * A key set with mapPutTTL() has a timer from timer.c, kept in its record in the same side table.
+ * A map with a log logs the key's deadline along with its value, and replaying the log starts the
+ * timer again, or leaves the key out if its deadline has gone by.
+ * Lookups remove a key whose time is up as they find it, and mapExpire() turns the wheel and removes
+ * the keys on its expired list a few at a time. Anything that counts or walks over the keys leaves
+ * out the ones still waiting on that list instead of removing them, so reads never do more than
+ * their share of the cleaning up.
+ * Building with MAP_DEBUG defined (e.g., CFLAGS=-DMAP_DEBUG make) checks the map's key count
+ * and every node's counts against a walk of the whole trie after every change.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "map.h"
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
 #include "value.h"
+#include "hashMap.h"
+#include "flatMap.h"
+#include "wal.h"
+#include "cache.h"
+#include "keyIndex.h"
+#include "timer.h"
+#include <time.h>
 
 /** Lowest-numbered symbol ina  key. */
 #define FIRST_SYM '!'
@@ -14,182 +61,2618 @@
 /** Number of possible symbols in a key. */
 #define SYM_COUNT ( '~' - '!' + 1 )
 
+/** Type tag for a node with room for up to 4 children. */
+#define NODE4 0
+/** Type tag for a node with room for up to 16 children. */
+#define NODE16 1
+/** Type tag for a node with room for up to 48 children, found through a symbol index. */
+#define NODE48 2
+/** Type tag for a node with a child slot for every symbol. */
+#define NODE94 3
+
+/** Number of children that fit in a NODE4. */
+#define CAP4 4
+/** Number of children that fit in a NODE16. */
+#define CAP16 16
+/** Number of children that fit in a NODE48. */
+#define CAP48 48
+
+/** A NODE16 shrinks back to a NODE4 once it has this many children left. */
+#define SHRINK16 3
+/** A NODE48 shrinks back to a NODE16 once it has this many children left. */
+#define SHRINK48 12
+/** A NODE94 shrinks back to a NODE48 once it has this many children left. */
+#define SHRINK94 40
+
+/** Edge labels up to this long are stored right in the node instead of a separate block. */
+#define LABEL_INLINE 8
+
+/** Hint to the processor that a node is about to be used, where the compiler supports it. */
+#ifdef __GNUC__
+#define PREFETCH( p ) __builtin_prefetch( p )
+#else
+#define PREFETCH( p )
+#endif
+
+/** Starting capacity of the explicit stack used to walk the whole trie. */
+#define STACK_START 64
+
+/** Starting capacity of the key buffer in a cursor. */
+#define KEY_START 64
+
+/** Number of nodes on a path to a key that fit in a Path, longer paths go on the heap. */
+#define PATH_START 64
+
+/** Number of stripes in a concurrent map, one for each starting symbol and one for the empty key. */
+#define STRIPES ( SYM_COUNT + 1 )
+
+/** Number of nodes of one size carved out of each chunk the node pool allocates. */
+#define CHUNK_NODES 128
+
+/** Number of milliseconds in a second. */
+#define MILLIS 1000
+
+/** Number of nanoseconds in a millisecond. */
+#define NANOS_PER_MILLI 1000000
+
 /** Short name for the node used to build this tree. */
 typedef struct NodeStruct Node;
 
-/** Node in the trie data structure. */
+/** Common header at the start of every node in the trie. */
 struct NodeStruct {
   /** If the substring to the root of the tree up to this node is a
-      key, this is the value that goes with it. */
-  Value *val;
-  
+      key, this is the value that goes with it, stored right in the node.
+      It's empty if the substring isn't a key. */
+  Value val;
+
+  /** Which kind of node this is, NODE4 through NODE94. */
+  unsigned char type;
+
+  /** Number of children this node currently has. */
+  unsigned char count;
+
+  /** Number of key characters on the edge into this node, after the symbol
+      the parent uses to pick it. */
+  int labelLen;
+
+  /** The edge label characters, stored inline if they fit. */
+  union {
+    char text[ LABEL_INLINE ];
+    char *heap;
+  } label;
+
+  /** Figures for this node's value and every key below it, or NULL for a node with
+      no children, whose figures are just its value's. */
+  MapAggregate *agg;
+};
+
+/** Smallest node, children are kept in symbol order in parallel arrays. */
+typedef struct {
+  // Superclass fields.
+  Node hdr;
+
+  // Subclass fields.
+  /** Symbol for each child, in increasing order. */
+  unsigned char sym[ CAP4 ];
+  /** Child pointers, parallel to sym. */
+  Node *child[ CAP4 ];
+} Node4;
+
+/** Medium node, laid out the same way as a Node4. */
+typedef struct {
+  // Superclass fields.
+  Node hdr;
+
+  // Subclass fields.
+  /** Symbol for each child, in increasing order. */
+  unsigned char sym[ CAP16 ];
+  /** Child pointers, parallel to sym. */
+  Node *child[ CAP16 ];
+} Node16;
+
+/** Large node, a symbol-indexed table says which child slot holds each symbol. */
+typedef struct {
+  // Superclass fields.
+  Node hdr;
+
+  // Subclass fields.
+  /** For each symbol, one more than its index in child, or zero if there's no child. */
+  unsigned char slot[ SYM_COUNT ];
+  /** Child pointers, in no particular order. */
+  Node *child[ CAP48 ];
+} Node48;
+
+/** Full node, with a child pointer for every possible symbol. */
+typedef struct {
+  // Superclass fields.
+  Node hdr;
+
+  // Subclass fields.
   /** Array of pointers to child nodes. */
   Node *child[ SYM_COUNT ];
+} Node94;
+
+/** The nodes a change passed through on its way down from the root, so their figures can be
+    adjusted on the way back up without walking the key again. */
+typedef struct {
+  /** The nodes, from the root down. */
+  Node **nodes;
+
+  /** Number of nodes on the path, and how many there's room for. */
+  int top, cap;
+
+  /** Room for a short path, so most changes don't allocate one. */
+  Node *local[ PATH_START ];
+} Path;
+
+/** Short name for a block of memory that nodes are carved out of. */
+typedef struct ChunkStruct Chunk;
+
+/** Header at the start of each chunk, the nodes follow right after it. */
+struct ChunkStruct {
+  /** Next chunk the pool has allocated. */
+  Chunk *next;
 };
 
+/** Slab allocator that hands out trie nodes, with separate slabs for each node size. */
+typedef struct {
+  /** List of every chunk allocated, so they can all be freed together. */
+  Chunk *chunks;
+
+  /** For each node size, list of freed nodes that can be handed out again,
+      linked through their first field. */
+  Node *free[ MAP_NODE_TYPES ];
+
+  /** For each node size, next unused spot in the newest chunk for that size. */
+  char *next[ MAP_NODE_TYPES ];
+
+  /** For each node size, end of the newest chunk for that size. */
+  char *end[ MAP_NODE_TYPES ];
+
+  /** Counters reported through mapGetStats. */
+  long chunkCount, chunkBytes, allocs, reuses, frees;
+
+  /** Bytes in the nodes handed out and not given back, and in their labels that
+      don't fit inline. */
+  long liveBytes;
+} NodePool;
+
+/** One stripe of a concurrent map, holding the keys that start with one symbol. */
+typedef struct {
+  /** Lock that readers share and writers hold alone. */
+  pthread_rwlock_t lock;
+
+  /** Ordinary map with the stripe's keys. */
+  Map *map;
+} Stripe;
+
 /** Representation of a trie implementation of a map. */
 struct MapStruct {
   /** Root node of this tree. */
   Node *root;
+
+  /** Number of key/value pairs in the tree, kept up to date by mapSet and mapRemove. */
+  int count;
+
+  /** Where this map's nodes come from. */
+  NodePool pool;
+
+  /** Hash table holding the keys instead of the trie, or NULL for a trie map. */
+  HashTable *hash;
+
+  /** Read-only flat trie holding the keys instead of the trie, or NULL if the map isn't flat. */
+  FlatMap *flat;
+
+  /** For a concurrent map, the stripes holding the keys, or NULL for an ordinary map. */
+  Stripe *stripes;
+
+  /** Log of changes to the map, or NULL if they aren't logged. */
+  Wal *wal;
+
+  /** For a map with a limit on its size, the order keys get thrown out in, or NULL. */
+  Cache *cache;
+
+  /** Records for the keys in a cache or with a timer, or NULL until there are any. */
+  KeyIndex *index;
+
+  /** True while a log is being replayed into the map. */
+  bool replaying;
+
+  /** Limits on the keys and bytes in a cache, zero for no limit. */
+  int maxKeys;
+  long maxBytes;
+
+  /** Bytes in a cache's string values. */
+  long valueBytes;
+
+  /** Counters reported through mapCacheStats. */
+  long hits, misses, evictions, expirations;
+
+  /** Timers for keys that expire, or NULL until one is set. */
+  TimerWheel *timers;
+
+  /** Clock for expiring keys, or NULL for the system's real-time clock, and what to pass it. */
+  MapClock clock;
+  void *clockCtx;
+};
+
+/** Size in bytes of each type of node, indexed by type tag. */
+static size_t const nodeSize[ MAP_NODE_TYPES ] = {
+  sizeof( Node4 ), sizeof( Node16 ), sizeof( Node48 ), sizeof( Node94 )
 };
 
-/** 
+/**
 * Create a new trie
 * @return returns the trie that was dynamically created
 */
-Map *makeMap() 
+Map *makeMap()
+{
+  return makeMapOfKind(MAP_TRIE);
+}
+
+/**
+* Create a new map with the given implementation
+* @param kind MAP_TRIE or MAP_HASH
+* @return returns the map that was dynamically created
+*/
+Map *makeMapOfKind(int kind)
 {
-  Map *m = malloc(sizeof(Map));
-  m->root = NULL; 
+  Map *m = calloc(1, sizeof(Map));
+  if (kind == MAP_HASH)
+    m->hash = makeHashTable();
   return m;
 }
 
 /**
-* Helper function to recursively count the number of key/value pairs in the trie.
-* @param node pointer to a node which represents the trie
-* @return returns the number of pairs in the trie
+* Create a map that's safe to use from several threads, split into stripes by first symbol
+* @param kind MAP_TRIE or MAP_HASH, for the map in each stripe
+* @return returns the map that was dynamically created
 */
-static int countKeys(Node *node) 
+Map *makeConcurrentMap(int kind)
 {
-  if (node == NULL) return 0;
-  //Assign only if not null
-  int count = (node->val != NULL); 
-  for (int i = 0; i < SYM_COUNT; i++)
-    count += countKeys(node->child[i]);
-  return count;
+  Map *m = calloc(1, sizeof(Map));
+  m->stripes = malloc(STRIPES * sizeof(Stripe));
+  for (int i = 0; i < STRIPES; i++) {
+    pthread_rwlock_init(&m->stripes[i].lock, NULL);
+    m->stripes[i].map = makeMapOfKind(kind);
+  }
+  return m;
 }
 
 /**
-* Return the number of key/value pairs in the map by using the count keys helper function
-* @param m pointer to the map 
-* @return returns the size of the number of pairs in the maps
+* Find the stripe a key belongs in. Stripes are in the same order as their keys, with the
+* empty key (and any key the trie can't hold) in the first one.
+* @param m concurrent map
+* @param key key to look for
+* @return returns the stripe
 */
-int mapSize(Map *m) 
+static Stripe *stripeFor(Map *m, char const *key)
 {
-  return countKeys(m->root);
+  int sym = key[0] - FIRST_SYM;
+  return &m->stripes[sym >= 0 && sym < SYM_COUNT ? sym + 1 : 0];
 }
 
 /**
-* Helper function to recursively free a trie node
-* @param node pointer to the trie that is being freed
+* Open a read-only map from a flat trie file
+* @param path name of the file
+* @return returns the map, or NULL if the file isn't a flat trie
 */
-static void freeNode(Node *node) 
+Map *mapOpenFlat(char const *path)
 {
-  if (node == NULL) return;
-  if (node->val != NULL) destroyValue(node->val);
-  for (int i = 0; i < SYM_COUNT; i++)
-    freeNode(node->child[i]);
-  free(node);
+  FlatMap *flat = openFlatMap(path);
+  if (!flat)
+    return NULL;
+  Map *m = calloc(1, sizeof(Map));
+  m->flat = flat;
+  m->count = flatCount(flat);
+  return m;
 }
 
 /**
-* Free all the memory associated with the map.
-* @param m pointer to the map that is being freed
+* Write a map out as a flat trie file
+* @param m map to write
+* @param path name of the file
+* @return returns true if the whole file was written
 */
-void freeMap(Map *m) 
+bool mapSaveFlat(Map *m, char const *path)
 {
-  freeNode(m->root);
-  free(m);
+  MapCursor *c = mapIterate(m, NULL);
+  bool ok = writeFlatMap(c, mapSize(m), path);
+  freeMapCursor(c);
+  return ok;
+}
+
+/**
+* Throw keys out of a cache until it's back under its limits, defined below removeKey.
+* @param m cache to shrink
+*/
+static void evict(Map *m);
+
+/**
+* Replay a log into a map and log every change from then on
+* @param m map to rebuild
+* @param path name of the log file
+* @param durability one of the MAP_LOG_ levels
+* @return returns true if the log was opened
+*/
+bool mapOpenLog(Map *m, char const *path, int durability)
+{
+  if (m->flat || m->wal)
+    return false;
+  //The log already has a remove for every key a cache threw out, so nothing else goes while it's replayed
+  m->replaying = true;
+  m->wal = openWal(path, durability, m);
+  m->replaying = false;
+  if (m->cache)
+    evict(m);
+  return m->wal != NULL;
+}
+
+/**
+* Report whether a map's log has failed
+* @param m map to check
+* @return returns zero, or the error from the first failed write or fsync
+*/
+int mapLogError(Map *m)
+{
+  return m->wal ? walError(m->wal) : 0;
+}
+
+/**
+* Flush and close a map's log
+* @param m map whose log to close
+* @return returns zero, or the error from the first failed write, fsync or close
+*/
+int mapCloseLog(Map *m)
+{
+  if (!m->wal)
+    return 0;
+  int err = closeWal(m->wal);
+  m->wal = NULL;
+  return err;
+}
+
+/**
+* Limit how big a map can get, turning it into a cache
+* @param m map to limit, which has to be an empty, ordinary trie
+* @param maxKeys most keys to keep, or zero for no limit
+* @param maxBytes most bytes to keep, or zero for no limit
+* @param policy MAP_EVICT_LRU or MAP_EVICT_CLOCK
+* @return returns true if the limit was set
+*/
+bool mapSetCapacity(Map *m, int maxKeys, long maxBytes, int policy)
+{
+  if (m->hash || m->flat || m->stripes || m->cache || m->count || maxKeys < 0 || maxBytes < 0)
+    return false;
+  if (policy != MAP_EVICT_LRU && policy != MAP_EVICT_CLOCK)
+    return false;
+  m->cache = makeCache(policy);
+  m->index = makeKeyIndex();
+  m->maxKeys = maxKeys;
+  m->maxBytes = maxBytes;
+  return true;
+}
+
+/**
+* Add up the bytes a cache is limited to
+* @param m cache to measure
+* @return returns the bytes in its nodes, labels, string values, key records and cache entries
+*/
+static long cacheUsage(Map *m)
+{
+  return m->pool.liveBytes + m->valueBytes + indexBytes(m->index) + cacheBytes(m->cache);
+}
+
+/**
+* Report how a cache is doing
+* @param m map to report on
+* @param stats structure to fill in
+* @return returns true if the map is a cache
+*/
+bool mapCacheStats(Map *m, MapCacheStats *stats)
+{
+  if (!m->cache && !m->timers)
+    return false;
+  *stats = (MapCacheStats) { 0 };
+  stats->policy = m->cache ? cachePolicy(m->cache) : MAP_EVICT_NONE;
+  stats->maxKeys = m->maxKeys;
+  stats->maxBytes = m->maxBytes;
+  stats->keys = m->timers ? m->count - (int) timerExpiredCount(m->timers) : m->count;
+  stats->bytes = m->cache ? cacheUsage(m) : m->pool.liveBytes + m->valueBytes;
+  stats->hits = m->hits;
+  stats->misses = m->misses;
+  stats->evictions = m->evictions;
+  stats->expirations = m->expirations;
+  return true;
+}
+
+/**
+* Read the system's real-time clock. Deadlines go in the log, so they're measured by a clock
+* that means the same thing after a restart, which a monotonic clock doesn't
+* @return returns the time in milliseconds
+*/
+static long long systemMillis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * (long long) MILLIS + ts.tv_nsec / NANOS_PER_MILLI;
+}
+
+/**
+* Get the time from a map's clock
+* @param m map to ask
+* @return returns the time in milliseconds
+*/
+static long long mapNow(Map *m)
+{
+  return m->clock ? m->clock(m->clockCtx) : systemMillis();
+}
+
+/**
+* Give a map the clock it expires keys by
+* @param m map to give the clock to
+* @param clock function reporting the time, or NULL for the system clock
+* @param ctx pointer to pass to the clock
+* @return returns true if the map hadn't started expiring keys yet
+*/
+bool mapSetClock(Map *m, MapClock clock, void *ctx)
+{
+  if (m->timers)
+    return false;
+  m->clock = clock;
+  m->clockCtx = ctx;
+  return true;
+}
+
+/**
+* Check whether a map can be changed
+* @param m map to check
+* @return returns true for a map opened from a flat trie file
+*/
+bool mapReadOnly(Map *m)
+{
+  return m->flat != NULL;
 }
 
 /**
-* Helper function to create a new trie node
+* Helper function to create a new, empty trie node of the given type. Freed nodes are
+* reused first, then nodes are carved from the newest chunk, and a new chunk is only
+* allocated when that runs out.
+* @param m map the node is for
+* @param type type tag for the node, NODE4 through NODE94
 * @return returns the node that was created
 */
-static Node *createNode() 
+static Node *createNode(Map *m, int type)
 {
-  Node *node = calloc(1, sizeof(Node));
+  NodePool *pool = &m->pool;
+  Node *node = pool->free[type];
+  if (node) {
+    //Pop a node off the free list
+    pool->free[type] = *(Node **) node;
+    pool->reuses++;
+  } else {
+    if (pool->next[type] == pool->end[type]) {
+      //Start a new chunk for this node size
+      size_t bytes = sizeof(Chunk) + CHUNK_NODES * nodeSize[type];
+      Chunk *chunk = malloc(bytes);
+      chunk->next = pool->chunks;
+      pool->chunks = chunk;
+      pool->next[type] = (char *) (chunk + 1);
+      pool->end[type] = pool->next[type] + CHUNK_NODES * nodeSize[type];
+      pool->chunkCount++;
+      pool->chunkBytes += bytes;
+    }
+    node = (Node *) pool->next[type];
+    pool->next[type] += nodeSize[type];
+  }
+  pool->allocs++;
+  pool->liveBytes += nodeSize[type];
+
+  memset(node, 0, nodeSize[type]);
+  node->type = type;
   return node;
 }
 
 /**
-* Helper function to insert or update a value in the trie
-* @param node pointer to a pointer to the node that is being updated
-* @param key key for the node
-* @param value value for the node
+* Give a node back to the pool so it can be reused.
+* @param m map the node belongs to
+* @param node node to free, its label must already be freed
+*/
+static void releaseNode(Map *m, Node *node)
+{
+  NodePool *pool = &m->pool;
+  int type = node->type;
+  *(Node **) node = pool->free[type];
+  pool->free[type] = node;
+  pool->frees++;
+  pool->liveBytes -= nodeSize[type];
+}
+
+
+/**
+* Get the characters of a node's edge label.
+* @param node node to get the label of
+* @return returns the label, which isn't null terminated
 */
-static void setHelper(Node **node, char const *key, Value *val) 
+static char *labelOf(Node *node)
 {
-  if (!*node) *node = createNode();
+  return node->labelLen > LABEL_INLINE ? node->label.heap : node->label.text;
+}
 
-  if (*key == '\0') {
-    //Replace the value at this node
-    if ((*node)->val) destroyValue((*node)->val);
-    (*node)->val = val;
+/**
+* Replace a node's edge label. The new label may be part of the old one.
+* @param m map the node belongs to
+* @param node node to relabel
+* @param str characters for the new label
+* @param len length of the new label
+*/
+static void setLabel(Map *m, Node *node, char const *str, int len)
+{
+  char *old = NULL;
+  if (node->labelLen > LABEL_INLINE) {
+    old = node->label.heap;
+    m->pool.liveBytes -= node->labelLen;
+  }
+  if (len > LABEL_INLINE) {
+    char *heap = malloc(len);
+    memcpy(heap, str, len);
+    node->label.heap = heap;
+    m->pool.liveBytes += len;
   } else {
-    //recursion for setting
-    setHelper(&((*node)->child[*key - FIRST_SYM]), key + 1, val);
+    memmove(node->label.text, str, len);
   }
+  node->labelLen = len;
+  free(old);
 }
 
 /**
-* Sets the map with a key and value
-* @param m pointer to the map to set
-* @param key key for the map
-* @param val value for the map
+* Free the figures a node keeps for its subtree, once it has no children left to keep them for.
+* @param m map the node belongs to
+* @param node node whose figures to free
 */
-void mapSet(Map *m, char const *key, Value *val) 
+static void dropFigures(Map *m, Node *node)
 {
-  setHelper(&(m->root), key, val);
+  if (node->agg) {
+    free(node->agg);
+    node->agg = NULL;
+    m->pool.liveBytes -= sizeof(MapAggregate);
+  }
 }
 
 /**
-* Helper method for the get command to get the value for the map.
-* @param node pointer to the node
-* @param key pointer to the key for the node
-* @return returns a value that the get command retrieves
+* Free a single node and its label, but not its value or children.
+* @param m map the node belongs to
+* @param node node to free
 */
-static Value *getHelper(Node *node, char const *key) 
+static void destroyNode(Map *m, Node *node)
 {
-  if (!node) return NULL;
+  if (node->labelLen > LABEL_INLINE) {
+    free(node->label.heap);
+    m->pool.liveBytes -= node->labelLen;
+  }
+  dropFigures(m, node);
+  releaseNode(m, node);
+}
 
-  if (*key == '\0') {
-    return node->val;
-  } else {
-    return getHelper(node->child[*key - FIRST_SYM], key + 1);
+/**
+* Make a new leaf node holding a value at the end of the given label.
+* @param m map the node is for
+* @param str characters for the edge label
+* @param len length of the edge label
+* @param val value to move into the leaf
+* @return returns the new node
+*/
+static Node *createLeaf(Map *m, char const *str, int len, Value *val)
+{
+  Node *node = createNode(m, NODE4);
+  setLabel(m, node, str, len);
+  moveValue(&node->val, val);
+  return node;
+}
+
+/**
+* Fill in the figures for a single value, which count it as one key and maybe one number.
+* @param agg structure to fill in
+* @param val value to count, which may be empty or NULL for no key at all
+*/
+static void aggregateOf(MapAggregate *agg, Value const *val)
+{
+  *agg = (MapAggregate) { 0 };
+  if (!val || valueEmpty(val))
+    return;
+  agg->keys = 1;
+  int type = valueType(val);
+  if (type == VALUE_INT) {
+    agg->numbers = 1;
+    agg->intSum = integerOf(val);
+    agg->min = agg->max = integerOf(val);
+  } else if (type == VALUE_DOUBLE) {
+    agg->numbers = agg->doubles = 1;
+    agg->doubleSum = doubleOf(val);
+    agg->min = agg->max = doubleOf(val);
   }
+  agg->minType = agg->maxType = type;
 }
 
-/** 
-* Gets the map and uses the helper function
-* @param m pointer to the map
-* @param key pointer to the key for the map
-* @return returns a value that is retrieved by the get command
+/**
+* Get the figures for a node's value and every key below it.
+* @param node node to get the figures for
+* @param leaf filled in with the figures for the node's value, if it has no children
+* @return returns the node's figures, or leaf if it has no children
 */
-Value *mapGet(Map *m, char const *key) 
+static MapAggregate const *figuresOf(Node const *node, MapAggregate *leaf)
 {
-  return getHelper(m->root, key);
+  if (node->agg)
+    return node->agg;
+  aggregateOf(leaf, &node->val);
+  return leaf;
 }
 
 /**
-* Helper function to remove a value from the trie
-* @param node pointer to pointer to node for the trie
-* @param key key for the trie
-* @return returns true if removed, false if not
+* Stretch the smallest and largest numbers in some figures to take in the numbers in others.
+* An integer and a double that are equal always come out as the integer, whatever order they
+* were taken in.
+* @param agg figures to stretch
+* @param first true if agg doesn't have any numbers of its own yet
+* @param from figures to take in
 */
-static bool removeHelper(Node **node, char const *key) 
+static void widen(MapAggregate *agg, bool first, MapAggregate const *from)
 {
-  if (!*node) return false;
+  if (!from->numbers)
+    return;
+  if (first || from->min < agg->min || (from->min == agg->min && from->minType == VALUE_INT)) {
+    agg->min = from->min;
+    agg->minType = from->minType;
+  }
+  if (first || from->max > agg->max || (from->max == agg->max && from->maxType == VALUE_INT)) {
+    agg->max = from->max;
+    agg->maxType = from->maxType;
+  }
+}
 
-  if (*key == '\0') {
-    if ((*node)->val) {
-      destroyValue((*node)->val);
-      (*node)->val = NULL;
-      return true;
+/**
+* Add one set of figures into another.
+* @param agg figures to add to
+* @param from figures to add
+*/
+static void combine(MapAggregate *agg, MapAggregate const *from)
+{
+  widen(agg, agg->numbers == 0, from);
+  agg->keys += from->keys;
+  agg->numbers += from->numbers;
+  agg->doubles += from->doubles;
+  agg->intSum += from->intSum;
+  agg->doubleSum += from->doubleSum;
+}
+
+/**
+* Find the slot holding the child for the given symbol.
+* @param node node to look in
+* @param sym symbol index of the child, 0 through SYM_COUNT - 1
+* @return returns a pointer to the child pointer, or NULL if there's no such child
+*/
+static Node **findChild(Node *node, int sym)
+{
+  switch (node->type) {
+  case NODE4: {
+    Node4 *n = (Node4 *) node;
+    for (int i = 0; i < node->count; i++)
+      if (n->sym[i] == sym)
+        return &n->child[i];
+    return NULL;
+  }
+  case NODE16: {
+    Node16 *n = (Node16 *) node;
+    for (int i = 0; i < node->count; i++)
+      if (n->sym[i] == sym)
+        return &n->child[i];
+    return NULL;
+  }
+  case NODE48: {
+    Node48 *n = (Node48 *) node;
+    return n->slot[sym] ? &n->child[n->slot[sym] - 1] : NULL;
+  }
+  default: {
+    Node94 *n = (Node94 *) node;
+    return n->child[sym] ? &n->child[sym] : NULL;
+  }
+  }
+}
+
+/**
+* Find the first child with a symbol at or after the given one, so children can be visited in order.
+* @param node node to look in
+* @param sym on entry, the first symbol to consider; on return, the symbol of the child found
+* @return returns the child, or NULL if there are no more children
+*/
+static Node *nextChild(Node const *node, int *sym)
+{
+  switch (node->type) {
+  case NODE4: {
+    Node4 const *n = (Node4 const *) node;
+    for (int i = 0; i < node->count; i++)
+      if (n->sym[i] >= *sym) {
+        *sym = n->sym[i];
+        return n->child[i];
+      }
+    return NULL;
+  }
+  case NODE16: {
+    Node16 const *n = (Node16 const *) node;
+    for (int i = 0; i < node->count; i++)
+      if (n->sym[i] >= *sym) {
+        *sym = n->sym[i];
+        return n->child[i];
+      }
+    return NULL;
+  }
+  case NODE48: {
+    Node48 const *n = (Node48 const *) node;
+    for (int s = *sym; s < SYM_COUNT; s++)
+      if (n->slot[s]) {
+        *sym = s;
+        return n->child[n->slot[s] - 1];
+      }
+    return NULL;
+  }
+  default: {
+    Node94 const *n = (Node94 const *) node;
+    for (int s = *sym; s < SYM_COUNT; s++)
+      if (n->child[s]) {
+        *sym = s;
+        return n->child[s];
+      }
+    return NULL;
+  }
+  }
+}
+
+/**
+* Insert a symbol/child pair into the sorted parallel arrays of a Node4 or Node16.
+* @param sym array of symbols
+* @param child array of child pointers
+* @param count number of children already in the arrays
+* @param s symbol to add
+* @param c child to add
+*/
+static void insertSorted(unsigned char *sym, Node **child, int count, int s, Node *c)
+{
+  int i = count;
+  //Shift bigger symbols up one spot
+  while (i > 0 && sym[i - 1] > s) {
+    sym[i] = sym[i - 1];
+    child[i] = child[i - 1];
+    i--;
+  }
+  sym[i] = s;
+  child[i] = c;
+}
+
+/**
+* Copy every child of one node into a newly created node of a different size, then free the old one.
+* @param m map the node belongs to
+* @param old node to copy from
+* @param type type tag for the new node
+* @return returns the new node
+*/
+static Node *resizeNode(Map *m, Node *old, int type)
+{
+  Node *node = createNode(m, type);
+  //The new node takes over the value, the label and the figures for the subtree
+  node->val = old->val;
+  node->agg = old->agg;
+  node->labelLen = old->labelLen;
+  node->label = old->label;
+
+  //Re-add each child in symbol order
+  int sym = 0;
+  Node *c;
+  while ((c = nextChild(old, &sym)) != NULL) {
+    switch (type) {
+    case NODE4: {
+      Node4 *n = (Node4 *) node;
+      n->sym[node->count] = sym;
+      n->child[node->count] = c;
+      break;
     }
-    return false;
-  } else {
-    return removeHelper(&((*node)->child[*key - FIRST_SYM]), key + 1);
+    case NODE16: {
+      Node16 *n = (Node16 *) node;
+      n->sym[node->count] = sym;
+      n->child[node->count] = c;
+      break;
+    }
+    case NODE48: {
+      Node48 *n = (Node48 *) node;
+      n->child[node->count] = c;
+      n->slot[sym] = node->count + 1;
+      break;
+    }
+    default:
+      ((Node94 *) node)->child[sym] = c;
+    }
+    node->count++;
+    sym++;
+  }
+
+  releaseNode(m, old);
+  return node;
+}
+
+/**
+* Add a child to a node that doesn't already have one for this symbol, growing the node if it's full.
+* The child's figures are added into the node's, which it gets along with its first child.
+* @param m map the node belongs to
+* @param node node to add the child to
+* @param sym symbol index for the child
+* @param c the child node
+* @return returns the node holding the new child, which is a new node if it had to grow
+*/
+static Node *addChild(Map *m, Node *node, int sym, Node *c)
+{
+  switch (node->type) {
+  case NODE4:
+    if (node->count == CAP4)
+      return addChild(m, resizeNode(m, node, NODE16), sym, c);
+    insertSorted(((Node4 *) node)->sym, ((Node4 *) node)->child, node->count, sym, c);
+    break;
+  case NODE16:
+    if (node->count == CAP16)
+      return addChild(m, resizeNode(m, node, NODE48), sym, c);
+    insertSorted(((Node16 *) node)->sym, ((Node16 *) node)->child, node->count, sym, c);
+    break;
+  case NODE48: {
+    if (node->count == CAP48)
+      return addChild(m, resizeNode(m, node, NODE94), sym, c);
+    Node48 *n = (Node48 *) node;
+    //Use the first free child slot
+    int i = 0;
+    while (n->child[i])
+      i++;
+    n->child[i] = c;
+    n->slot[sym] = i + 1;
+    break;
+  }
+  default:
+    ((Node94 *) node)->child[sym] = c;
+  }
+  node->count++;
+
+  if (!node->agg) {
+    node->agg = malloc(sizeof(MapAggregate));
+    m->pool.liveBytes += sizeof(MapAggregate);
+    aggregateOf(node->agg, &node->val);
   }
+  MapAggregate leaf;
+  combine(node->agg, figuresOf(c, &leaf));
+  return node;
 }
 
 /**
-* Removes value from the trie and uses the helper function
-* @param m pointer to the trie
-* @param key pointer to the key for the trie
-* @return returns true if value removed, false if not
+* Take the child for the given symbol out of a node, shrinking the node if it's gotten sparse.
+* The node's figures have to already leave out everything under the child.
+* @param m map the node belongs to
+* @param node node to remove the child from, it must have a child for sym
+* @param sym symbol index of the child to remove
+* @return returns the node without the child, which is a new node if it shrank
+*/
+static Node *removeChild(Map *m, Node *node, int sym)
+{
+  switch (node->type) {
+  case NODE4:
+  case NODE16: {
+    //Both small nodes start with the same layout up to their arrays
+    unsigned char *syms = node->type == NODE4 ? ((Node4 *) node)->sym : ((Node16 *) node)->sym;
+    Node **child = node->type == NODE4 ? ((Node4 *) node)->child : ((Node16 *) node)->child;
+    int i = 0;
+    while (syms[i] != sym)
+      i++;
+    //Close up the gap
+    for (; i + 1 < node->count; i++) {
+      syms[i] = syms[i + 1];
+      child[i] = child[i + 1];
+    }
+    child[i] = NULL;
+    node->count--;
+    if (node->count == 0)
+      dropFigures(m, node);
+    if (node->type == NODE16 && node->count <= SHRINK16)
+      return resizeNode(m, node, NODE4);
+    return node;
+  }
+  case NODE48: {
+    Node48 *n = (Node48 *) node;
+    n->child[n->slot[sym] - 1] = NULL;
+    n->slot[sym] = 0;
+    node->count--;
+    if (node->count <= SHRINK48)
+      return resizeNode(m, node, NODE16);
+    return node;
+  }
+  default:
+    ((Node94 *) node)->child[sym] = NULL;
+    node->count--;
+    if (node->count <= SHRINK94)
+      return resizeNode(m, node, NODE48);
+    return node;
+  }
+}
+
+/**
+* Tidy up a node after something under it was removed. A node with no value and no
+* children is freed, and one with no value and a single child is merged into that child.
+* @param m map the node belongs to
+* @param node node to tidy up
+* @return returns what should replace the node in its parent, or NULL if it's gone
+*/
+static Node *collapse(Map *m, Node *node)
+{
+  if (!valueEmpty(&node->val) || node->count > 1)
+    return node;
+  if (node->count == 0) {
+    destroyNode(m, node);
+    return NULL;
+  }
+
+  //Fold this node's label and the branch symbol into the front of the child's label
+  int sym = 0;
+  Node *c = nextChild(node, &sym);
+  int len = node->labelLen + 1 + c->labelLen;
+  char *joined = malloc(len);
+  memcpy(joined, labelOf(node), node->labelLen);
+  joined[node->labelLen] = sym + FIRST_SYM;
+  memcpy(joined + node->labelLen + 1, labelOf(c), c->labelLen);
+  setLabel(m, c, joined, len);
+  free(joined);
+
+  destroyNode(m, node);
+  return c;
+}
+
+/**
+* Work out a node's smallest and largest numbers again from its own value and its children's
+* figures, for when the number that was smallest or largest has gone.
+* @param node node to fix, whose children's figures are already right
+*/
+static void refigureExtremes(Node *node)
+{
+  MapAggregate own;
+  aggregateOf(&own, &node->val);
+  bool first = true;
+  widen(node->agg, first, &own);
+  first = !own.numbers;
+  int sym = 0;
+  Node *c;
+  while ((c = nextChild(node, &sym)) != NULL) {
+    MapAggregate leaf;
+    MapAggregate const *figures = figuresOf(c, &leaf);
+    widen(node->agg, first, figures);
+    first = first && !figures->numbers;
+    sym++;
+  }
+}
+
+/**
+* Adjust a node's figures for a value under it that changed from one thing to another. A node
+* with no children has nothing to adjust, since its figures come from its value.
+* @param node node to adjust, whose own value and children's figures are already right
+* @param old figures for the value before the change
+* @param now figures for the value after the change
+*/
+static void adjustNode(Node *node, MapAggregate const *old, MapAggregate const *now)
+{
+  MapAggregate *agg = node->agg;
+  if (!agg)
+    return;
+  agg->keys += now->keys - old->keys;
+  agg->numbers += now->numbers - old->numbers;
+  agg->doubles += now->doubles - old->doubles;
+  agg->intSum += now->intSum - old->intSum;
+  agg->doubleSum += now->doubleSum - old->doubleSum;
+  //Don't leave rounding errors behind once the last double is gone
+  if (agg->doubles == 0)
+    agg->doubleSum = 0;
+
+  //Only losing the smallest or largest number means looking at the children again
+  if (old->numbers && agg->numbers && (old->min <= agg->min || old->max >= agg->max))
+    refigureExtremes(node);
+  else
+    widen(agg, agg->numbers == now->numbers, now);
+}
+
+/**
+* Start an empty path.
+* @param path path to start
+*/
+static void initPath(Path *path)
+{
+  path->nodes = path->local;
+  path->top = 0;
+  path->cap = PATH_START;
+}
+
+/**
+* Add the next node down to a path.
+* @param path path to add to
+* @param node node to add
 */
-bool mapRemove(Map *m, char const *key) 
+static void pushPath(Path *path, Node *node)
 {
-  return removeHelper(&(m->root), key);
+  if (path->top == path->cap) {
+    path->cap *= 2;
+    if (path->nodes == path->local) {
+      path->nodes = malloc(path->cap * sizeof(Node *));
+      memcpy(path->nodes, path->local, sizeof(path->local));
+    } else {
+      path->nodes = realloc(path->nodes, path->cap * sizeof(Node *));
+    }
+  }
+  path->nodes[path->top++] = node;
+}
+
+/**
+* Adjust the figures in every node on a path, after the value of a key below them changed. The
+* nodes on the path only ever gain or lose a child at the bottom, and that's already been taken
+* care of, so they're done from the bottom up and each one can count on its children.
+* @param path nodes above the change
+* @param old figures for the key's old value
+* @param now figures for the key's new value
+*/
+static void adjustAlong(Path *path, MapAggregate const *old, MapAggregate const *now)
+{
+  //Swapping one string for another doesn't change any figures
+  if (old->keys == now->keys && !old->numbers && !now->numbers)
+    return;
+  for (int i = path->top - 1; i >= 0; i--)
+    adjustNode(path->nodes[i], old, now);
+}
+
+/**
+* Free anything a path allocated.
+* @param path path to free
+*/
+static void freePath(Path *path)
+{
+  if (path->nodes != path->local)
+    free(path->nodes);
+}
+
+/**
+* Visit every node in a trie, using an explicit stack instead of recursion so
+* deep tries can't overflow the call stack.
+* @param root root of the trie to walk
+* @param visit function to call for each node
+* @param ctx extra data passed along to visit
+*/
+static void walkNodes(Node *root, void (*visit)(Node *node, void *ctx), void *ctx)
+{
+  if (root == NULL) return;
+  int cap = STACK_START;
+  int top = 0;
+  Node **stack = malloc(cap * sizeof(Node *));
+  stack[top++] = root;
+
+  while (top > 0) {
+    Node *node = stack[--top];
+    //Push the children before the visit, so visit can free what's in the node
+    int sym = 0;
+    Node *c;
+    while ((c = nextChild(node, &sym)) != NULL) {
+      if (top == cap) {
+        cap *= 2;
+        stack = realloc(stack, cap * sizeof(Node *));
+      }
+      stack[top++] = c;
+      sym++;
+    }
+    visit(node, ctx);
+  }
+  free(stack);
+}
+
+#ifdef MAP_DEBUG
+/**
+* Node visitor that counts the nodes holding a key/value pair.
+* @param node node being visited
+* @param ctx pointer to the int count
+*/
+static void countKey(Node *node, void *ctx)
+{
+  //Assign only if not null
+  *(int *) ctx += !valueEmpty(&node->val);
+}
+
+/**
+* Node visitor that makes sure a node has figures exactly when it has children, and that its
+* counts and integer total add up from its value and its children's.
+* @param node node being visited
+* @param ctx unused
+*/
+static void checkAggregate(Node *node, void *ctx)
+{
+  MapAggregate sum;
+  aggregateOf(&sum, &node->val);
+  int sym = 0;
+  Node *c;
+  while ((c = nextChild(node, &sym)) != NULL) {
+    MapAggregate leaf;
+    combine(&sum, figuresOf(c, &leaf));
+    sym++;
+  }
+  assert(!node->agg == !node->count);
+  if (!node->agg)
+    return;
+  assert(sum.keys == node->agg->keys && sum.numbers == node->agg->numbers);
+  assert(sum.doubles == node->agg->doubles && sum.intSum == node->agg->intSum);
+  assert(!sum.numbers || (sum.min == node->agg->min && sum.max == node->agg->max));
+}
+
+/**
+* Node visitor that adds up the bytes a cache keeps track of in its nodes.
+* @param node node being visited
+* @param ctx array of two longs, for the bytes in nodes and labels and the bytes in values
+*/
+static void countCacheBytes(Node *node, void *ctx)
+{
+  long *bytes = ctx;
+  bytes[0] += nodeSize[node->type] + (node->labelLen > LABEL_INLINE ? node->labelLen : 0);
+  bytes[0] += node->agg ? sizeof(MapAggregate) : 0;
+  bytes[1] += valueBytes(&node->val);
+}
+#endif
+
+/**
+* In a MAP_DEBUG build, make sure the maintained key count matches the number of keys in the trie.
+* @param m pointer to the map to check
+*/
+static void checkCount(Map *m)
+{
+#ifdef MAP_DEBUG
+  if (m->hash || m->flat || m->stripes)
+    return;
+  int count = 0;
+  walkNodes(m->root, countKey, &count);
+  assert(m->count == count);
+  walkNodes(m->root, checkAggregate, NULL);
+  if (m->cache) {
+    long bytes[2] = { 0, 0 };
+    walkNodes(m->root, countCacheBytes, bytes);
+    assert(bytes[0] == m->pool.liveBytes && bytes[1] == m->valueBytes);
+    assert(indexSize(m->index) == m->count);
+  } else if (m->index) {
+    assert(indexSize(m->index) <= m->count);
+  }
+#else
+  (void) m;
+#endif
+}
+
+/**
+* Return the number of key/value pairs in the map, which the map keeps track of as keys come and go
+* @param m pointer to the map
+* @return returns the size of the number of pairs in the maps
+*/
+int mapSize(Map *m)
+{
+  if (m->stripes) {
+    int count = 0;
+    for (int i = 0; i < STRIPES; i++) {
+      pthread_rwlock_rdlock(&m->stripes[i].lock);
+      count += mapSize(m->stripes[i].map);
+      pthread_rwlock_unlock(&m->stripes[i].lock);
+    }
+    return count;
+  }
+  checkCount(m);
+  //Keys that have gone off are still in the trie until mapExpire() gets to them
+  return m->timers ? m->count - (int) timerExpiredCount(m->timers) : m->count;
+}
+
+/**
+* Node visitor that adds up the memory used by nodes.
+* @param node node being visited
+* @param ctx pointer to the MapStats to add this node into
+*/
+static void countNode(Node *node, void *ctx)
+{
+  MapStats *stats = ctx;
+  stats->nodes[node->type]++;
+  stats->nodeBytes += nodeSize[node->type];
+  if (node->labelLen > LABEL_INLINE)
+    stats->nodeBytes += node->labelLen;
+  if (node->agg)
+    stats->nodeBytes += sizeof(MapAggregate);
+}
+
+/**
+* Report how much memory the trie is using.
+* @param m pointer to the map
+* @param stats structure to fill in
+*/
+void mapGetStats(Map *m, MapStats *stats)
+{
+  *stats = (MapStats) { 0 };
+  if (m->stripes) {
+    //Add up the figures for every stripe
+    stats->nodeBytes = sizeof(Map) + STRIPES * sizeof(Stripe);
+    for (int i = 0; i < STRIPES; i++) {
+      MapStats part;
+      pthread_rwlock_rdlock(&m->stripes[i].lock);
+      mapGetStats(m->stripes[i].map, &part);
+      pthread_rwlock_unlock(&m->stripes[i].lock);
+      stats->keys += part.keys;
+      for (int j = 0; j < MAP_NODE_TYPES; j++)
+        stats->nodes[j] += part.nodes[j];
+      stats->nodeBytes += part.nodeBytes;
+      stats->chunks += part.chunks;
+      stats->chunkBytes += part.chunkBytes;
+      stats->nodeAllocs += part.nodeAllocs;
+      stats->nodeReuses += part.nodeReuses;
+      stats->nodeFrees += part.nodeFrees;
+    }
+    return;
+  }
+  stats->keys = m->count;
+  stats->nodeBytes = sizeof(Map);
+  if (m->hash)
+    stats->nodeBytes += hashBytes(m->hash);
+  if (m->flat)
+    stats->nodeBytes += flatBytes(m->flat);
+  walkNodes(m->root, countNode, stats);
+  stats->chunks = m->pool.chunkCount;
+  stats->chunkBytes = m->pool.chunkBytes;
+  stats->nodeAllocs = m->pool.allocs;
+  stats->nodeReuses = m->pool.reuses;
+  stats->nodeFrees = m->pool.frees;
+}
+
+/**
+* Node visitor that frees the value, label and figures in a node. The nodes
+* themselves are freed along with their chunks.
+* @param node node being visited
+* @param ctx unused
+*/
+static void freeNode(Node *node, void *ctx)
+{
+  (void) ctx;
+  clearValue(&node->val);
+  if (node->labelLen > LABEL_INLINE) free(node->label.heap);
+  free(node->agg);
+}
+
+/**
+* Free all the memory associated with the map.
+* @param m pointer to the map that is being freed
+*/
+void freeMap(Map *m)
+{
+  if (m->wal)
+    closeWal(m->wal);
+  if (m->stripes) {
+    for (int i = 0; i < STRIPES; i++) {
+      pthread_rwlock_destroy(&m->stripes[i].lock);
+      freeMap(m->stripes[i].map);
+    }
+    free(m->stripes);
+  }
+  if (m->hash)
+    freeHashTable(m->hash);
+  if (m->flat)
+    closeFlatMap(m->flat);
+  if (m->cache)
+    freeCache(m->cache);
+  if (m->index)
+    freeKeyIndex(m->index);
+  if (m->timers)
+    freeTimerWheel(m->timers);
+  walkNodes(m->root, freeNode, NULL);
+  //All the nodes go back with their chunks
+  while (m->pool.chunks) {
+    Chunk *next = m->pool.chunks->next;
+    free(m->pool.chunks);
+    m->pool.chunks = next;
+  }
+  free(m);
+}
+
+/**
+* Count how many characters of a node's edge label match the start of a key.
+* @param node node whose label to check
+* @param key rest of the key being looked up
+* @return returns the length of the match, which is labelLen if the whole label matches
+*/
+static int matchLabel(Node *node, char const *key)
+{
+  char const *label = labelOf(node);
+  int match = 0;
+  while (match < node->labelLen && key[match] == label[match])
+    match++;
+  return match;
+}
+
+/**
+* Check that a key only uses symbols the trie can store.
+* @param key key to check
+* @return returns true if every character is between FIRST_SYM and '~'
+*/
+static bool validKey(char const *key)
+{
+  for (; *key; key++)
+    if (*key < FIRST_SYM || *key - FIRST_SYM >= SYM_COUNT)
+      return false;
+  return true;
+}
+
+/**
+* Insert or update a value somewhere under a node, walking down the trie one edge at a time.
+* The node where the change happens has its figures brought up to date, and the nodes above
+* it that still need theirs adjusted are added to the path.
+* @param m map being updated
+* @param node slot in the parent (or the root pointer) holding the node to start at
+* @param key rest of the key, starting at the node's label
+* @param val value for the key, which is moved into the map
+* @param path gets the nodes passed through on the way down
+* @param old filled in with the figures for the value the key had before, if any
+* @return returns true if the key is new, false if it replaced an existing value
+*/
+static bool setBelow(Map *m, Node **node, char const *key, Value *val, Path *path, MapAggregate *old)
+{
+  aggregateOf(old, NULL);
+  while (*node) {
+    int match = matchLabel(*node, key);
+
+    if (match < (*node)->labelLen) {
+      //The key leaves the label partway through, so split the edge there
+      char const *label = labelOf(*node);
+      Node *split = createNode(m, NODE4);
+      setLabel(m, split, label, match);
+      int oldSym = label[match] - FIRST_SYM;
+      setLabel(m, *node, label + match + 1, (*node)->labelLen - match - 1);
+      //Everything under the old node is under the split too, so it starts with the old node's figures
+      split = addChild(m, split, oldSym, *node);
+      if (key[match] == '\0') {
+        moveValue(&split->val, val);
+        MapAggregate now;
+        aggregateOf(&now, &split->val);
+        combine(split->agg, &now);
+      } else
+        split = addChild(m, split, key[match] - FIRST_SYM, createLeaf(m, key + match + 1, strlen(key + match + 1), val));
+      *node = split;
+      return true;
+    }
+
+    key += match;
+    if (*key == '\0') {
+      //Replace the value at this node
+      bool added = valueEmpty(&(*node)->val);
+      aggregateOf(old, &(*node)->val);
+      moveValue(&(*node)->val, val);
+      MapAggregate now;
+      aggregateOf(&now, &(*node)->val);
+      adjustNode(*node, old, &now);
+      return added;
+    }
+
+    int sym = *key - FIRST_SYM;
+    Node **child = findChild(*node, sym);
+    if (!child) {
+      //Hang a new leaf off this node, the node may move if it has to grow
+      *node = addChild(m, *node, sym, createLeaf(m, key + 1, strlen(key + 1), val));
+      return true;
+    }
+    pushPath(path, *node);
+    node = child;
+    key++;
+  }
+
+  //The rest of the key becomes the label of a new leaf
+  *node = createLeaf(m, key, strlen(key), val);
+  return true;
+}
+
+/**
+* Find the node where a key's value is in a trie, following one edge per loop iteration
+* @param m pointer to the trie
+* @param key key to look for
+* @param path gets the nodes passed through on the way down, or NULL
+* @return returns the node, or NULL if the key isn't there
+*/
+static Node *findAlong(Map *m, char const *key, Path *path)
+{
+  Node *node = m->root;
+  while (node) {
+    //The whole edge label has to match
+    if (strncmp(labelOf(node), key, node->labelLen) != 0)
+      return NULL;
+    key += node->labelLen;
+
+    if (*key == '\0')
+      return valueEmpty(&node->val) ? NULL : node;
+    int sym = *key - FIRST_SYM;
+    if (sym < 0 || sym >= SYM_COUNT) return NULL;
+    Node **child = findChild(node, sym);
+    if (!child) return NULL;
+    if (path)
+      pushPath(path, node);
+    node = *child;
+    key++;
+  }
+  return NULL;
+}
+
+/**
+* Find the node where a key's value is in a trie
+* @param m pointer to the trie
+* @param key key to look for
+* @return returns the node, or NULL if the key isn't there
+*/
+static Node *findNode(Map *m, char const *key)
+{
+  return findAlong(m, key, NULL);
+}
+
+/**
+* Tell a cache a key was just set, defined below removeKey.
+* @param m cache that was set
+* @param key key that was set
+* @param grown change in the bytes in the key's value
+*/
+static void useKey(Map *m, char const *key, long grown);
+
+/**
+* Remove a key whose time is up, defined below removeKey.
+* @param m map to remove it from
+* @param key key to remove
+*/
+static void expireKey(Map *m, char const *key);
+
+/**
+* Set a key in a map that isn't concurrent or read-only, once the set has been logged
+* @param m pointer to the map to set
+* @param key key for the map, which the map can hold
+* @param val value for the map, left empty
+*/
+static void putKey(Map *m, char const *key, Value *val);
+
+/**
+* Sets the map with a key and value, moving the value out of the caller's Value
+* @param m pointer to the map to set
+* @param key key for the map
+* @param val value for the map, left empty
+*/
+void mapPut(Map *m, char const *key, Value *val)
+{
+  //A key the trie can't hold can't be stored, but the value is still used up
+  if (!validKey(key) || m->flat) {
+    clearValue(val);
+    return;
+  }
+  if (m->stripes) {
+    Stripe *s = stripeFor(m, key);
+    pthread_rwlock_wrlock(&s->lock);
+    uint64_t seq = m->wal ? walSet(m->wal, key, val) : 0;
+    mapPut(s->map, key, val);
+    pthread_rwlock_unlock(&s->lock);
+    //Wait for the disk after letting go of the stripe
+    if (m->wal)
+      walWait(m->wal, seq);
+    return;
+  }
+  //Log before setting, since the value is gone once the map has it
+  if (m->wal)
+    walWait(m->wal, walSet(m->wal, key, val));
+  putKey(m, key, val);
+}
+
+/**
+* Set a key in a map that isn't concurrent or read-only, once the set has been logged
+* @param m pointer to the map to set
+* @param key key for the map, which the map can hold
+* @param val value for the map, left empty
+*/
+static void putKey(Map *m, char const *key, Value *val)
+{
+  if (m->hash) {
+    if (hashSet(m->hash, key, val))
+      m->count++;
+    return;
+  }
+
+  //A cache needs the size of the value being replaced, which is gone once it's set
+  long grown = 0;
+  if (m->cache) {
+    Node *node = findNode(m, key);
+    grown = valueBytes(val) - (node ? valueBytes(&node->val) : 0);
+  }
+
+  Path path;
+  initPath(&path);
+  MapAggregate old, now;
+  aggregateOf(&now, val);
+  if (setBelow(m, &(m->root), key, val, &path, &old))
+    m->count++;
+  adjustAlong(&path, &old, &now);
+  freePath(&path);
+  //A plain set makes the key stay for good, and a key with no cache entry has no use for its record
+  KeyRecord *rec = m->timers ? indexFind(m->index, key) : NULL;
+  if (rec && rec->timer) {
+    timerCancel(m->timers, rec->timer);
+    rec->timer = NULL;
+    if (!rec->entry)
+      indexRemove(m->index, rec);
+  }
+  if (m->cache)
+    useKey(m, key, grown);
+  checkCount(m);
+}
+
+/**
+* Sets a key that expires after a while
+* @param m pointer to the map to set
+* @param key key for the map
+* @param val value for the map, left empty
+* @param ttl milliseconds until the key expires, up to MAP_TTL_MAX
+* @return returns true if the key was set
+*/
+bool mapPutTTL(Map *m, char const *key, Value *val, long long ttl)
+{
+  if (ttl <= 0 || ttl > MAP_TTL_MAX) {
+    clearValue(val);
+    return false;
+  }
+  return mapPutUntil(m, key, val, mapNow(m) + ttl);
+}
+
+/**
+* Sets a key that expires at a given time, logging the deadline along with the value
+* @param m pointer to the map to set
+* @param key key for the map
+* @param val value for the map, left empty
+* @param deadline time by the map's clock that the key expires
+* @return returns true if the key was set, or was removed because its time was already up
+*/
+bool mapPutUntil(Map *m, char const *key, Value *val, long long deadline)
+{
+  if (m->hash || m->flat || m->stripes || !validKey(key)) {
+    clearValue(val);
+    return false;
+  }
+  //Only a log being replayed has deadlines that are already gone, and those keys have expired
+  long long now = mapNow(m);
+  if (deadline <= now) {
+    clearValue(val);
+    mapRemove(m, key);
+    return true;
+  }
+  if (!m->timers)
+    m->timers = makeTimerWheel(now);
+  if (!m->index)
+    m->index = makeKeyIndex();
+  if (m->wal)
+    walWait(m->wal, walSetUntil(m->wal, key, val, deadline));
+  putKey(m, key, val);
+  //A cache can throw out the key it just set, which leaves nothing to expire
+  KeyRecord *rec = m->cache ? indexFind(m->index, key) : indexAdd(m->index, key);
+  if (rec)
+    rec->timer = timerAdd(m->timers, rec->key, deadline);
+  checkCount(m);
+  return true;
+}
+
+/**
+* Sets the map with a key and a dynamically allocated value
+* @param m pointer to the map to set
+* @param key key for the map
+* @param val value for the map, which is freed once it's been moved in
+*/
+void mapSet(Map *m, char const *key, Value *val)
+{
+  mapPut(m, key, val);
+  destroyValue(val);
+}
+
+/**
+* Look up a key in a trie. A key whose time is up goes as soon as it's found, and in a cache,
+* this counts as using the key
+* @param m pointer to the trie
+* @param key key to look for
+* @param path gets the nodes passed through on the way down, or NULL
+* @return returns the node holding the key's value, or NULL if the key isn't there
+*/
+static Node *lookup(Map *m, char const *key, Path *path)
+{
+  Node *node = findAlong(m, key, path);
+  KeyRecord *rec = node && m->index ? indexFind(m->index, key) : NULL;
+  if (rec && rec->timer && timerDeadline(rec->timer) <= mapNow(m)) {
+    expireKey(m, key);
+    node = NULL;
+  }
+  //Replaying a log isn't anyone using the keys
+  if (m->cache && !m->replaying) {
+    if (!node) {
+      m->misses++;
+      return NULL;
+    }
+    m->hits++;
+    cacheTouch(m->cache, rec->entry);
+  }
+  return node;
+}
+
+/**
+* Gets the value for a key. In a cache, this counts as using the key
+* @param m pointer to the map
+* @param key pointer to the key for the map
+* @return returns a value that is retrieved by the get command
+*/
+Value *mapGet(Map *m, char const *key)
+{
+  if (m->hash)
+    return hashGet(m->hash, key);
+  if (m->flat)
+    return flatGet(m->flat, key);
+  if (m->stripes) {
+    Stripe *s = stripeFor(m, key);
+    pthread_rwlock_rdlock(&s->lock);
+    Value *val = mapGet(s->map, key);
+    pthread_rwlock_unlock(&s->lock);
+    return val;
+  }
+  Node *node = lookup(m, key, NULL);
+  return node ? &node->val : NULL;
+}
+
+/**
+* Gets the value for a key as a string, converting it while nothing can change it
+* @param m pointer to the map
+* @param key key to look for
+* @return returns the dynamically allocated string, or NULL if the key isn't there
+*/
+char *mapGetString(Map *m, char const *key)
+{
+  if (m->stripes) {
+    Stripe *s = stripeFor(m, key);
+    pthread_rwlock_rdlock(&s->lock);
+    char *str = mapGetString(s->map, key);
+    pthread_rwlock_unlock(&s->lock);
+    return str;
+  }
+  Value *val = mapGet(m, key);
+  return val ? valueToString(val) : NULL;
+}
+
+/**
+* Looks up a key and writes its value into a buffer, while nothing else can change it
+* @param m pointer to the map
+* @param key key to look for
+* @param buf buffer to write to
+* @param cap number of bytes buf has room for
+* @return returns the length of the value as a string, or -1 if the key isn't there
+*/
+long mapFormat(Map *m, char const *key, char *buf, size_t cap)
+{
+  if (m->stripes) {
+    Stripe *s = stripeFor(m, key);
+    pthread_rwlock_rdlock(&s->lock);
+    long len = mapFormat(s->map, key, buf, cap);
+    pthread_rwlock_unlock(&s->lock);
+    return len;
+  }
+  Value *val = mapGet(m, key);
+  return val ? (long) formatValue(val, buf, cap) : -1;
+}
+
+/**
+* Adds to the value for a key in place, while nothing else can change it
+* @param m pointer to the map
+* @param key key whose value to add to
+* @param x value to add, still owned by the caller
+* @return returns true if the key was there with a value of the same type as x
+*/
+bool mapPlus(Map *m, char const *key, Value const *x)
+{
+  if (m->stripes) {
+    Stripe *s = stripeFor(m, key);
+    pthread_rwlock_wrlock(&s->lock);
+    bool ok = mapPlus(s->map, key, x);
+    uint64_t seq = ok && m->wal ? walPlus(m->wal, key, x) : 0;
+    pthread_rwlock_unlock(&s->lock);
+    if (seq)
+      walWait(m->wal, seq);
+    return ok;
+  }
+  if (m->flat)
+    return false;
+  if (m->hash) {
+    Value *val = mapGet(m, key);
+    if (!val || !valuePlus(val, x))
+      return false;
+    if (m->wal)
+      walWait(m->wal, walPlus(m->wal, key, x));
+    return true;
+  }
+
+  Path path;
+  initPath(&path);
+  Node *node = lookup(m, key, &path);
+  MapAggregate old, now;
+  aggregateOf(&old, node ? &node->val : NULL);
+  long oldBytes = node ? valueBytes(&node->val) : 0;
+  if (!node || !valuePlus(&node->val, x)) {
+    freePath(&path);
+    return false;
+  }
+  //Log the plus ahead of the removes for anything a cache throws out because of it
+  if (m->wal)
+    walWait(m->wal, walPlus(m->wal, key, x));
+  aggregateOf(&now, &node->val);
+  adjustNode(node, &old, &now);
+  adjustAlong(&path, &old, &now);
+  freePath(&path);
+  if (m->cache) {
+    m->valueBytes += valueBytes(&node->val) - oldBytes;
+    evict(m);
+  }
+  checkCount(m);
+  return true;
+}
+
+/**
+* Removes value from the trie. The node that held it is freed or merged with its only
+* child, and if it was freed its parent may need the same treatment. Nodes with no value
+* always have at least two children, so nothing further up ever changes.
+* @param m pointer to the trie, which isn't concurrent or flat
+* @param key pointer to the key for the trie
+* @return returns true if value removed, false if not
+*/
+static bool removeKey(Map *m, char const *key)
+{
+  if (m->hash) {
+    if (!hashRemove(m->hash, key))
+      return false;
+    m->count--;
+    return true;
+  }
+
+  //Slot holding the parent of the current node, and the symbol the parent uses for it
+  char const *whole = key;
+  Node **parent = NULL;
+  int parentSym = 0;
+  Node **node = &(m->root);
+  Path path;
+  initPath(&path);
+
+  bool found = false;
+  while (*node && strncmp(labelOf(*node), key, (*node)->labelLen) == 0) {
+    key += (*node)->labelLen;
+    if (*key == '\0') {
+      found = !valueEmpty(&(*node)->val);
+      break;
+    }
+
+    int sym = *key - FIRST_SYM;
+    Node **child = sym >= 0 && sym < SYM_COUNT ? findChild(*node, sym) : NULL;
+    if (!child)
+      break;
+    pushPath(&path, *node);
+    parent = node;
+    parentSym = sym;
+    node = child;
+    key++;
+  }
+  if (!found) {
+    freePath(&path);
+    return false;
+  }
+
+  MapAggregate old, none;
+  aggregateOf(&old, &(*node)->val);
+  aggregateOf(&none, NULL);
+  //The record holds the key an eviction or expiry is removing, so it's dropped last
+  KeyRecord *rec = m->index ? indexFind(m->index, whole) : NULL;
+  if (m->cache)
+    m->valueBytes -= valueBytes(&(*node)->val);
+  clearValue(&(*node)->val);
+  //Take the key out of the figures while every node on the path is still there
+  adjustNode(*node, &old, &none);
+  adjustAlong(&path, &old, &none);
+  freePath(&path);
+  *node = collapse(m, *node);
+
+  //Take the node out of its parent if it's gone
+  if (!*node && parent) {
+    *parent = removeChild(m, *parent, parentSym);
+    *parent = collapse(m, *parent);
+  }
+
+  m->count--;
+  if (rec) {
+    if (rec->timer)
+      timerCancel(m->timers, rec->timer);
+    if (rec->entry)
+      cacheDrop(m->cache, rec->entry);
+    indexRemove(m->index, rec);
+  }
+  checkCount(m);
+  return true;
+}
+
+/**
+* Remove a key whose time is up, logging it like any other remove
+* @param m map to remove it from
+* @param key key to remove, which is in the map
+*/
+static void expireKey(Map *m, char const *key)
+{
+  if (m->wal)
+    walWait(m->wal, walRemove(m->wal, key));
+  removeKey(m, key);
+  m->expirations++;
+}
+
+/**
+* Remove keys whose time is up, as many as the wheel says have gone off up to a limit
+* @param m map to clean up
+* @param max most keys to remove, or negative for all of them
+* @return returns the number of keys removed
+*/
+int mapExpire(Map *m, int max)
+{
+  if (!m->timers)
+    return 0;
+  timerAdvance(m->timers, mapNow(m));
+  int removed = 0;
+  char const *key;
+  while ((max < 0 || removed < max) && (key = timerExpired(m->timers)) != NULL) {
+    expireKey(m, key);
+    removed++;
+  }
+  return removed;
+}
+
+/**
+* Check whether a key is one the wheel has found expired but mapExpire() hasn't removed yet
+* @param m map the key is in
+* @param key key to check
+* @return returns true if the key should be left out of counts and walks
+*/
+static bool goneOff(Map *m, char const *key)
+{
+  if (!m->timers || timerExpiredCount(m->timers) == 0)
+    return false;
+  KeyRecord *rec = indexFind(m->index, key);
+  return rec && rec->timer && timerGoneOff(rec->timer);
+}
+
+/**
+* Check whether a key's time is up, whether or not the wheel has gotten to it
+* @param m map the key is in
+* @param key key to check
+* @param now current time from the map's clock
+* @return returns true if the key has a timer whose deadline has come
+*/
+static bool pastDeadline(Map *m, char const *key, long long now)
+{
+  KeyRecord *rec = m->timers ? indexFind(m->index, key) : NULL;
+  return rec && rec->timer && timerDeadline(rec->timer) <= now;
+}
+
+/**
+* Check whether any key waiting to be expired starts with a prefix
+* @param m map to check
+* @param prefix prefix for the keys
+* @return returns true if the node figures for the prefix still count an expired key
+*/
+static bool goneOffUnder(Map *m, char const *prefix)
+{
+  if (!m->timers)
+    return false;
+  size_t len = strlen(prefix);
+  for (Timer *t = timerNextExpired(m->timers, NULL); t; t = timerNextExpired(m->timers, t))
+    if (strncmp(timerKey(t), prefix, len) == 0)
+      return true;
+  return false;
+}
+
+/**
+* Throw keys out of a cache until it's back under its limits, always keeping at least one key.
+* Nothing goes while a log is being replayed.
+* @param m cache to shrink
+*/
+static void evict(Map *m)
+{
+  if (m->replaying)
+    return;
+  while (m->count > 1 && ((m->maxKeys && m->count > m->maxKeys) ||
+                          (m->maxBytes && cacheUsage(m) > m->maxBytes))) {
+    char const *key = cacheVictim(m->cache);
+    if (m->wal)
+      walWait(m->wal, walRemove(m->wal, key));
+    removeKey(m, key);
+    m->evictions++;
+  }
+}
+
+/**
+* Tell a cache a key was just set, then throw out whatever it takes to get back under the limits
+* @param m cache that was set
+* @param key key that was set
+* @param grown change in the bytes in the key's value
+*/
+static void useKey(Map *m, char const *key, long grown)
+{
+  m->valueBytes += grown;
+  KeyRecord *rec = indexAdd(m->index, key);
+  if (rec->entry)
+    cacheTouch(m->cache, rec->entry);
+  else
+    rec->entry = cacheAdd(m->cache, rec->key);
+  evict(m);
+}
+
+/**
+* Removes a key from any kind of map, logging the remove if there was anything to remove
+* @param m pointer to the map
+* @param key key to remove
+* @return returns true if the key was removed
+*/
+bool mapRemove(Map *m, char const *key)
+{
+  if (m->flat)
+    return false;
+  if (m->stripes) {
+    Stripe *s = stripeFor(m, key);
+    pthread_rwlock_wrlock(&s->lock);
+    bool removed = mapRemove(s->map, key);
+    uint64_t seq = removed && m->wal ? walRemove(m->wal, key) : 0;
+    pthread_rwlock_unlock(&s->lock);
+    if (seq)
+      walWait(m->wal, seq);
+    return removed;
+  }
+  if (!removeKey(m, key))
+    return false;
+  if (m->wal)
+    walWait(m->wal, walRemove(m->wal, key));
+  return true;
+}
+
+/**
+* Add up the keys starting with a prefix. A trie has the figures waiting in the node where the
+* prefix ends, the other kinds of map, and a prefix with keys still waiting to be expired, add up
+* each key the prefix leads to
+* @param m map to look in
+* @param prefix prefix for the keys, or NULL for all of them
+* @param agg filled in with the figures
+*/
+void mapAggregate(Map *m, char const *prefix, MapAggregate *agg)
+{
+  aggregateOf(agg, NULL);
+  if (!prefix) prefix = "";
+  if (m->stripes) {
+    //Only one stripe can hold keys starting with a non-empty prefix
+    Stripe *only = *prefix ? stripeFor(m, prefix) : NULL;
+    for (int i = 0; i < STRIPES; i++) {
+      Stripe *s = &m->stripes[i];
+      if (only && s != only)
+        continue;
+      MapAggregate part;
+      pthread_rwlock_rdlock(&s->lock);
+      mapAggregate(s->map, prefix, &part);
+      pthread_rwlock_unlock(&s->lock);
+      combine(agg, &part);
+    }
+    return;
+  }
+  //The node figures still count keys waiting to be expired, so those prefixes add up what's left
+  if (m->hash || m->flat || goneOffUnder(m, prefix)) {
+    MapCursor *c = mapIterate(m, prefix);
+    char const *key;
+    Value *val;
+    while (mapNext(c, &key, &val)) {
+      MapAggregate one;
+      aggregateOf(&one, val);
+      combine(agg, &one);
+    }
+    freeMapCursor(c);
+    return;
+  }
+
+  //Follow the prefix down to the node whose subtree holds every key starting with it
+  Node *node = m->root;
+  while (node) {
+    int match = matchLabel(node, prefix);
+    if (prefix[match] == '\0') {
+      MapAggregate leaf;
+      *agg = *figuresOf(node, &leaf);
+      return;
+    }
+    if (match < node->labelLen)
+      return;
+    prefix += match;
+    int sym = *prefix - FIRST_SYM;
+    if (sym < 0 || sym >= SYM_COUNT) return;
+    Node **child = findChild(node, sym);
+    if (!child) return;
+    node = *child;
+    prefix++;
+  }
+}
+
+/** A key in a batch, along with where it was in the caller's arrays. */
+typedef struct {
+  /** The key. */
+  char const *key;
+
+  /** Index of the key in the caller's arrays. */
+  int index;
+} BatchKey;
+
+/** One node on the path a batch keeps from the root toward the last key it handled. */
+typedef struct {
+  /** The node. */
+  Node *node;
+
+  /** Number of key characters before this node's label. */
+  int depth;
+} Step;
+
+/**
+* Compare two batch keys by key, then by position so equal keys stay in their original order.
+* @param a pointer to the first BatchKey
+* @param b pointer to the second BatchKey
+* @return returns negative, zero or positive like strcmp
+*/
+static int compareBatchKeys(void const *a, void const *b)
+{
+  BatchKey const *x = a;
+  BatchKey const *y = b;
+  int cmp = strcmp(x->key, y->key);
+  return cmp ? cmp : x->index - y->index;
+}
+
+/**
+* Sort the keys in a batch, so keys that share a prefix end up next to each other.
+* @param keys keys in the batch
+* @param n number of keys
+* @param maxLen set to the length of the longest key
+* @return returns a dynamically allocated, sorted array of the keys
+*/
+static BatchKey *sortBatch(char const **keys, int n, int *maxLen)
+{
+  BatchKey *order = malloc(n * sizeof(BatchKey));
+  *maxLen = 0;
+  for (int i = 0; i < n; i++) {
+    order[i] = (BatchKey) { keys[i], i };
+    int len = strlen(keys[i]);
+    if (len > *maxLen)
+      *maxLen = len;
+  }
+  qsort(order, n, sizeof(BatchKey), compareBatchKeys);
+  return order;
+}
+
+/**
+* Back up the batch path to the deepest node that the new key reaches the same way the last key did.
+* @param path the path
+* @param top number of steps on the path, updated
+* @param prev last key handled, or NULL
+* @param key next key to handle
+*/
+static void backUp(Step *path, int *top, char const *prev, char const *key)
+{
+  int shared = 0;
+  if (prev)
+    while (prev[shared] && prev[shared] == key[shared])
+      shared++;
+  while (*top > 0 && path[*top - 1].depth > shared)
+    (*top)--;
+}
+
+/**
+* Look up a key, starting from the end of the batch path and extending the path as it goes.
+* @param m map to look in
+* @param path path from the root, updated
+* @param top number of steps on the path, updated
+* @param key key to find
+* @return returns the value, or NULL if the key isn't there
+*/
+static Value *getAlong(Map *m, Step *path, int *top, char const *key)
+{
+  if (*top == 0) {
+    if (!m->root) return NULL;
+    path[(*top)++] = (Step) { m->root, 0 };
+  }
+  Node *node = path[*top - 1].node;
+  int depth = path[*top - 1].depth;
+  while (true) {
+    if (strncmp(labelOf(node), key + depth, node->labelLen) != 0)
+      return NULL;
+    depth += node->labelLen;
+    if (key[depth] == '\0')
+      return valueEmpty(&node->val) ? NULL : &node->val;
+
+    int sym = key[depth] - FIRST_SYM;
+    if (sym < 0 || sym >= SYM_COUNT) return NULL;
+    Node **child = findChild(node, sym);
+    if (!child) return NULL;
+    node = *child;
+    PREFETCH(node);
+    depth++;
+    path[(*top)++] = (Step) { node, depth };
+  }
+}
+
+/**
+* Look up a batch of keys. The keys are handled in sorted order, and each lookup starts
+* from the deepest node it shares with the lookup before it instead of from the root.
+* @param m map to look in
+* @param keys keys to look up
+* @param vals filled in with the value for each key, or NULL for keys that aren't there
+* @param n number of keys
+*/
+void mapGetBatch(Map *m, char const **keys, Value **vals, int n)
+{
+  if (m->hash || m->flat || m->stripes) {
+    for (int i = 0; i < n; i++)
+      vals[i] = mapGet(m, keys[i]);
+    return;
+  }
+  //Keys whose time is up are left out but not removed, since that could move values already found
+  long long now = m->timers ? mapNow(m) : 0;
+  if (m->cache) {
+    //Every key counts as a hit or a miss, and the ones found as used
+    for (int i = 0; i < n; i++) {
+      Node *node = findNode(m, keys[i]);
+      if (node && pastDeadline(m, keys[i], now))
+        node = NULL;
+      if (node) {
+        m->hits++;
+        cacheTouch(m->cache, indexFind(m->index, keys[i])->entry);
+      } else {
+        m->misses++;
+      }
+      vals[i] = node ? &node->val : NULL;
+    }
+    return;
+  }
+
+  int maxLen;
+  BatchKey *order = sortBatch(keys, n, &maxLen);
+  Step *path = malloc((maxLen + 2) * sizeof(Step));
+  int top = 0;
+  for (int i = 0; i < n; i++) {
+    backUp(path, &top, i ? order[i - 1].key : NULL, order[i].key);
+    if (i + 1 < n)
+      PREFETCH(order[i + 1].key);
+    Value *val = getAlong(m, path, &top, order[i].key);
+    vals[order[i].index] = val && pastDeadline(m, order[i].key, now) ? NULL : val;
+  }
+  free(path);
+  free(order);
+}
+
+/**
+* Set a key, starting from the end of the batch path. Replacing a value leaves the trie's shape
+* alone, but anything else can move or split the node where the change happens, so that node
+* comes off the path and the change is made through the slot that holds it.
+* @param m map being updated
+* @param path path from the root, updated
+* @param top number of steps on the path, updated
+* @param key key to set
+* @param val value for the key
+* @param above gets the nodes above the change, whose figures still need adjusting
+* @param old filled in with the figures for the value the key had before, if any
+* @return returns true if the key is new
+*/
+static bool setAlong(Map *m, Step *path, int *top, char const *key, Value *val, Path *above,
+                     MapAggregate *old)
+{
+  if (*top == 0) {
+    if (!m->root)
+      return setBelow(m, &(m->root), key, val, above, old);
+    path[(*top)++] = (Step) { m->root, 0 };
+  }
+  while (true) {
+    Node *node = path[*top - 1].node;
+    int depth = path[*top - 1].depth;
+    if (matchLabel(node, key + depth) == node->labelLen) {
+      int end = depth + node->labelLen;
+      if (key[end] == '\0') {
+        bool added = valueEmpty(&node->val);
+        aggregateOf(old, &node->val);
+        moveValue(&node->val, val);
+        MapAggregate now;
+        aggregateOf(&now, &node->val);
+        adjustNode(node, old, &now);
+        for (int i = 0; i + 1 < *top; i++)
+          pushPath(above, path[i].node);
+        return added;
+      }
+      Node **child = findChild(node, key[end] - FIRST_SYM);
+      if (child) {
+        PREFETCH(*child);
+        path[(*top)++] = (Step) { *child, end + 1 };
+        continue;
+      }
+    }
+
+    //Find the slot holding this node, then let setBelow change things from there
+    Node **slot = *top == 1 ? &(m->root) : findChild(path[*top - 2].node, key[depth - 1] - FIRST_SYM);
+    (*top)--;
+    for (int i = 0; i < *top; i++)
+      pushPath(above, path[i].node);
+    return setBelow(m, slot, key + depth, val, above, old);
+  }
+}
+
+/**
+* Set a batch of keys, moving all the values into the map. The keys are handled in sorted order
+* (keeping the original order for repeated keys, so the last one wins), and each one starts from
+* the deepest node it shares with the key before it.
+* @param m map to update
+* @param keys keys to set
+* @param vals value for each key, each left empty
+* @param n number of keys
+*/
+void mapSetBatch(Map *m, char const **keys, Value *vals, int n)
+{
+  if (m->hash || m->flat || m->stripes || m->cache || m->timers) {
+    for (int i = 0; i < n; i++)
+      mapPut(m, keys[i], &vals[i]);
+    return;
+  }
+
+  //The log gets the sets in the caller's order, so replaying them leaves the same value for a repeated key
+  uint64_t seq = 0;
+  for (int i = 0; m->wal && i < n; i++)
+    if (validKey(keys[i]))
+      seq = walSet(m->wal, keys[i], &vals[i]);
+
+  int maxLen;
+  BatchKey *order = sortBatch(keys, n, &maxLen);
+  Step *path = malloc((maxLen + 2) * sizeof(Step));
+  int top = 0;
+  char const *prev = NULL;
+  for (int i = 0; i < n; i++) {
+    char const *key = order[i].key;
+    Value *val = &vals[order[i].index];
+    if (!validKey(key)) {
+      clearValue(val);
+      continue;
+    }
+    backUp(path, &top, prev, key);
+    Path above;
+    initPath(&above);
+    MapAggregate old, now;
+    aggregateOf(&now, val);
+    if (setAlong(m, path, &top, key, val, &above, &old))
+      m->count++;
+    adjustAlong(&above, &old, &now);
+    freePath(&above);
+    prev = key;
+  }
+  free(path);
+  free(order);
+  checkCount(m);
+  if (seq)
+    walWait(m->wal, seq);
+}
+
+/** One node on a cursor's path from the root, along with how far it's gotten. */
+typedef struct {
+  /** The node. */
+  Node *node;
+
+  /** Next child symbol to look at, or -1 if the node's own value hasn't been visited yet. */
+  int sym;
+
+  /** Length of the key up to the end of this node's label. */
+  int len;
+} Frame;
+
+/** State for walking over the keys in a map, in order. */
+struct MapCursorStruct {
+  /** Stack of nodes from the start of the walk down to the current node. */
+  Frame *stack;
+
+  /** Number of frames on the stack, and how many there's room for. */
+  int top, cap;
+
+  /** Key for the current node, built up from labels and branch symbols. */
+  char *key;
+
+  /** Capacity of the key buffer. */
+  int keyCap;
+
+  /** Lower and upper bounds on the keys to visit, or NULL for none. */
+  char *low, *high;
+
+  /** True once the walk has gotten to keys that are at least low. */
+  bool pastLow;
+
+  /** For a hash or flat map, the sorted pairs to visit, or NULL for a trie map. */
+  HashPair *pairs;
+
+  /** For a flat map, the block holding the keys in pairs. */
+  char *pairText;
+
+  /** For a concurrent map, the map being walked, or NULL for an ordinary map. */
+  Map *striped;
+
+  /** Index of the stripe being walked, whose lock the cursor holds while inner is in use. */
+  int stripe;
+
+  /** Cursor over the current stripe, or NULL between stripes. */
+  MapCursor *inner;
+
+  /** For a concurrent map, the prefix to pass to each stripe's cursor. */
+  char *prefix;
+
+  /** Number of pairs, and index of the next one to visit. */
+  int pairCount, pairPos;
+
+  /** For a trie map with timers, the map, so keys waiting to be expired can be skipped. */
+  Map *timed;
+};
+
+/**
+* Make sure a cursor's key buffer has room for a key of the given length, plus a null terminator.
+* @param c cursor to check
+* @param len length of key that needs to fit
+*/
+static void reserveKey(MapCursor *c, int len)
+{
+  if (len + 1 > c->keyCap) {
+    while (len + 1 > c->keyCap)
+      c->keyCap *= 2;
+    c->key = realloc(c->key, c->keyCap);
+  }
+}
+
+/**
+* Copy a string so a cursor can keep it.
+* @param str string to copy, or NULL
+* @return returns a dynamically allocated copy, or NULL if str was NULL
+*/
+static char *copyBound(char const *str)
+{
+  if (!str) return NULL;
+  char *copy = malloc(strlen(str) + 1);
+  strcpy(copy, str);
+  return copy;
+}
+
+/**
+* Start visiting a node, whose key so far is already in the cursor's buffer. If every
+* key under the node is below the cursor's lower bound, the node is skipped.
+* @param c cursor doing the walk
+* @param node node to visit
+* @param len length of the key up to the end of the node's label
+*/
+static void pushFrame(MapCursor *c, Node *node, int len)
+{
+  if (c->low && !c->pastLow) {
+    c->key[len] = '\0';
+    //Unless the key so far leads toward low, every key down here is either all smaller or all bigger
+    if (strncmp(c->low, c->key, len) != 0 && strcmp(c->key, c->low) < 0)
+      return;
+  }
+  if (c->top == c->cap) {
+    c->cap *= 2;
+    c->stack = realloc(c->stack, c->cap * sizeof(Frame));
+  }
+  c->stack[c->top++] = (Frame) { node, -1, len };
+}
+
+/**
+* Make a cursor with nothing on its stack yet.
+* @param low lower bound on keys, or NULL
+* @param high upper bound on keys, or NULL
+* @return returns the new cursor
+*/
+static MapCursor *makeCursor(char const *low, char const *high)
+{
+  MapCursor *c = malloc(sizeof(MapCursor));
+  c->cap = STACK_START;
+  c->top = 0;
+  c->stack = malloc(c->cap * sizeof(Frame));
+  c->keyCap = KEY_START;
+  c->key = malloc(c->keyCap);
+  c->low = copyBound(low);
+  c->high = copyBound(high);
+  c->pastLow = false;
+  c->pairs = NULL;
+  c->pairText = NULL;
+  c->striped = NULL;
+  c->stripe = -1;
+  c->inner = NULL;
+  c->prefix = NULL;
+  c->timed = NULL;
+  return c;
+}
+
+/**
+* Walk over keys starting with a prefix. The walk starts at the node where the prefix ends,
+* so nothing outside that subtree is ever looked at.
+* @param m map to walk over
+* @param prefix prefix for the keys, or NULL for all of them
+* @return returns the new cursor
+*/
+MapCursor *mapIterate(Map *m, char const *prefix)
+{
+  MapCursor *c = makeCursor(NULL, NULL);
+  if (m->stripes) {
+    c->striped = m;
+    c->prefix = copyBound(prefix);
+    return c;
+  }
+  if (m->hash) {
+    c->pairs = hashSorted(m->hash, prefix, NULL, NULL, &c->pairCount);
+    c->pairPos = 0;
+    return c;
+  }
+  if (m->flat) {
+    c->pairs = flatSorted(m->flat, prefix, NULL, NULL, &c->pairCount, &c->pairText);
+    c->pairPos = 0;
+    return c;
+  }
+  if (!prefix) prefix = "";
+  c->timed = m->timers ? m : NULL;
+
+  //Follow the prefix down, copying the path into the key buffer
+  Node *node = m->root;
+  int len = 0;
+  char const *rest = prefix;
+  while (node) {
+    reserveKey(c, len + node->labelLen + 1);
+    memcpy(c->key + len, labelOf(node), node->labelLen);
+    int match = matchLabel(node, rest);
+    len += node->labelLen;
+    if (rest[match] == '\0') {
+      //The prefix ends somewhere in this node's label, so the whole subtree matches
+      pushFrame(c, node, len);
+      break;
+    }
+    if (match < node->labelLen)
+      break;
+
+    rest += match;
+    int sym = *rest - FIRST_SYM;
+    if (sym < 0 || sym >= SYM_COUNT) break;
+    Node **child = findChild(node, sym);
+    if (!child) break;
+    c->key[len++] = *rest++;
+    node = *child;
+  }
+  return c;
+}
+
+/**
+* Walk over keys in a range, skipping any subtree that's entirely below low.
+* @param m map to walk over
+* @param low smallest key to visit, or NULL
+* @param high largest key to visit, or NULL
+* @return returns the new cursor
+*/
+MapCursor *mapRange(Map *m, char const *low, char const *high)
+{
+  MapCursor *c = makeCursor(low, high);
+  if (m->stripes) {
+    c->striped = m;
+    return c;
+  }
+  if (m->hash) {
+    c->pairs = hashSorted(m->hash, NULL, low, high, &c->pairCount);
+    c->pairPos = 0;
+    return c;
+  }
+  if (m->flat) {
+    c->pairs = flatSorted(m->flat, NULL, low, high, &c->pairCount, &c->pairText);
+    c->pairPos = 0;
+    return c;
+  }
+  c->timed = m->timers ? m : NULL;
+  if (m->root) {
+    reserveKey(c, m->root->labelLen);
+    memcpy(c->key, labelOf(m->root), m->root->labelLen);
+    pushFrame(c, m->root, m->root->labelLen);
+  }
+  return c;
+}
+
+/**
+* Advance the cursor. Each node's own key comes before the keys in its subtree,
+* and children are visited in symbol order, so keys come out in strcmp order.
+* @param c cursor to advance
+* @param key set to the next key
+* @param val set to the value for the next key
+* @return returns true if there was another key
+*/
+bool mapNext(MapCursor *c, char const **key, Value **val)
+{
+  //Stripes are in key order, so walking them one after another keeps the keys in order
+  while (c->striped) {
+    if (c->inner && mapNext(c->inner, key, val))
+      return true;
+    if (c->inner) {
+      freeMapCursor(c->inner);
+      c->inner = NULL;
+      pthread_rwlock_unlock(&c->striped->stripes[c->stripe].lock);
+    }
+    if (c->stripe + 1 == STRIPES)
+      return false;
+    Stripe *s = &c->striped->stripes[++c->stripe];
+    pthread_rwlock_rdlock(&s->lock);
+    c->inner = c->low || c->high ? mapRange(s->map, c->low, c->high) : mapIterate(s->map, c->prefix);
+  }
+
+  if (c->pairs) {
+    if (c->pairPos == c->pairCount)
+      return false;
+    *key = c->pairs[c->pairPos].key;
+    *val = c->pairs[c->pairPos++].val;
+    return true;
+  }
+
+  while (c->top > 0) {
+    Frame *f = &c->stack[c->top - 1];
+
+    if (f->sym < 0) {
+      //Visit the node's own value before its children
+      f->sym = 0;
+      if (valueEmpty(&f->node->val))
+        continue;
+      c->key[f->len] = '\0';
+      if (c->low && !c->pastLow) {
+        if (strcmp(c->key, c->low) < 0)
+          continue;
+        c->pastLow = true;
+      }
+      if (c->high && strcmp(c->key, c->high) > 0) {
+        //Everything after this is bigger too
+        c->top = 0;
+        return false;
+      }
+      if (c->timed && goneOff(c->timed, c->key))
+        continue;
+      *key = c->key;
+      *val = &f->node->val;
+      return true;
+    }
+
+    Node *child = nextChild(f->node, &f->sym);
+    if (!child) {
+      c->top--;
+      continue;
+    }
+
+    //Extend the key with the branch symbol and the child's label
+    int len = f->len;
+    reserveKey(c, len + 1 + child->labelLen);
+    c->key[len] = f->sym + FIRST_SYM;
+    memcpy(c->key + len + 1, labelOf(child), child->labelLen);
+    f->sym++;
+    pushFrame(c, child, len + 1 + child->labelLen);
+  }
+  return false;
+}
+
+/**
+* Free a cursor.
+* @param c cursor to free
+*/
+void freeMapCursor(MapCursor *c)
+{
+  if (c->inner) {
+    freeMapCursor(c->inner);
+    pthread_rwlock_unlock(&c->striped->stripes[c->stripe].lock);
+  }
+  free(c->prefix);
+  free(c->pairs);
+  free(c->pairText);
+  free(c->stack);
+  free(c->key);
+  free(c->low);
+  free(c->high);
+  free(c);
 }
@@ -13,11 +13,293 @@
 /** Incomplete type for the Map representation. */
 typedef struct MapStruct Map;
 
+/** Incomplete type for a cursor that walks over the keys in a map. */
+typedef struct MapCursorStruct MapCursor;
+
+/** Kind of map that stores its keys in a trie, kept in order. */
+#define MAP_TRIE 0
+
+/** Kind of map that stores its keys in a hash table, for fast lookups of single keys. */
+#define MAP_HASH 1
+
+/** Log level that writes changes out in big blocks but leaves flushing them to disk to the system. */
+#define MAP_LOG_BUFFERED 0
+
+/** Log level that flushes every few milliseconds, so a crash loses at most the last few changes. */
+#define MAP_LOG_GROUP 1
+
+/** Log level where every change is flushed to disk before the function making it returns. */
+#define MAP_LOG_SYNC 2
+
+/** Eviction policy that throws out the key used longest ago. */
+#define MAP_EVICT_LRU 0
+
+/** Eviction policy that sweeps a hand over the keys, giving each one used
+    since the hand last went by another chance, which is close to LRU but
+    cheaper every time a key is used. */
+#define MAP_EVICT_CLOCK 1
+
+/** Policy reported by mapCacheStats() for a map that has keys with a
+    time to live but no limit on its size. */
+#define MAP_EVICT_NONE -1
+
+/** Longest time to live mapPutTTL() takes, in milliseconds (365 days
+    a year for a hundred years). */
+#define MAP_TTL_MAX 3153600000000LL
+
+/** Number of different node sizes the trie is built from (4, 16, 48 and 94 children). */
+#define MAP_NODE_TYPES 4
+
+/** Memory usage figures for a map, filled in by mapGetStats(). */
+typedef struct {
+  /** Number of key/value pairs in the map. */
+  int keys;
+
+  /** Number of trie nodes of each size, smallest first. */
+  int nodes[ MAP_NODE_TYPES ];
+
+  /** Bytes used by the map itself and all of its trie nodes (or hash table slots
+      and keys), including the values stored in them but not the characters
+      of string values. */
+  long nodeBytes;
+
+  /** Number of chunks the node pool has allocated. */
+  long chunks;
+
+  /** Total bytes in those chunks, including space not handed out yet. */
+  long chunkBytes;
+
+  /** Number of nodes handed out by the pool, including reused ones. */
+  long nodeAllocs;
+
+  /** Number of those nodes that were recycled from the free list. */
+  long nodeReuses;
+
+  /** Number of nodes given back to the pool. */
+  long nodeFrees;
+} MapStats;
+
+/** Figures for a map used as a cache, with a limit on its size or keys
+    that expire, filled in by mapCacheStats(). */
+typedef struct {
+  /** MAP_EVICT_LRU, MAP_EVICT_CLOCK or MAP_EVICT_NONE. */
+  int policy;
+
+  /** Most keys the map will hold, or zero for no limit. */
+  int maxKeys;
+
+  /** Most bytes the map will hold, or zero for no limit. */
+  long maxBytes;
+
+  /** Number of keys in the map now. */
+  int keys;
+
+  /** Bytes in the map's trie nodes, their edge labels and the characters
+      of its string values. */
+  long bytes;
+
+  /** Number of lookups that found their key, and that didn't. */
+  long hits, misses;
+
+  /** Number of keys thrown out to stay under the limits. */
+  long evictions;
+
+  /** Number of keys removed because their time to live ran out. */
+  long expirations;
+} MapCacheStats;
+
+/** Function a map calls to find out the time, for expiring keys.
+    @param ctx Pointer given to mapSetClock() along with the function.
+    @return current time in milliseconds, which must never go backward.
+*/
+typedef long long (*MapClock)( void *ctx );
+
+/** Figures for the keys that start with some prefix, filled in by
+    mapAggregate(). */
+typedef struct {
+  /** Number of keys. */
+  int keys;
+
+  /** Number of those keys whose values are numbers. */
+  int numbers;
+
+  /** Number of the numbers that are doubles, the rest are integers. */
+  int doubles;
+
+  /** VALUE_INT or VALUE_DOUBLE, for the kind of value min and max came from. */
+  unsigned char minType, maxType;
+
+  /** Total of the integer values, which can't overflow like an int would. */
+  long long intSum;
+
+  /** Total of the double values. */
+  double doubleSum;
+
+  /** Smallest and largest of the numbers, if there are any. */
+  double min, max;
+} MapAggregate;
+
 /** Make an empty map.
     @return pointer to a new map representation.
 */
 Map *makeMap();
 
+/** Make an empty map using a particular implementation.  Every map
+    function works the same on either kind of map.
+    @param kind MAP_TRIE or MAP_HASH.
+    @return pointer to a new map representation.
+*/
+Map *makeMapOfKind( int kind );
+
+/** Make an empty map that several threads can use at once.  Keys are
+    split into stripes by their first character, each with its own
+    reader-writer lock, so readers never wait for each other and a writer
+    only holds up readers of the same stripe.  Values handed out by
+    mapGet() can be changed or freed by another thread as soon as it
+    returns, so threads that share a map should read through
+    mapGetString() and update through mapPlus() instead.  A cursor holds a
+    read lock on the stripe it's in until it moves on or is freed, so the
+    thread using it mustn't change the map.
+    @param kind MAP_TRIE or MAP_HASH, for the map inside each stripe.
+    @return pointer to the new map.
+*/
+Map *makeConcurrentMap( int kind );
+
+/** Open a read-only map that looks keys up straight out of a flat trie
+    file written by mapSaveFlat().  The file is mapped into memory rather
+    than read, so opening it is quick no matter how big it is.  mapSet()
+    and mapRemove() leave the map unchanged.
+    @param path Name of the file to open.
+    @return pointer to the new map, or NULL if the file isn't a flat trie.
+*/
+Map *mapOpenFlat( char const *path );
+
+/** Write every key / value pair in a map to a flat trie file that
+    mapOpenFlat() can open.
+    @param m Map to write.
+    @param path Name of the file to write.
+    @return true if the whole file was written.
+*/
+bool mapSaveFlat( Map *m, char const *path );
+
+/** Report whether a map is read-only, i.e., was opened with mapOpenFlat().
+    @param m Pointer to the map.
+    @return true if the map can't be changed.
+*/
+bool mapReadOnly( Map *m );
+
+/** Rebuild a map from a log file, then keep logging every set, remove
+    and plus made to it, so the map can be rebuilt again after a crash.
+    Replaying reads binary records, which is much faster than running
+    the commands that made the changes.  Each change is logged right
+    before (or after) it's made, while nothing else can change the same
+    key, and changes made at about the same time are written and flushed
+    to disk together.  The log is flushed and closed by freeMap().
+    @param m Map to rebuild, which shouldn't be read-only or have a log already.
+    @param path Name of the log file, which is created if it isn't there.
+    @param durability MAP_LOG_BUFFERED, MAP_LOG_GROUP or MAP_LOG_SYNC.
+    @return true if the log was opened.
+*/
+bool mapOpenLog( Map *m, char const *path, int durability );
+
+/** Report whether a map's log has failed.  A change whose write or fsync
+    fails isn't durable, and since nothing after it could be replayed, the
+    log stops writing altogether.  The map itself keeps working.
+    @param m Map to check.
+    @return zero if the map has no log or everything handed to the log so
+    far has been written, or the errno from the first failure.
+*/
+int mapLogError( Map *m );
+
+/** Flush and close a map's log, so the map stops logging changes.
+    freeMap() does the same, but can't say whether it worked.
+    @param m Map whose log to close.
+    @return zero if the map had no log or all of it made it to disk, or the
+    errno from the first write, fsync or close that failed.
+*/
+int mapCloseLog( Map *m );
+
+/** Put a limit on how big a map can get, so it can be used as a cache.
+    Once a set (or a plus that makes a string longer) takes the map over
+    either limit, keys are thrown out in the order the policy picks until
+    it's back under, though the key that was just set is always kept.
+    Every set, successful lookup and plus counts as using a key, and the
+    policy's order is kept up to date in constant time on each one.  Keys
+    that are thrown out are logged as removes if the map has a log.  Only
+    an empty trie map that isn't concurrent or read-only can be limited.
+    @param m Map to limit.
+    @param maxKeys Most keys to keep, or zero for no limit on keys.
+    @param maxBytes Most bytes of nodes and string values to keep, or zero
+    for no limit on bytes.
+    @param policy MAP_EVICT_LRU or MAP_EVICT_CLOCK.
+    @return true if the limit was set.
+*/
+bool mapSetCapacity( Map *m, int maxKeys, long maxBytes, int policy );
+
+/** Report a cache's limits, size, and how lookups, evictions and
+    expirations have gone.
+    @param m Map to report on.
+    @param stats Structure to fill in.
+    @return true if the map has a limit from mapSetCapacity() or has had a
+    key set with a time to live.
+*/
+bool mapCacheStats( Map *m, MapCacheStats *stats );
+
+/** Give a map the clock it uses to expire keys, in place of the system's
+    real-time clock, e.g. so tests can control time.  Deadlines in a log are
+    measured by the clock, so a map replaying a log needs the same kind of
+    clock it was written with, and needs it before the log is opened.
+    @param m Map to give the clock to, which can't have had any key set
+    with a time to live yet.
+    @param clock Function that reports the time, or NULL for the system clock.
+    @param ctx Pointer passed to the clock every time it's called.
+    @return true if the map will use the clock.
+*/
+bool mapSetClock( Map *m, MapClock clock, void *ctx );
+
+/** Set a key like mapPut(), but have it expire after a while.  Until it
+    expires, it's like any other key.  Once its time is up, looking it up
+    finds nothing and removes it right then, and keys nobody looks up are
+    removed a few at a time by mapExpire().  Setting the key again with
+    mapPut() makes it stay for good.  Expiring keys are kept track of in a
+    timer wheel, so nothing ever has to scan the map for them.  A map with
+    a log logs the time the key expires, and logs a remove when it goes.
+    The time to live isn't saved in snapshots, so a key loaded from one stays.
+    Only a trie map that isn't concurrent or read-only can expire keys.
+    @param m Map to add a key/value pair to.
+    @param key Key to add to map.
+    @param val Value to move into the map, which is left empty even if the
+    key can't be stored.
+    @param ttl Number of milliseconds before the key expires, more than zero
+    and no more than MAP_TTL_MAX.
+    @return true if the key was set.
+*/
+bool mapPutTTL( Map *m, char const *key, Value *val, long long ttl );
+
+/** Set a key like mapPutTTL(), but have it expire at a given time instead
+    of after a while.  This is how a log puts back a key with a time to
+    live, and a key whose time is already up is removed instead of set.
+    @param m Map to add a key/value pair to.
+    @param key Key to add to map.
+    @param val Value to move into the map, which is left empty even if the
+    key can't be stored.
+    @param deadline Time the key expires, in milliseconds by the map's clock.
+    @return true if the key was set, or removed because its time was up.
+*/
+bool mapPutUntil( Map *m, char const *key, Value *val, long long deadline );
+
+/** Remove keys whose time to live has run out.  Calling this with a small
+    limit after each operation keeps the map from holding on to expired
+    keys without any one call taking long.  Until it does, mapSize(),
+    mapAggregate(), mapIterate() and mapRange() leave out the keys the last
+    call found expired without removing them, and mapGetBatch() finds
+    nothing for any key whose time is up.
+    @param m Map to clean up.
+    @param max Most keys to remove, or a negative number for no limit.
+    @return number of keys removed.
+*/
+int mapExpire( Map *m, int max );
+
 /** Return the size of the given map.
     @param m Pointer to the map.
     @return Number of key/value pairs in the map. */
@@ -32,8 +314,21 @@ int mapSize( Map *m );
 */
 void mapSet( Map *m, char const *key, Value *val );
 
+/** Add a new key / value pair like mapSet(), but move the value out of a
+    Value the caller keeps, e.g. one on the stack, instead of taking over a
+    dynamically allocated one.  Numbers are stored right in the map, so
+    setting one this way doesn't allocate anything for the value.
+    @param m Map to add a key/value pair to.
+    @param key Key to add to map.
+    @param val Value to move into the map, which is left empty even if the
+    key can't be stored.
+*/
+void mapPut( Map *m, char const *key, Value *val );
+
 /** Return the value associated with the given key. The returned Value
     is still owned by the map.  The caller can use it but shouldn't free it.
+    Values are stored inside the map, so the pointer is only good until the
+    map is next changed, which looking up a key that's expired does too.
     @param m Map to query.
     @param key Key to look for in the map.
     @return Value associated with the given key, or NULL if the key
@@ -41,6 +336,36 @@ void mapSet( Map *m, char const *key, Value *val );
 */
 Value *mapGet( Map *m, char const *key );
 
+/** Look up a key and return its value as a string, made while no other
+    thread can change the value.
+    @param m Map to query.
+    @param key Key to look for in the map.
+    @return dynamically allocated string for the value, or NULL if the key
+    isn't in the map.
+*/
+char *mapGetString( Map *m, char const *key );
+
+/** Look up a key and write its value into a buffer, formatted the same
+    way as mapGetString() and while no other thread can change it.
+    @param m Map to query.
+    @param key Key to look for in the map.
+    @param buf Buffer to write to.
+    @param cap Number of bytes buf has room for.
+    @return length of the formatted value, which didn't fit if it's cap or
+    more, or -1 if the key isn't in the map.
+*/
+long mapFormat( Map *m, char const *key, char *buf, size_t cap );
+
+/** Add to the value for a key in place, using the value's plus operation,
+    while no other thread can change it.
+    @param m Map to update.
+    @param key Key whose value gets added to.
+    @param x Value to add, which is still owned by the caller.
+    @return true if the key was in the map with a value of the same type
+    as x, and the map isn't read-only.
+*/
+bool mapPlus( Map *m, char const *key, Value const *x );
+
 /** Remove a key / value pair from the given map.
     @param m Map to remove a key from
     @param key Key to look for and remove in the map.
@@ -49,6 +374,76 @@ Value *mapGet( Map *m, char const *key );
 */
 bool mapRemove( Map *m, char const *key );
 
+/** Measure how much memory the given map is using for its structure.
+    @param m Map to measure.
+    @param stats Structure to fill in with the map's memory usage.
+*/
+void mapGetStats( Map *m, MapStats *stats );
+
+/** Add up the keys that start with a prefix, and the numbers stored
+    under them.  A trie keeps these figures for every subtree up to date as
+    keys are set, added to and removed, so this only has to find where the
+    prefix ends.  The other kinds of map go over the keys one at a time.
+    Totals of doubles are kept as running sums, so they can be off in the
+    last few bits from adding the values up fresh.
+    @param m Map to look in.
+    @param prefix Only count keys starting with this, or NULL for all keys.
+    @param agg Structure to fill in.
+*/
+void mapAggregate( Map *m, char const *prefix, MapAggregate *agg );
+
+/** Set a whole batch of keys at once.  This works the same as calling
+    mapSet() on each key in order, but keys that share a prefix share the
+    work of getting to it.  Each value is moved into the map, like mapPut().
+    @param m Map to add the key/value pairs to.
+    @param keys Array of keys to set.
+    @param vals Array with a value for each key, which are all left empty.
+    @param n Number of keys.
+*/
+void mapSetBatch( Map *m, char const **keys, Value *vals, int n );
+
+/** Look up a whole batch of keys at once, sharing the work of getting to
+    common prefixes.
+    @param m Map to look in.
+    @param keys Array of keys to look up.
+    @param vals Array to fill in with the value for each key, or NULL if
+    the key isn't in the map.
+    @param n Number of keys.
+*/
+void mapGetBatch( Map *m, char const **keys, Value **vals, int n );
+
+/** Start walking over all the keys in the map that begin with the given
+    prefix, in increasing (strcmp) order.  Keys are found one at a time as
+    the cursor advances, they aren't collected up front.  The map must not
+    be changed while the cursor is in use.
+    @param m Map to walk over.
+    @param prefix Only visit keys starting with this, or NULL for all keys.
+    @return new cursor, to be freed with freeMapCursor().
+*/
+MapCursor *mapIterate( Map *m, char const *prefix );
+
+/** Start walking over the keys between low and high (inclusive) in
+    increasing order.  The map must not be changed while the cursor is in use.
+    @param m Map to walk over.
+    @param low Smallest key to visit, or NULL to start at the first key.
+    @param high Largest key to visit, or NULL to go to the last key.
+    @return new cursor, to be freed with freeMapCursor().
+*/
+MapCursor *mapRange( Map *m, char const *low, char const *high );
+
+/** Advance a cursor to the next key.
+    @param c Cursor to advance.
+    @param key Set to the next key, which is only good until the cursor moves again.
+    @param val Set to the value for that key, which is still owned by the map.
+    @return true if there was another key, false if the cursor is done.
+*/
+bool mapNext( MapCursor *c, char const **key, Value **val );
+
+/** Free the memory used by a cursor.
+    @param c Cursor to free.
+*/
+void freeMapCursor( MapCursor *c );
+
 /** Free all the memory used to store a map, including all the
     memory in its key/value pairs.
     @param m The map to free.
@@ -0,0 +1,249 @@
+/**
+ * @file mapBench.c
+ * @author David Mond (dmmond)
+ * Benchmark for the map. Builds a set of long keys that share long prefixes, then times
+ * setting, getting and removing all of them and reports nanoseconds per operation. Then it
+ * runs a random mix of sets, gets and removes on short keys. Everything is run once with
+ * the trie and once with the hash table, so the two can be compared. Last, it times appending
+ * to one string value with mapPlus over longer and longer runs, where the time for each append
+ * should stay flat as the string grows.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "map.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** Default number of keys to use. */
+#define KEY_COUNT 20000
+/** Default length of each key, the driver accepts keys up to 1023 characters. */
+#define KEY_LENGTH 1000
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+/** Keys are made of this many different characters after their shared prefix. */
+#define KEY_SYMS 4
+/** Number of times to repeat the lookups, so they run long enough to time. */
+#define GET_ROUNDS 5
+/** Length of the keys for the mixed workload. */
+#define SHORT_LENGTH 8
+/** Number of operations in the mixed workload, for each key. */
+#define MIX_ROUNDS 10
+/** Out of 100 operations in the mix, this many are sets. */
+#define MIX_SET 30
+/** Out of 100 operations in the mix, this many are removes, the rest are gets. */
+#define MIX_REMOVE 20
+/** Percent scale for the operation mix. */
+#define PERCENT 100
+/** String added to the value on each append. */
+#define APPEND_PIECE "abcdefgh"
+/** Number of appends in the shortest run. */
+#define APPEND_START 1000
+/** Number of appends in the longest run. */
+#define APPEND_MOST 1000000
+/** Each run of appends is this many times longer than the one before. */
+#define APPEND_GROWTH 10
+/** Room for the name of a run of appends. */
+#define NAME_LENGTH 32
+
+/**
+ * Get the current time from a monotonic clock.
+ * @return returns the time in nanoseconds
+ */
+static long long now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANOS + ts.tv_nsec;
+}
+
+/**
+ * Print the time taken by one phase of the benchmark.
+ * @param name name of the phase
+ * @param ops number of map operations in the phase
+ * @param start time the phase started
+ */
+static void report(char const *name, long ops, long long start)
+{
+  long long elapsed = now() - start;
+  printf("%-8s %10ld ops %10.1f ns/op\n", name, ops, (double) elapsed / ops);
+}
+
+/**
+ * Make the keys for the benchmark. The first half of every key is the same, so lookups
+ * have to get through a long stretch of shared path before the keys branch apart.
+ * @param count number of keys to make
+ * @param len length of each key
+ * @param shared true if the keys should share the first half, false for fully random keys
+ * @return returns a dynamically allocated array of dynamically allocated keys
+ */
+static char **makeKeys(int count, int len, bool shared)
+{
+  char **keys = malloc(count * sizeof(char *));
+  for (int i = 0; i < count; i++) {
+    keys[i] = malloc(len + 1);
+    for (int j = 0; j < len; j++) {
+      if (!shared)
+        keys[i][j] = '!' + rand() % ('~' - '!' + 1);
+      else if (j < len / 2)
+        keys[i][j] = 'a' + j % 26;
+      else
+        keys[i][j] = 'A' + rand() % KEY_SYMS;
+    }
+    keys[i][len] = '\0';
+  }
+  return keys;
+}
+
+/**
+ * Free the keys made by makeKeys.
+ * @param keys array of keys
+ * @param count number of keys
+ */
+static void freeKeys(char **keys, int count)
+{
+  for (int i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+}
+
+/**
+ * Put the keys in a random order, so each phase visits the trie differently.
+ * @param keys array of keys to shuffle
+ * @param count number of keys
+ */
+static void shuffle(char **keys, int count)
+{
+  for (int i = count - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    char *tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+/** Names for the two kinds of map, indexed by kind. */
+static char const *kindName[] = { "trie", "hash" };
+
+/**
+ * Time setting, getting and removing every key in turn.
+ * @param kind kind of map to use
+ * @param keys keys to use
+ * @param count number of keys
+ * @return returns true if every key was found again
+ */
+static bool runPhases(int kind, char **keys, int count)
+{
+  printf("%s:\n", kindName[kind]);
+  Map *m = makeMapOfKind(kind);
+  long long start = now();
+  for (int i = 0; i < count; i++)
+    mapSet(m, keys[i], parseInteger("1"));
+  report("set", count, start);
+
+  shuffle(keys, count);
+  long found = 0;
+  start = now();
+  for (int r = 0; r < GET_ROUNDS; r++)
+    for (int i = 0; i < count; i++)
+      found += mapGet(m, keys[i]) != NULL;
+  report("get", (long) count * GET_ROUNDS, start);
+
+  MapStats stats;
+  mapGetStats(m, &stats);
+  printf("%d keys, %ld node bytes\n", mapSize(m), stats.nodeBytes);
+
+  shuffle(keys, count);
+  start = now();
+  for (int i = 0; i < count; i++)
+    mapRemove(m, keys[i]);
+  report("remove", count, start);
+
+  freeMap(m);
+  return found == (long) count * GET_ROUNDS;
+}
+
+/**
+ * Time a random mix of sets, gets and removes. The same random sequence is used for each
+ * kind of map.
+ * @param kind kind of map to use
+ * @param keys keys to pick from
+ * @param count number of keys
+ */
+static void runMix(int kind, char **keys, int count)
+{
+  long ops = (long) count * MIX_ROUNDS;
+  Map *m = makeMapOfKind(kind);
+  //Start with half the keys in the map
+  for (int i = 0; i < count; i += 2)
+    mapSet(m, keys[i], parseInteger("1"));
+
+  srand(count);
+  long long start = now();
+  for (long i = 0; i < ops; i++) {
+    char const *key = keys[rand() % count];
+    int op = rand() % PERCENT;
+    if (op < MIX_SET)
+      mapSet(m, key, parseInteger("2"));
+    else if (op < MIX_SET + MIX_REMOVE)
+      mapRemove(m, key);
+    else
+      mapGet(m, key);
+  }
+  char name[ SHORT_LENGTH * 2 ];
+  sprintf(name, "mix/%s", kindName[kind]);
+  report(name, ops, start);
+  freeMap(m);
+}
+
+/**
+ * Time appending to a single string value, for runs of increasing length.
+ */
+static void runAppends()
+{
+  Value piece;
+  initString(&piece, APPEND_PIECE, strlen(APPEND_PIECE));
+  for (long n = APPEND_START; n <= APPEND_MOST; n *= APPEND_GROWTH) {
+    Map *m = makeMap();
+    mapSet(m, "s", makeString("", 0));
+    long long start = now();
+    for (long i = 0; i < n; i++)
+      mapPlus(m, "s", &piece);
+    char name[ NAME_LENGTH ];
+    sprintf(name, "plus/%ld", n);
+    report(name, n, start);
+    freeMap(m);
+  }
+  clearValue(&piece);
+}
+
+/**
+ * Run the benchmark.
+ * @param argc number of command-line arguments
+ * @param argv optional key count and key length
+ * @return returns exit success
+ */
+int main(int argc, char *argv[])
+{
+  int count = argc > 1 ? atoi(argv[1]) : KEY_COUNT;
+  int len = argc > 2 ? atoi(argv[2]) : KEY_LENGTH;
+  srand(1);
+  char **keys = makeKeys(count, len, true);
+  printf("%d keys of length %d\n", count, len);
+  bool ok = runPhases(MAP_TRIE, keys, count) && runPhases(MAP_HASH, keys, count);
+  freeKeys(keys, count);
+
+  keys = makeKeys(count, SHORT_LENGTH, false);
+  printf("%d%% set, %d%% remove, %d%% get on %d keys of length %d\n",
+         MIX_SET, MIX_REMOVE, PERCENT - MIX_SET - MIX_REMOVE, count, SHORT_LENGTH);
+  runMix(MAP_TRIE, keys, count);
+  runMix(MAP_HASH, keys, count);
+  freeKeys(keys, count);
+
+  printf("appending \"%s\" to one string value\n", APPEND_PIECE);
+  runAppends();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,187 @@
+/**
+ * @file mapStress.c
+ * @author David Mond (dmmond)
+ * Multi-threaded stress test for the concurrent map. Fills a map with short keys, then for
+ * 1, 2, 4, ... up to the requested number of reader threads, runs the readers against the map
+ * while one writer thread keeps setting and adding to random keys. Reports how many reads per
+ * second the readers managed together, and how that compares to a single reader.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "map.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/** Number of keys in the map. */
+#define KEY_COUNT 100000
+/** Length of each key. */
+#define KEY_LENGTH 8
+/** Default number of seconds to run each round. */
+#define SECONDS 1
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+/** Threads only check the clock once every this many operations. */
+#define CLOCK_EVERY 1024
+/** Out of 100 writes, this many are sets, the rest are adds. */
+#define WRITE_SET 50
+/** Percent scale for the write mix. */
+#define PERCENT 100
+
+/** Everything one thread needs for a round. */
+typedef struct {
+  /** Map being tested. */
+  Map *m;
+
+  /** Keys to pick from. */
+  char **keys;
+
+  /** Time to stop, in nanoseconds. */
+  long long deadline;
+
+  /** Seed for this thread's random numbers. */
+  unsigned int seed;
+
+  /** Set to the number of operations the thread did. */
+  long ops;
+} Worker;
+
+/**
+ * Get the current time from a monotonic clock.
+ * @return returns the time in nanoseconds
+ */
+static long long now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANOS + ts.tv_nsec;
+}
+
+/**
+ * Reader thread, looks up random keys until the deadline.
+ * @param arg the thread's Worker
+ * @return returns NULL
+ */
+static void *reader(void *arg)
+{
+  Worker *w = arg;
+  long ops = 0;
+  do {
+    for (int i = 0; i < CLOCK_EVERY; i++) {
+      char *str = mapGetString(w->m, w->keys[rand_r(&w->seed) % KEY_COUNT]);
+      free(str);
+    }
+    ops += CLOCK_EVERY;
+  } while (now() < w->deadline);
+  w->ops = ops;
+  return NULL;
+}
+
+/**
+ * Writer thread, sets and adds to random keys until the deadline.
+ * @param arg the thread's Worker
+ * @return returns NULL
+ */
+static void *writer(void *arg)
+{
+  Worker *w = arg;
+  Value *one = makeInteger(1);
+  long ops = 0;
+  do {
+    for (int i = 0; i < CLOCK_EVERY; i++) {
+      char const *key = w->keys[rand_r(&w->seed) % KEY_COUNT];
+      if (rand_r(&w->seed) % PERCENT < WRITE_SET)
+        mapSet(w->m, key, makeInteger(i));
+      else
+        mapPlus(w->m, key, one);
+    }
+    ops += CLOCK_EVERY;
+  } while (now() < w->deadline);
+  destroyValue(one);
+  w->ops = ops;
+  return NULL;
+}
+
+/**
+ * Run one round with the given number of readers and one writer.
+ * @param m map to test
+ * @param keys keys to pick from
+ * @param readers number of reader threads
+ * @param seconds how long to run
+ * @param writes set to the number of writes done
+ * @return returns the number of reads done
+ */
+static long runRound(Map *m, char **keys, int readers, int seconds, long *writes)
+{
+  long long deadline = now() + (long long) seconds * NANOS;
+  Worker *w = malloc((readers + 1) * sizeof(Worker));
+  pthread_t *t = malloc((readers + 1) * sizeof(pthread_t));
+  for (int i = 0; i <= readers; i++) {
+    w[i] = (Worker) { m, keys, deadline, i + 1, 0 };
+    pthread_create(&t[i], NULL, i == readers ? writer : reader, &w[i]);
+  }
+  long reads = 0;
+  for (int i = 0; i <= readers; i++) {
+    pthread_join(t[i], NULL);
+    if (i < readers)
+      reads += w[i].ops;
+  }
+  *writes = w[readers].ops;
+  free(t);
+  free(w);
+  return reads;
+}
+
+/**
+ * Run the stress test.
+ * @param argc number of command-line arguments
+ * @param argv optional most reader threads and seconds per round
+ * @return returns exit success
+ */
+int main(int argc, char *argv[])
+{
+  int most = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+  int seconds = argc > 2 ? atoi(argv[2]) : SECONDS;
+  if (most < 1)
+    most = 1;
+
+  srand(1);
+  char **keys = malloc(KEY_COUNT * sizeof(char *));
+  Map *m = makeConcurrentMap(MAP_TRIE);
+  for (int i = 0; i < KEY_COUNT; i++) {
+    keys[i] = malloc(KEY_LENGTH + 1);
+    for (int j = 0; j < KEY_LENGTH; j++)
+      keys[i][j] = '!' + rand() % ('~' - '!' + 1);
+    keys[i][KEY_LENGTH] = '\0';
+    mapSet(m, keys[i], makeInteger(i));
+  }
+
+  printf("%d keys, 1 writer, %d second rounds, %ld cores online\n", mapSize(m), seconds,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  double base = 0;
+  //Double the readers each round, finishing with exactly the most asked for
+  for (int readers = 1; ; readers *= 2) {
+    if (readers > most)
+      readers = most;
+    long writes;
+    long reads = runRound(m, keys, readers, seconds, &writes);
+    double rate = (double) reads / seconds;
+    if (readers == 1)
+      base = rate;
+    printf("%3d readers %12.0f reads/s %6.2fx %12.0f writes/s\n", readers, rate, rate / base,
+           (double) writes / seconds);
+    if (readers == most)
+      break;
+  }
+
+  freeMap(m);
+  for (int i = 0; i < KEY_COUNT; i++)
+    free(keys[i]);
+  free(keys);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,293 @@
+/**
+ * @file server.c
+ * @author David Mond (dmmond)
+ * Serves driver commands over a Unix domain socket. The main thread accepts connections and
+ * puts them on a queue, and a fixed pool of worker threads takes them off and runs a session
+ * for each one against the shared map. Every reply is flushed as soon as its command is done,
+ * so a client can send one command at a time and wait for the answer.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "server.h"
+#include "command.h"
+#include "input.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** Number of connections the system will hold before they're accepted. */
+#define BACKLOG 64
+/** Initial capacity of the connection queue. */
+#define QUEUE_START 16
+/** Nanoseconds to wait before trying accept() again after it fails, e.g. when the process is
+    out of file descriptors, so a failure that won't go away doesn't spin. */
+#define ACCEPT_PAUSE 100000000L
+
+/** Short name for the server state, which workers point back to. */
+typedef struct ServerStruct Server;
+
+/** One worker thread, and the connection it's serving. */
+typedef struct {
+  /** Server the worker belongs to. */
+  Server *srv;
+
+  /** Connection being served, or -1 while waiting for one. */
+  int fd;
+} Worker;
+
+/** State shared by the accepting thread and the workers. */
+struct ServerStruct {
+  /** Map every session runs against. */
+  Map *map;
+
+  /** Kind of map inside the shared map. */
+  int kind;
+
+  /** Socket that connections are accepted on. */
+  int listenFd;
+
+  /** Lock for the queue and the stopping flag. */
+  pthread_mutex_t lock;
+
+  /** Signalled when a connection is queued or the server is stopping. */
+  pthread_cond_t ready;
+
+  /** Circular queue of accepted connections waiting for a worker. */
+  int *queue;
+
+  /** Index of the oldest connection, how many are waiting, and room in the queue. */
+  int head, count, cap;
+
+  /** True once a client has asked the server to shut down. */
+  bool stopping;
+
+  /** Every worker, so stopping can cut off the connections they're serving. */
+  Worker *workers;
+
+  /** Number of workers. */
+  int threads;
+};
+
+/**
+* Add an accepted connection to the queue and wake a worker.
+* @param srv server to queue it on
+* @param fd the connection
+*/
+static void enqueue(Server *srv, int fd)
+{
+  pthread_mutex_lock(&srv->lock);
+  if (srv->count == srv->cap) {
+    //Unroll the circular queue into a bigger array
+    int *bigger = malloc(srv->cap * 2 * sizeof(int));
+    for (int i = 0; i < srv->count; i++)
+      bigger[i] = srv->queue[(srv->head + i) % srv->cap];
+    free(srv->queue);
+    srv->queue = bigger;
+    srv->head = 0;
+    srv->cap *= 2;
+  }
+  srv->queue[(srv->head + srv->count++) % srv->cap] = fd;
+  pthread_cond_signal(&srv->ready);
+  pthread_mutex_unlock(&srv->lock);
+}
+
+/**
+* Wait for a connection to serve, and note it as the one the worker is serving.
+* @param w worker that will serve it
+* @return returns the connection, or -1 once the server is stopping
+*/
+static int dequeue(Worker *w)
+{
+  Server *srv = w->srv;
+  pthread_mutex_lock(&srv->lock);
+  while (srv->count == 0 && !srv->stopping)
+    pthread_cond_wait(&srv->ready, &srv->lock);
+  int fd = -1;
+  if (!srv->stopping) {
+    fd = srv->queue[srv->head];
+    srv->head = (srv->head + 1) % srv->cap;
+    srv->count--;
+  }
+  w->fd = fd;
+  pthread_mutex_unlock(&srv->lock);
+  return fd;
+}
+
+/**
+* Note that a worker is done with its connection, so stopping won't touch it once it's closed.
+* @param w worker that's done
+*/
+static void finished(Worker *w)
+{
+  pthread_mutex_lock(&w->srv->lock);
+  w->fd = -1;
+  pthread_mutex_unlock(&w->srv->lock);
+}
+
+/**
+* Stop taking new connections. Shutting down the listening socket wakes up accept(), and
+* shutting down the reading side of every connection being served makes its worker see the
+* end of its input once it's done with the command it's on, instead of waiting on an idle client.
+* @param srv server to stop
+*/
+static void stopServer(Server *srv)
+{
+  pthread_mutex_lock(&srv->lock);
+  srv->stopping = true;
+  pthread_cond_broadcast(&srv->ready);
+  for (int i = 0; i < srv->threads; i++)
+    if (srv->workers[i].fd >= 0)
+      shutdown(srv->workers[i].fd, SHUT_RD);
+  pthread_mutex_unlock(&srv->lock);
+  shutdown(srv->listenFd, SHUT_RDWR);
+}
+
+/**
+* Run the commands sent on one connection until the client quits or hangs up.
+* @param w worker serving the connection
+* @param fd the connection
+*/
+static void serve(Worker *w, int fd)
+{
+  Server *srv = w->srv;
+  LineReader *in = makeLineReader(fd);
+  int outFd = dup(fd);
+  FILE *out = outFd < 0 ? NULL : fdopen(outFd, "w");
+  if (!out) {
+    //Out of descriptors or memory, so drop just this connection
+    fprintf(stderr, "connection: %s\n", strerror(errno));
+    if (outFd >= 0)
+      close(outFd);
+    freeLineReader(in);
+    finished(w);
+    close(fd);
+    return;
+  }
+  Session *s = makeSession(srv->map, srv->kind, SESSION_CONCURRENT | SESSION_SHARED, out);
+  sessionFlush(s);
+  fflush(out);
+  char *line;
+  while ((line = nextLine(in, NULL)) != NULL) {
+    if (strcmp(line, "shutdown") == 0) {
+      stopServer(srv);
+      break;
+    }
+    bool more = runLine(s, line);
+    //The client waits for each reply before sending more
+    sessionFlush(s);
+    fflush(out);
+    if (!more)
+      break;
+  }
+  freeSession(s);
+  fclose(out);
+  freeLineReader(in);
+  finished(w);
+  close(fd);
+}
+
+/**
+* Worker thread, serves connections from the queue until the server stops.
+* @param arg the Worker
+* @return returns NULL
+*/
+static void *worker(void *arg)
+{
+  Worker *w = arg;
+  int fd;
+  while ((fd = dequeue(w)) >= 0)
+    serve(w, fd);
+  return NULL;
+}
+
+/**
+* Serve commands on a Unix domain socket
+* @param path name for the socket
+* @param threads number of worker threads
+* @param m shared map
+* @param kind kind of map inside m
+* @return returns EXIT_SUCCESS, or EXIT_FAILURE if the socket couldn't be set up
+*/
+int runServer(char const *path, int threads, Map *m, int kind)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket name too long: %s\n", path);
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, path);
+
+  Server srv = { .map = m, .kind = kind, .listenFd = socket(AF_UNIX, SOCK_STREAM, 0) };
+  unlink(path);
+  if (srv.listenFd < 0 || bind(srv.listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(srv.listenFd, BACKLOG) != 0) {
+    perror(path);
+    if (srv.listenFd >= 0)
+      close(srv.listenFd);
+    return EXIT_FAILURE;
+  }
+
+  //A client hanging up in the middle of a reply shouldn't kill the server
+  signal(SIGPIPE, SIG_IGN);
+  pthread_mutex_init(&srv.lock, NULL);
+  pthread_cond_init(&srv.ready, NULL);
+  srv.cap = QUEUE_START;
+  srv.queue = malloc(srv.cap * sizeof(int));
+
+  srv.threads = threads;
+  srv.workers = malloc(threads * sizeof(Worker));
+  pthread_t *pool = malloc(threads * sizeof(pthread_t));
+  for (int i = 0; i < threads; i++) {
+    srv.workers[i] = (Worker) { &srv, -1 };
+    pthread_create(&pool[i], NULL, worker, &srv.workers[i]);
+  }
+
+  //Last error accept() reported, so one that keeps happening is only printed once
+  int reported = 0;
+  while (true) {
+    int fd = accept(srv.listenFd, NULL, NULL);
+    if (fd >= 0) {
+      reported = 0;
+      enqueue(&srv, fd);
+      continue;
+    }
+    int err = errno;
+    pthread_mutex_lock(&srv.lock);
+    bool stopping = srv.stopping;
+    pthread_mutex_unlock(&srv.lock);
+    if (stopping)
+      break;
+    if (err == EINTR || err == ECONNABORTED)
+      continue;
+    if (err != reported) {
+      fprintf(stderr, "accept: %s\n", strerror(err));
+      reported = err;
+    }
+    //Give connections being served a chance to finish and free up what ran out
+    nanosleep(&(struct timespec) { 0, ACCEPT_PAUSE }, NULL);
+  }
+
+  for (int i = 0; i < threads; i++)
+    pthread_join(pool[i], NULL);
+  //Connections that never got a worker are just closed
+  for (int i = 0; i < srv.count; i++)
+    close(srv.queue[(srv.head + i) % srv.cap]);
+  free(pool);
+  free(srv.workers);
+  free(srv.queue);
+  pthread_cond_destroy(&srv.ready);
+  pthread_mutex_destroy(&srv.lock);
+  close(srv.listenFd);
+  unlink(path);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,26 @@
+/**
+ * @file server.h
+ * @author David Mond (dmmond)
+ * Header file for server.c, serves driver commands over a Unix domain socket.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "map.h"
+
+/** Accept connections on a Unix domain socket and run the commands sent on
+    each one against a shared map, replying with the same output the driver
+    prints.  A pool of worker threads each serve one connection at a time.
+    Runs until a client sends the shutdown command.  Connections being
+    served then finish the command they're on and are closed, even if their
+    clients are still connected.
+    @param path Name for the socket, which is replaced if it's already there.
+    @param threads Number of worker threads.
+    @param m Map to share, which should be made with makeConcurrentMap().
+    @param kind MAP_TRIE or MAP_HASH, the kind of map inside m.
+    @return EXIT_SUCCESS, or EXIT_FAILURE if the socket couldn't be set up.
+*/
+int runServer( char const *path, int threads, Map *m, int kind );
+
+#endif
@@ -0,0 +1,327 @@
+/**
+ * @file snapshot.c
+ * @author David Mond (dmmond)
+ * Saves a map to a compact binary file and loads it back. A snapshot is a short header
+ * followed by the pairs in key order. Each key only stores the part that's different from
+ * the key before it, and all the lengths and integers are stored as variable-length numbers,
+ * so a snapshot is usually much smaller than the commands that built the map. Loading maps
+ * the whole file into memory and reads it in one pass, feeding the sorted keys to the map in
+ * batches so neighbouring keys share the walk down the trie.
+ *
+ * Layout, with every number in little-endian order:
+ *   magic "P6MP", version byte, three zero bytes, varint pair count
+ *   for each pair: varint shared prefix length, varint suffix length, suffix characters,
+ *                  type byte, then the value
+ *   integer values are zigzag varints, doubles are their 8 bytes, strings are a varint
+ *   length and their characters
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Characters every snapshot starts with. */
+#define MAGIC "P6MP"
+/** Length of the magic string. */
+#define MAGIC_LEN 4
+/** Version of the snapshot layout written by this code. */
+#define VERSION 1
+/** Bytes in the header before the pair count. */
+#define HEADER_LEN 8
+/** Bits of a number stored in each varint byte. */
+#define VARINT_BITS 7
+/** Flag on a varint byte when more bytes follow. */
+#define VARINT_MORE 0x80
+/** Most bytes a 64-bit varint can take. */
+#define VARINT_MAX 10
+/** Bytes in a stored double. */
+#define DOUBLE_BYTES 8
+/** Bits in a byte. */
+#define BYTE_BITS 8
+/** Number of pairs to hand to the map at once while loading. */
+#define LOAD_BATCH 1024
+
+/**
+* Write a number as a varint.
+* @param fp file to write to
+* @param x number to write
+*/
+static void writeVarint(FILE *fp, uint64_t x)
+{
+  while (x >= VARINT_MORE) {
+    putc((int) (x & (VARINT_MORE - 1)) | VARINT_MORE, fp);
+    x >>= VARINT_BITS;
+  }
+  putc((int) x, fp);
+}
+
+/**
+* Write one value, starting with its type byte.
+* @param fp file to write to
+* @param v value to write
+*/
+static void writeValue(FILE *fp, Value const *v)
+{
+  int type = valueType(v);
+  putc(type, fp);
+  if (type == VALUE_INT) {
+    //Zigzag so small negative numbers stay short
+    int64_t x = integerOf(v);
+    writeVarint(fp, ((uint64_t) x << 1) ^ (uint64_t) (x >> (sizeof(x) * BYTE_BITS - 1)));
+  } else if (type == VALUE_DOUBLE) {
+    double d = doubleOf(v);
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    for (int i = 0; i < DOUBLE_BYTES; i++)
+      putc((int) (bits >> (i * BYTE_BITS)) & 0xFF, fp);
+  } else {
+    char const *str = stringOf(v);
+    size_t len = stringLength(v);
+    writeVarint(fp, len);
+    fwrite(str, 1, len, fp);
+  }
+}
+
+/**
+* Save a map to a snapshot file
+* @param m map to save
+* @param path name of the file to write
+* @return returns true if the whole snapshot was written
+*/
+bool mapSave(Map *m, char const *path)
+{
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return false;
+
+  fwrite(MAGIC, 1, MAGIC_LEN, fp);
+  putc(VERSION, fp);
+  for (int i = MAGIC_LEN + 1; i < HEADER_LEN; i++)
+    putc(0, fp);
+  writeVarint(fp, mapSize(m));
+
+  //Keys come out of the cursor in order, so each one shares what it can with the last
+  char *prev = malloc(1);
+  size_t prevLen = 0;
+  MapCursor *c = mapIterate(m, NULL);
+  char const *key;
+  Value *val;
+  while (mapNext(c, &key, &val)) {
+    size_t len = strlen(key);
+    size_t shared = 0;
+    while (shared < prevLen && shared < len && prev[shared] == key[shared])
+      shared++;
+    writeVarint(fp, shared);
+    writeVarint(fp, len - shared);
+    fwrite(key + shared, 1, len - shared, fp);
+    writeValue(fp, val);
+
+    prev = realloc(prev, len + 1);
+    memcpy(prev, key, len + 1);
+    prevLen = len;
+  }
+  freeMapCursor(c);
+  free(prev);
+
+  bool ok = !ferror(fp);
+  return fclose(fp) == 0 && ok;
+}
+
+/** Position in a snapshot being read. */
+typedef struct {
+  /** Next byte to read. */
+  unsigned char const *pos;
+
+  /** End of the snapshot. */
+  unsigned char const *end;
+} Reader;
+
+/**
+* Read a varint.
+* @param r reader to read from
+* @param x set to the number read
+* @return returns false if the snapshot ends in the middle of the number
+*/
+static bool readVarint(Reader *r, uint64_t *x)
+{
+  *x = 0;
+  for (int i = 0; i < VARINT_MAX && r->pos < r->end; i++) {
+    unsigned char b = *r->pos++;
+    *x |= (uint64_t) (b & (VARINT_MORE - 1)) << (i * VARINT_BITS);
+    if (!(b & VARINT_MORE))
+      return true;
+  }
+  return false;
+}
+
+/**
+* Read one value.
+* @param r reader to read from
+* @param v filled in with the value
+* @return returns false if the snapshot is bad
+*/
+static bool readValue(Reader *r, Value *v)
+{
+  if (r->pos >= r->end)
+    return false;
+  int type = *r->pos++;
+  uint64_t x;
+  if (type == VALUE_INT) {
+    if (!readVarint(r, &x))
+      return false;
+    initInteger(v, (int) (int64_t) ((x >> 1) ^ -(x & 1)));
+    return true;
+  }
+  if (type == VALUE_DOUBLE) {
+    if (r->end - r->pos < DOUBLE_BYTES)
+      return false;
+    uint64_t bits = 0;
+    for (int i = 0; i < DOUBLE_BYTES; i++)
+      bits |= (uint64_t) *r->pos++ << (i * BYTE_BITS);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    initDouble(v, d);
+    return true;
+  }
+  if (type == VALUE_STRING) {
+    if (!readVarint(r, &x) || x > (uint64_t) (r->end - r->pos))
+      return false;
+    initString(v, (char const *) r->pos, x);
+    r->pos += x;
+    return true;
+  }
+  return false;
+}
+
+/** Pairs read from a snapshot, waiting to be added to the map. */
+typedef struct {
+  /** Characters of all the keys, one after another with null terminators. */
+  char *text;
+
+  /** Bytes used in text. */
+  size_t len;
+
+  /** Capacity of text. */
+  size_t cap;
+
+  /** Where each key starts in text. */
+  size_t start[LOAD_BATCH];
+
+  /** Value for each key. */
+  Value vals[LOAD_BATCH];
+
+  /** Number of pairs waiting. */
+  int count;
+} Pending;
+
+/**
+* Hand the waiting pairs to the map.
+* @param m map to add to
+* @param p pairs to add
+*/
+static void flushPending(Map *m, Pending *p)
+{
+  char const *keys[LOAD_BATCH];
+  for (int i = 0; i < p->count; i++)
+    keys[i] = p->text + p->start[i];
+  mapSetBatch(m, keys, p->vals, p->count);
+  p->count = 0;
+  p->len = 0;
+}
+
+/**
+* Read the pairs from a snapshot and add them to the map.
+* @param m map to add to
+* @param r reader positioned after the header
+* @return returns false if the snapshot is bad
+*/
+static bool readPairs(Map *m, Reader *r)
+{
+  uint64_t count;
+  if (!readVarint(r, &count))
+    return false;
+
+  Pending *p = malloc(sizeof(Pending));
+  p->cap = LOAD_BATCH;
+  p->text = malloc(p->cap);
+  p->len = 0;
+  p->count = 0;
+
+  //The key being rebuilt, since each key only has what's different from the last
+  char *key = malloc(1);
+  size_t keyLen = 0;
+  bool ok = true;
+  for (uint64_t i = 0; ok && i < count; i++) {
+    uint64_t shared, suffix;
+    ok = readVarint(r, &shared) && readVarint(r, &suffix) && shared <= keyLen &&
+         suffix <= (uint64_t) (r->end - r->pos) && memchr(r->pos, '\0', suffix) == NULL;
+    if (!ok)
+      break;
+    keyLen = shared + suffix;
+    key = realloc(key, keyLen + 1);
+    memcpy(key + shared, r->pos, suffix);
+    key[keyLen] = '\0';
+    r->pos += suffix;
+
+    if (!readValue(r, &p->vals[p->count])) {
+      ok = false;
+      break;
+    }
+
+    if (p->len + keyLen + 1 > p->cap) {
+      while (p->len + keyLen + 1 > p->cap)
+        p->cap *= 2;
+      p->text = realloc(p->text, p->cap);
+    }
+    p->start[p->count++] = p->len;
+    memcpy(p->text + p->len, key, keyLen + 1);
+    p->len += keyLen + 1;
+    if (p->count == LOAD_BATCH)
+      flushPending(m, p);
+  }
+
+  //Whatever was read before a problem still goes in, like the earlier batches did
+  flushPending(m, p);
+  free(key);
+  free(p->text);
+  free(p);
+  return ok && r->pos == r->end;
+}
+
+/**
+* Load the pairs in a snapshot file into a map
+* @param m map to add the pairs to
+* @param path name of the file to read
+* @return returns true if the file was a valid snapshot
+*/
+bool mapLoad(Map *m, char const *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < HEADER_LEN) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  Reader r = { data, (unsigned char const *) data + st.st_size };
+  bool ok = memcmp(r.pos, MAGIC, MAGIC_LEN) == 0 && r.pos[MAGIC_LEN] == VERSION;
+  r.pos += HEADER_LEN;
+  if (ok)
+    ok = readPairs(m, &r);
+  munmap(data, st.st_size);
+  return ok;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file snapshot.h
+ * @author David Mond (dmmond)
+ * Header file for snapshot.c, saves a map to a binary file and loads it back, so a big map
+ * doesn't have to be rebuilt from its commands every time.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "map.h"
+#include <stdbool.h>
+
+/** Write every key / value pair in a map to a snapshot file, replacing the file
+    if it's already there.
+    @param m Map to save.
+    @param path Name of the file to write.
+    @return true if the whole snapshot was written.
+*/
+bool mapSave( Map *m, char const *path );
+
+/** Add every key / value pair from a snapshot file to a map.  Keys that are
+    already in the map get the value from the file.
+    @param m Map to add the pairs to.
+    @param path Name of the file to read.
+    @return true if the file was a valid snapshot.  If it wasn't, some of its
+    pairs may have already been added.
+*/
+bool mapLoad( Map *m, char const *path );
+
+#endif
@@ -118,15 +118,17 @@ checkEmpty() {
   return 0
 }
 
-# Run a test of the driver program.
+# Run a test of the driver program, with any options after the test number
+# passed along to the driver.
 runTest() {
   TESTNO=$1
+  shift
 
   echo "Test $TESTNO"
   rm -f output.txt stderr.txt
 
-  echo "   ./driver < input-$TESTNO.txt > output.txt 2> stderr.txt"
-  ./driver < input-$TESTNO.txt > output.txt 2> stderr.txt
+  echo "   ./driver $@ < input-$TESTNO.txt > output.txt 2> stderr.txt"
+  ./driver "$@" < input-$TESTNO.txt > output.txt 2> stderr.txt
   ASTATUS=$?
 
   if ! checkStatus 0 "$ASTATUS" ||
@@ -141,6 +143,39 @@ runTest() {
   return 0
 }
 
+# Timings change from run to run, so this takes them out of the metrics
+# JSON, leaving the counts.
+maskTimes() {
+  sed -E 's/"(min|mean|p[0-9.]+|max)":[0-9.]+/"\1":0/g' "$1"
+}
+
+# Run a test of the driver program with -metrics, checking the metrics file
+# as well as the output, with the timings masked in both.  Any options after
+# the test number are passed along to the driver.
+runMetricsTest() {
+  TESTNO=$1
+  shift
+  echo "Test $TESTNO"
+  rm -f output.txt stderr.txt metrics.txt
+  echo "   ./driver -metrics metrics.txt $@ < input-$TESTNO.txt > output.txt 2> stderr.txt"
+  ./driver -metrics metrics.txt "$@" < input-$TESTNO.txt > output.txt 2> stderr.txt
+  ASTATUS=$?
+  maskTimes output.txt > output-masked.txt
+  maskTimes metrics.txt > metrics-masked.txt
+  if ! checkStatus 0 "$ASTATUS" ||
+     ! checkFile "Program output" "expected-$TESTNO.txt" "output-masked.txt" ||
+     ! checkFile "Metrics output" "expected-metrics-$TESTNO.txt" "metrics-masked.txt" ||
+     ! checkEmpty "Stderr output" "stderr.txt"
+  then
+      FAIL=1
+      return 1
+  fi
+
+  echo "Test $TESTNO PASS"
+  rm -f metrics.txt output-masked.txt metrics-masked.txt
+  return 0
+}
+
 # get a fresh copy of the target program
 make clean
 
@@ -207,6 +242,52 @@ if [ -x driver ]; then
     runTest 09
     runTest 10
     runTest 11
+    runTest 12
+    runTest 13 -intern
+    runTest 14 -maxkeys 3
+    runTest 15 -maxkeys 3 -evict clock
+    # Test 17 starts over from the log test 16 leaves behind
+    rm -f test.log
+    runTest 16 -maxkeys 2 -log test.log
+    runTest 17 -maxkeys 2 -log test.log
+    rm -f test.log
+    runTest 18 -testclock
+    runMetricsTest 19
+    runMetricsTest 19 -batch
+    # Test 21 replays the log test 20 leaves behind, with the keys that expire
+    rm -f test.log
+    runTest 20 -log test.log -testclock
+    runTest 21 -log test.log -testclock
+    rm -f test.log
+    runTest 22
+    runTest 23
+    rm -f test.snap
+    # Test 25 opens the flat trie file test 24 writes
+    rm -f test.flat
+    runTest 24
+    runTest 25 -flat test.flat
+    rm -f test.flat
+    runTest 26
+    # The hash table has to behave the same as the trie
+    runTest 06 -hash
+    runTest 12 -hash
+    runTest 22 -hash
+    # So does the striped map, including when it loads a snapshot
+    runTest 06 -concurrent
+    runTest 12 -concurrent
+    runTest 22 -concurrent
+    runTest 23 -concurrent
+    rm -f test.snap
+    # Tests 28 and 29 each pick up from the log the test before leaves behind
+    rm -f test.log
+    runTest 27 -log test.log
+    runTest 28 -log test.log
+    runTest 29 -log test.log
+    rm -f test.log
+    runTest 27 -log test.log -durability sync -batch
+    runTest 28 -log test.log -durability sync -batch
+    runTest 29 -log test.log -durability sync -batch
+    rm -f test.log
 else
     fail "Your driver program didn't compile, so it couldn't be tested."
 fi
@@ -0,0 +1,301 @@
+/**
+ * @file timer.c
+ * @author David Mond (dmmond)
+ * A hierarchical timer wheel for keys with a time to live. Time is counted in millisecond ticks.
+ * Each level of the wheel is a ring of slots, and each slot on a level covers 64 times as many
+ * ticks as one on the level below, so six levels reach out a couple of years. A timer goes on
+ * the lowest level whose slots are still finer than how far off it is, in the slot for its
+ * deadline, so adding or stopping one never depends on how many other timers there are. As the
+ * wheel turns, the slot on the first level for each tick goes off, and whenever a level comes
+ * around to a new slot, the timers in the matching slot of the level above move down to wherever
+ * they belong now. Each timer only moves down a few times before it goes off, and stretches of
+ * time with no timers on the lower levels are skipped over in one step.
+*/
+
+#include "timer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Number of bits of a deadline used to pick a slot on each level. */
+#define SLOT_BITS 6
+
+/** Number of slots in each level. */
+#define SLOTS ( 1 << SLOT_BITS )
+
+/** Mask for picking a slot out of a deadline. */
+#define SLOT_MASK ( SLOTS - 1 )
+
+/** Number of levels in the wheel. */
+#define LEVELS 6
+
+/** Level number used for timers that are on the expired list. */
+#define EXPIRED LEVELS
+
+/** Timers further off than this go in the last slot they can reach and move in from there. */
+#define MAX_SPAN ( ( 1LL << ( SLOT_BITS * LEVELS ) ) - 1 )
+
+/** One key's timer. */
+struct TimerStruct {
+  /** Timers on either side in the same slot or list. */
+  Timer *prev, *next;
+
+  /** Time the key expires. */
+  long long deadline;
+
+  /** Level the timer is on, or EXPIRED. */
+  int level;
+
+  /** The key, which belongs to whoever started the timer. */
+  char const *key;
+};
+
+/** Representation of a timer wheel. */
+struct TimerWheelStruct {
+  /** Last tick the wheel has turned to. */
+  long long now;
+
+  /** Sentinels for the lists of timers in each slot of each level. */
+  Timer slots[ LEVELS ][ SLOTS ];
+
+  /** Sentinel for the list of timers that have gone off. */
+  Timer expired;
+
+  /** Number of timers on each level, so empty levels can be skipped. */
+  long counts[ LEVELS + 1 ];
+};
+
+/**
+* Make a list empty.
+* @param head sentinel for the list
+*/
+static void emptyList(Timer *head)
+{
+  head->prev = head->next = head;
+}
+
+/**
+* Make an empty timer wheel
+* @param now current time in milliseconds
+* @return returns the new wheel
+*/
+TimerWheel *makeTimerWheel(long long now)
+{
+  TimerWheel *w = malloc(sizeof(TimerWheel));
+  w->now = now;
+  for (int l = 0; l < LEVELS; l++)
+    for (int s = 0; s < SLOTS; s++)
+      emptyList(&w->slots[l][s]);
+  emptyList(&w->expired);
+  memset(w->counts, 0, sizeof(w->counts));
+  return w;
+}
+
+/**
+* Put a timer in the slot it belongs in for the wheel's current time, or on the expired list
+* if its deadline has already come.
+* @param w wheel to put the timer in
+* @param t timer to place, which isn't in any list
+*/
+static void place(TimerWheel *w, Timer *t)
+{
+  Timer *head;
+  if (t->deadline <= w->now) {
+    t->level = EXPIRED;
+    head = &w->expired;
+  } else {
+    long long at = t->deadline - w->now > MAX_SPAN ? w->now + MAX_SPAN : t->deadline;
+    //The level is picked by the highest group of bits where the deadline and now differ. A
+    //deadline that only differs past the top level comes around in the top level's slot first
+    long long diff = at ^ w->now;
+    int level = 0;
+    while (level < LEVELS - 1 && (diff >> (SLOT_BITS * (level + 1))) != 0)
+      level++;
+    t->level = level;
+    head = &w->slots[level][(at >> (SLOT_BITS * level)) & SLOT_MASK];
+  }
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+  w->counts[t->level]++;
+}
+
+/**
+* Take a timer out of whatever slot or list it's in.
+* @param w wheel the timer is in
+* @param t timer to take out
+*/
+static void unplace(TimerWheel *w, Timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  w->counts[t->level]--;
+}
+
+/**
+* Start a timer for a key
+* @param w wheel to add to
+* @param key key the timer is for, which isn't copied
+* @param deadline time the key expires
+* @return returns the new timer
+*/
+Timer *timerAdd(TimerWheel *w, char const *key, long long deadline)
+{
+  Timer *t = malloc(sizeof(Timer));
+  t->key = key;
+  t->deadline = deadline;
+  place(w, t);
+  return t;
+}
+
+/**
+* Report when a timer goes off
+* @param t timer to check
+* @return returns the deadline
+*/
+long long timerDeadline(Timer const *t)
+{
+  return t->deadline;
+}
+
+/**
+* Report whether a timer has gone off
+* @param t timer to check
+* @return returns true if it's on the expired list
+*/
+bool timerGoneOff(Timer const *t)
+{
+  return t->level == EXPIRED;
+}
+
+/**
+* Get the key a timer is for
+* @param t timer to check
+* @return returns the key
+*/
+char const *timerKey(Timer const *t)
+{
+  return t->key;
+}
+
+/**
+* Stop a timer and free it
+* @param w wheel the timer is in
+* @param t timer to stop
+*/
+void timerCancel(TimerWheel *w, Timer *t)
+{
+  unplace(w, t);
+  free(t);
+}
+
+/**
+* Move every timer in one slot to wherever it belongs now.
+* @param w wheel being turned
+* @param head sentinel for the slot
+*/
+static void replaceSlot(TimerWheel *w, Timer *head)
+{
+  Timer *t = head->next;
+  emptyList(head);
+  while (t != head) {
+    Timer *next = t->next;
+    w->counts[t->level]--;
+    place(w, t);
+    t = next;
+  }
+}
+
+/**
+* Turn the wheel forward to the given time
+* @param w wheel to turn
+* @param now current time
+*/
+void timerAdvance(TimerWheel *w, long long now)
+{
+  while (w->now < now) {
+    //Nothing can go off before the next slot of the lowest level with any timers
+    int low = 0;
+    while (low < LEVELS && w->counts[low] == 0)
+      low++;
+    if (low == LEVELS) {
+      w->now = now;
+      return;
+    }
+    long long tick = w->now + 1;
+    if (low > 0) {
+      long long span = 1LL << (SLOT_BITS * low);
+      tick = (w->now / span + 1) * span;
+      if (tick > now) {
+        w->now = now;
+        return;
+      }
+    }
+    w->now = tick;
+
+    //Each level that's come around to a new slot moves that slot's timers down, lowest first
+    for (int l = 1; l < LEVELS && (tick & ((1LL << (SLOT_BITS * l)) - 1)) == 0; l++)
+      replaceSlot(w, &w->slots[l][(tick >> (SLOT_BITS * l)) & SLOT_MASK]);
+    //Then everything due this tick goes off
+    replaceSlot(w, &w->slots[0][tick & SLOT_MASK]);
+  }
+}
+
+/**
+* Get the key for a timer that's gone off
+* @param w wheel to look in
+* @return returns the key, or NULL if none have gone off
+*/
+char const *timerExpired(TimerWheel *w)
+{
+  return w->expired.next == &w->expired ? NULL : w->expired.next->key;
+}
+
+/**
+* Step to the next timer that's gone off
+* @param w wheel to look in
+* @param t timer to start after, or NULL for the first one
+* @return returns the next expired timer, or NULL if there are no more
+*/
+Timer *timerNextExpired(TimerWheel *w, Timer const *t)
+{
+  Timer *next = t ? t->next : w->expired.next;
+  return next == &w->expired ? NULL : next;
+}
+
+/**
+* Report how many timers have gone off
+* @param w wheel to check
+* @return returns the number on the expired list
+*/
+long timerExpiredCount(TimerWheel *w)
+{
+  return w->counts[EXPIRED];
+}
+
+/**
+* Free every timer in a list.
+* @param head sentinel for the list
+*/
+static void freeList(Timer *head)
+{
+  Timer *t = head->next;
+  while (t != head) {
+    Timer *next = t->next;
+    free(t);
+    t = next;
+  }
+}
+
+/**
+* Free a timer wheel and its timers
+* @param w wheel to free
+*/
+void freeTimerWheel(TimerWheel *w)
+{
+  for (int l = 0; l < LEVELS; l++)
+    for (int s = 0; s < SLOTS; s++)
+      freeList(&w->slots[l][s]);
+  freeList(&w->expired);
+  free(w);
+}
@@ -0,0 +1,95 @@
+/**
+ * @file timer.h
+ * @author David Mond (dmmond)
+ * Header file for timer.c, a hierarchical timer wheel that keeps track of when keys with a time
+ * to live expire. map.c keeps a timer for each such key, and these functions are only meant to
+ * be called from there. A timer points at its key instead of copying it, so the key has to stay
+ * put until the timer is stopped.
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+
+/** Incomplete type for a timer wheel. */
+typedef struct TimerWheelStruct TimerWheel;
+
+/** Incomplete type for one key's timer. */
+typedef struct TimerStruct Timer;
+
+/** Make an empty timer wheel.
+    @param now Current time, in milliseconds.
+    @return the new wheel.
+*/
+TimerWheel *makeTimerWheel( long long now );
+
+/** Start a timer for a key.  Starting one takes constant time, however
+    far off it expires.
+    @param w Wheel to add the timer to.
+    @param key Key the timer is for, which has to last until the timer is stopped.
+    @param deadline Time the key expires, in milliseconds.
+    @return the new timer.
+*/
+Timer *timerAdd( TimerWheel *w, char const *key, long long deadline );
+
+/** Report when a timer goes off.
+    @param t Timer to check.
+    @return its deadline, in milliseconds.
+*/
+long long timerDeadline( Timer const *t );
+
+/** Report whether a timer has gone off, which only changes when the wheel
+    turns.
+    @param t Timer to check.
+    @return true if the timer is on the expired list.
+*/
+bool timerGoneOff( Timer const *t );
+
+/** Get the key a timer is for.
+    @param t Timer to check.
+    @return the key passed to timerAdd().
+*/
+char const *timerKey( Timer const *t );
+
+/** Stop a timer, whether it's gone off yet or not, and free it.
+    @param w Wheel the timer is in.
+    @param t Timer to stop.
+*/
+void timerCancel( TimerWheel *w, Timer *t );
+
+/** Turn the wheel forward to the given time, putting every timer whose
+    deadline has come on the list of expired timers.  The work is for the
+    timers that go off or move closer to going off, and a few steps for each
+    stretch of time with nothing in it, never one step for every millisecond.
+    @param w Wheel to turn.
+    @param now Current time, in milliseconds.  The wheel never turns back.
+*/
+void timerAdvance( TimerWheel *w, long long now );
+
+/** Get the key for one of the timers that have gone off.  The timer stays
+    on the expired list until it's stopped with timerCancel().
+    @param w Wheel to look in.
+    @return the key, still owned by the timer, or NULL if no timer has gone off.
+*/
+char const *timerExpired( TimerWheel *w );
+
+/** Step through the timers that have gone off, in the order they went off.
+    @param w Wheel to look in.
+    @param t Timer to start after, or NULL to start from the first one.
+    @return the next timer that's gone off, or NULL if there are no more.
+*/
+Timer *timerNextExpired( TimerWheel *w, Timer const *t );
+
+/** Report how many timers have gone off and are waiting to be stopped.
+    @param w Wheel to check.
+    @return the number of timers on the expired list.
+*/
+long timerExpiredCount( TimerWheel *w );
+
+/** Free a timer wheel and every timer still in it.
+    @param w Wheel to free.
+*/
+void freeTimerWheel( TimerWheel *w );
+
+#endif
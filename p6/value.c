@@ -2,25 +2,37 @@
  * @file value.c
  * @author David Mond (dmmond)
  * Holds an integer value, double value, and a string value. Can parse doubles, integers, and strings, along with destroyed and adding them.
+ * Every kind of value is the same fixed-size struct: a one-byte type tag, then the integer or double
+ * itself, or a pointer to a string's characters. The functions for each type live in one static
+ * table indexed by the tag, instead of being copied into every value, and adding numbers is done
+ * right in a switch on the tag with no function pointers at all.
+ * The make and parse functions hand back values on the heap, and the init and Into functions fill
+ * in a Value the caller already has, so numbers stored inline in the map or on the stack never
+ * touch malloc.
+ * A string keeps its length and capacity next to its characters, and grows to at least double its
+ * capacity when it runs out of room, so appending to it over and over takes linear time overall.
+ * Values are printed by writing them straight into the caller's buffer with formatValue(), and
+ * numbers are turned into digits here rather than through printf.
+ * parseNumberInto() reads an integer or a double in one pass over a word of a command line,
+ * working out the usual decimal doubles exactly without strtod.
+ * With setStringInterning() turned on, every new string is looked up in one table shared by the
+ * whole program, and a string that's already there is shared instead of copied, with a count of
+ * the values using it. Adding to a shared string copies it first, so no value ever sees another
+ * one change. The table and the counts are guarded by one lock, so values can be made and freed
+ * from any thread.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "value.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
-
-
-/** Type used to represent a subclass of Value that holds an integer. */
-typedef struct {
-  // Superclass fields.
-  char *(*toString)( Value const *v );
-  bool (*plus)( Value *v, Value const *x );
-  void (*destroy)( Value *v );
-
-  // Subclass fields.
-  int val;
-} IntegerValue;
+#include <stdint.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
 
 /** Maximum length of a 32-bit integer as a string. */
 #define INTEGER_LENGTH 11
@@ -31,55 +43,129 @@ typedef struct {
 /** Stirng to String addition. */
 #define STR 3
 
+/** Block holding the characters of a string value. */
+struct StringDataStruct {
+  /** Number of characters, not counting the null terminator. */
+  size_t len;
+
+  /** Number of characters text has room for, including the null terminator. */
+  size_t cap;
+
+  /** Number of values sharing the block, always one unless it's interned. */
+  unsigned int refs;
+
+  /** True while the block is in the intern table. */
+  bool interned;
+
+  /** The null-terminated characters. */
+  char text[];
+};
+
+/** Starting number of slots in the intern table. */
+#define INTERN_START 64
+
+/** Table of interned strings, found by hashing their characters. Slots are probed linearly,
+    and a removed string's slot is filled back in by moving later strings up, so there are
+    never any tombstones. */
+typedef struct {
+  /** Strings in the table, or NULL for an empty slot. */
+  StringData **slots;
+
+  /** Number of slots, always a power of two. */
+  size_t cap;
+
+  /** Figures reported by getInternStats(). */
+  InternStats stats;
+} InternTable;
+
+/** True once setStringInterning() has turned interning on. */
+static bool interning;
+
+/** The one intern table, shared by every thread. */
+static InternTable internTable;
+
+/** Lock for the intern table and the reference counts of interned strings. */
+static pthread_mutex_t internLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Tag for an empty value, which is what a zeroed Value has. */
+#define TAG_EMPTY 0
+/** Tag for an integer value. The tags for real values are their VALUE_ type plus one. */
+#define TAG_INT ( VALUE_INT + 1 )
+/** Tag for a double value. */
+#define TAG_DOUBLE ( VALUE_DOUBLE + 1 )
+/** Tag for a string value. */
+#define TAG_STRING ( VALUE_STRING + 1 )
+/** Number of different tags. */
+#define TAG_COUNT 4
+
+/** Functions shared by every value of one type. */
+typedef struct {
+  /** Write a value of this type into a buffer, returning its full length. */
+  size_t (*format)( Value const *v, char *buf, size_t cap );
+
+  /** Add a value of the same type to one of this type. */
+  bool (*plus)( Value *v, Value const *x );
+
+  /** Free any memory a value of this type holds, but not the Value itself. */
+  void (*destroy)( Value *v );
+} ValueOps;
+
+/** Table of functions for each type, indexed by tag. Defined at the end of the file. */
+static ValueOps const valueOps[ TAG_COUNT ];
+
 /**
- * Converts integer value to a dynamically allocated string representation.
+ * Copies formatted characters out to a caller's buffer, if they fit along with a null terminator.
  *
- * @param v Pointer to the Value structure.
- * @return Dynamically allocated string representing the integer.
+ * @param buf Buffer to copy to.
+ * @param cap Number of bytes buf has room for.
+ * @param str Characters to copy.
+ * @param len Number of characters to copy.
+ * @return The number of characters, whether or not they fit.
  */
-static char *integerToString( Value const *v )
+static size_t copyOut( char *buf, size_t cap, char const *str, size_t len )
 {
-  // Get v as a pointer to the subclass struct.
-  IntegerValue *this = (IntegerValue *) v;
-
-  // Convert to a dynamically allocated string.
-  char *str = (char *) malloc( INTEGER_LENGTH + 1 );
-  sprintf( str, "%d", this->val );
-  return str;
+  if ( len < cap ) {
+    memcpy( buf, str, len );
+    buf[ len ] = '\0';
+  } else if ( cap > 0 ) {
+    buf[ 0 ] = '\0';
+  }
+  return len;
 }
 
 /**
- * Adds an integer value to the current integer value in place.
+ * Writes an integer value into a buffer in decimal, one digit at a time from the right.
  *
- * @param v Pointer to the current Value structure.
- * @param x Pointer to the Value to add.
- * @return True if operation is successful, false otherwise.
+ * @param v Pointer to the Value structure.
+ * @param buf Buffer to write to.
+ * @param cap Number of bytes buf has room for.
+ * @return The length of the integer as a string.
  */
-static bool integerPlus( Value *v, Value const *x )
+static size_t integerFormat( Value const *v, char *buf, size_t cap )
 {
-  // We can use a function pointer to make sure x is also an
-  // integrer.
-  if ( x->toString != integerToString )
-    return false;
-  
-  // Get the parameters as IntegerValue poitners.
-  IntegerValue *this = (IntegerValue *) v;
-  IntegerValue *that = (IntegerValue *) x;
-
-  // Add the value in x to v.
-  this->val += that->val;
-  return true;
+  char str[ INTEGER_LENGTH ];
+  char *p = str + INTEGER_LENGTH;
+  // Negate as unsigned so the most negative int works too
+  unsigned int u = v->as.i < 0 ? 0u - (unsigned int) v->as.i : (unsigned int) v->as.i;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while ( u );
+  if ( v->as.i < 0 ) {
+    *--p = '-';
+  }
+  return copyOut( buf, cap, p, str + INTEGER_LENGTH - p );
 }
 
 /**
- * Frees the memory allocated for integer Value structure.
+ * Frees the memory held by an integer value, which is none.
  *
- * @param v Pointer to the Value structure to destroy.
+ * @param v Pointer to the Value structure.
  */
 static void integerDestroy( Value *v )
 {
-  // All the memory for an integer is in one big block.
-  free( v );
+  // All the memory for an integer is in the Value itself.
+  (void) v;
 }
 
 /**
@@ -89,6 +175,21 @@ static void integerDestroy( Value *v )
  * @return Pointer to a newly allocated Value structure or NULL on failure.
  */
 Value *parseInteger( char const *str )
+{
+  Value v;
+  if ( !parseIntegerInto( &v, str ) )
+    return NULL;
+  return makeInteger( v.as.i );
+}
+
+/**
+ * Parses an integer from a given string into a Value the caller has.
+ *
+ * @param v The Value to fill in.
+ * @param str The string to parse.
+ * @return True if the string was an integer.
+ */
+bool parseIntegerInto( Value *v, char const *str )
 {
   // Try to parse an integer from str.  The buffer is to make sure
   // there's no extra, non-space characters after the integer value.
@@ -96,107 +197,158 @@ Value *parseInteger( char const *str )
   char buffer[ BUFFER ];
 
   if ( sscanf( str, "%d%1s", &ival, buffer ) != 1 )
-    return NULL;
+    return false;
 
-  // Make a new instance of an integer value.
-  IntegerValue *v = (IntegerValue *) malloc( sizeof( IntegerValue ) );
-  v->toString = integerToString;
-  v->plus = integerPlus;
-  v->destroy = integerDestroy;
-  v->val = ival;
+  initInteger( v, ival );
+  return true;
+}
 
-  // Return as a pointer to the superclass.
-  return (Value *)v;
+/**
+ * Makes an integer value holding the given number.
+ *
+ * @param val The integer to store.
+ * @return Pointer to a newly allocated Value structure.
+ */
+Value *makeInteger( int val )
+{
+  Value *v = (Value *) malloc( sizeof( Value ) );
+  initInteger( v, val );
+  return v;
+}
+
+/**
+ * Stores an integer in a Value.
+ *
+ * @param v The Value to fill in.
+ * @param val The integer to store.
+ */
+void initInteger( Value *v, int val )
+{
+  v->tag = TAG_INT;
+  v->as.i = val;
 }
 
 /** This is the maximum number of characters I could get from a double value,
     printed with %f. */
 #define DOUBLE_LENGTH 317
 
-typedef struct {
-  char *(*toString)(Value const *v);
-  bool (*plus)(Value *v, Value const *x);
-  void (*destroy)(Value *v);
-
-  double val; 
-} DoubleValue;
+/** Doubles this big or bigger are formatted by snprintf, since their whole part doesn't fit in 64 bits. */
+#define FAST_HIGH 18446744073709551616.0
+/** Doubles smaller than this, other than zero, are formatted by snprintf, since their fraction
+    has bits more than 64 places after the point. */
+#define FAST_LOW 0.000244140625
+/** Number of digits printed after the decimal point. */
+#define PLACES 6
+/** Ten to the power of PLACES. */
+#define PLACES_SCALE 1000000
+/** One half, as a 64-bit binary fraction. */
+#define HALF ( (uint64_t) 1 << 63 )
 
 /**
- * Declaration for doubleToString.
+ * Declaration for doubleFormat.
  *
  * @param v Pointer to the Value structure.
- * @return Dynamically allocated string representing the double.
- */
-static char *doubleToString(Value const *v);
-
-/**
- * Declaration for doublePlus.
- *
- * @param v Pointer to the current Value structure.
- * @param x Pointer to the Value to add.
- * @return True if operation is successful, false otherwise.
+ * @param buf Buffer to write to.
+ * @param cap Number of bytes buf has room for.
+ * @return The length of the double as a string.
  */
-static bool doublePlus(Value *v, Value const *x);
+static size_t doubleFormat(Value const *v, char *buf, size_t cap);
 
 /**
  * Declaration for doubleDestroy
  *
- * @param v Pointer to the Value structure to destroy.
+ * @param v Pointer to the Value structure.
  */
 static void doubleDestroy(Value *v);
 
 /**
- * Converts double value to a dynamically allocated string representation.
+ * Writes a double value into a buffer the way %.6f prints it, without going through printf
+ * for the usual sizes of number. The whole part fits in 64 bits and the fraction is exactly a
+ * 64-bit binary fixed point number, so multiplying that by a million gives the six places with
+ * the rest below them, and the rest says exactly which way to round.
  *
  * @param v Pointer to the Value structure.
- * @return Dynamically allocated string representing the double.
+ * @param buf Buffer to write to.
+ * @param cap Number of bytes buf has room for.
+ * @return The length of the double as a string.
  */
-static char *doubleToString(Value const *v) 
+static size_t doubleFormat(Value const *v, char *buf, size_t cap)
 {
-  DoubleValue *dv = (DoubleValue *)v;
-  char *str = (char *)malloc(DOUBLE_LENGTH + 1);
-  if (str) {
-    sprintf(str, "%.6f", dv->val); 
+  char str[DOUBLE_LENGTH + 1];
+  double d = v->as.d;
+  double mag = signbit(d) ? -d : d;
+  // Huge and tiny numbers, infinity and NaN are left to snprintf
+  if (!(mag < FAST_HIGH) || (mag != 0 && mag < FAST_LOW)) {
+    int len = snprintf(str, sizeof(str), "%.6f", d);
+    return copyOut(buf, cap, str, len);
   }
-  return str;
+
+  uint64_t whole = (uint64_t) mag;
+  uint64_t frac = (uint64_t) ((mag - (double) whole) * FAST_HIGH);
+  // Multiply the fraction by a million in 32-bit halves, leaving the places above 64 bits
+  uint64_t high = (frac >> 32) * PLACES_SCALE;
+  uint64_t low = (frac & 0xffffffffu) * PLACES_SCALE;
+  uint64_t rest = (high << 32) + low;
+  uint64_t places = (high >> 32) + (rest < low);
+  // Round to nearest with ties to even, like printf
+  if (rest > HALF || (rest == HALF && (places & 1))) {
+    places++;
+  }
+  if (places == PLACES_SCALE) {
+    places = 0;
+    whole++;
+  }
+
+  char *p = str + sizeof(str);
+  for (int i = 0; i < PLACES; i++) {
+    *--p = '0' + places % 10;
+    places /= 10;
+  }
+  *--p = '.';
+  do {
+    *--p = '0' + whole % 10;
+    whole /= 10;
+  } while (whole);
+  if (signbit(d)) {
+    *--p = '-';
+  }
+  return copyOut(buf, cap, p, str + sizeof(str) - p);
 }
 
 /**
- * Adds a double value to the current double value in place.
+ * Frees the memory held by a double value, which is none.
  *
- * @param v Pointer to the current Value structure.
- * @param x Pointer to the Value to add.
- * @return True if operation is successful, false otherwise.
+ * @param v Pointer to the Value structure.
  */
-static bool doublePlus(Value *v, Value const *x) 
+static void doubleDestroy(Value *v)
 {
-  DoubleValue *dv1 = (DoubleValue *)v;
-  Value *xv = (Value *)x;
-  if (xv->toString != doubleToString) {
-    return false; 
-  }
-  DoubleValue *dv2 = (DoubleValue *)x;
-  dv1->val += dv2->val;
-  return true;
+  // All the memory for a double is in the Value itself.
+  (void) v;
 }
 
 /**
- * Frees the memory allocated for double Value structure.
+ * Parses a double from a given string, skipping leading and trailing whitespaces.
  *
- * @param v Pointer to the Value structure to destroy.
+ * @param str The string to parse.
+ * @return Pointer to a newly allocated Value structure or NULL on failure.
  */
-static void doubleDestroy(Value *v) 
+Value *parseDouble(char const *str)
 {
-  free(v);
+  Value v;
+  if (!parseDoubleInto(&v, str)) {
+    return NULL;
+  }
+  return makeDouble(v.as.d);
 }
 
 /**
- * Parses a double from a given string, skipping leading and trailing whitespaces.
+ * Parses a double from a given string into a Value the caller has.
  *
+ * @param v The Value to fill in.
  * @param str The string to parse.
- * @return Pointer to a newly allocated Value structure or NULL on failure.
+ * @return True if the string was a double.
  */
-Value *parseDouble(char const *str) 
+bool parseDoubleInto(Value *v, char const *str)
 {
   // Skip leading whitespace
   while (isspace((unsigned char)*str)) {
@@ -212,43 +364,368 @@ Value *parseDouble(char const *str)
   }
 
   if (*endptr != '\0') {
-    return NULL; 
+    return false;
   }
 
-  // Allocate a new DoubleValue
-  DoubleValue *dv = (DoubleValue *)malloc(sizeof(DoubleValue));
-  if (!dv) return NULL;
+  initDouble(v, dval);
+  return true;
+}
 
-  // Set up the methods
-  dv->toString = doubleToString;
-  dv->plus = doublePlus;
-  dv->destroy = doubleDestroy;
-  dv->val = dval; 
+/**
+ * Makes a double value holding the given number.
+ *
+ * @param dval The double to store.
+ * @return Pointer to a newly allocated Value structure or NULL on failure.
+ */
+Value *makeDouble(double dval)
+{
+  Value *v = (Value *)malloc(sizeof(Value));
+  if (!v) return NULL;
+  initDouble(v, dval);
+  return v;
+}
 
-  return (Value *)dv;
+/**
+ * Stores a double in a Value.
+ *
+ * @param v The Value to fill in.
+ * @param dval The double to store.
+ */
+void initDouble(Value *v, double dval)
+{
+  v->tag = TAG_DOUBLE;
+  v->as.d = dval;
 }
 
+/** Most significant digits the fast double parser keeps, so its mantissa can't overflow. */
+#define FAST_DIGITS 19
+/** Biggest mantissa a double holds exactly, two to the 53rd. */
+#define FAST_MANTISSA 9007199254740992ULL
+/** Biggest power of ten a double holds exactly. */
+#define FAST_POWER 22
+/** Exponents are stopped from growing past this while they're read. */
+#define EXPONENT_LIMIT 100000
+/** Longest number copied onto the stack for strtod. */
+#define NUMBER_LENGTH 1024
 
-// Structure to represent a string value
-typedef struct {
-  char *(*toString)(Value const *v);
-  bool (*plus)(Value *v, Value const *x);
-  void (*destroy)(Value *v);
+/** Every power of ten a double holds exactly. */
+static double const powersOfTen[ FAST_POWER + 1 ] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * Parses a number that the fast paths can't, with parseDoubleInto() on a null-terminated copy.
+ *
+ * @param v The Value to fill in.
+ * @param str The characters of the number.
+ * @param len Number of characters.
+ * @return True if the characters were a double.
+ */
+static bool parseNumberSlow(Value *v, char const *str, size_t len)
+{
+  char copy[NUMBER_LENGTH];
+  char *text = len < NUMBER_LENGTH ? copy : (char *)malloc(len + 1);
+  if (!text) {
+    return false;
+  }
+  memcpy(text, str, len);
+  text[len] = '\0';
+  bool ok = parseDoubleInto(v, text);
+  if (text != copy) {
+    free(text);
+  }
+  return ok;
+}
+
+/**
+ * Parses an integer or a double from a word with no whitespace in it, in one pass and without
+ * needing a null terminator. A word that's all digits after an optional sign is an integer,
+ * which is cut down to an int the way %d does it. Other decimal numbers whose digits fit in a
+ * double's mantissa, with a power of ten a double holds exactly, are one exactly rounded multiply
+ * or divide away from the right double. Anything else goes to strtod.
+ *
+ * @param v The Value to fill in.
+ * @param str The characters of the word.
+ * @param len Number of characters.
+ * @return True if the word was an integer or a double.
+ */
+bool parseNumberInto(Value *v, char const *str, size_t len)
+{
+  char const *end = str + len;
+  char const *p = str;
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+
+  // An integer is read as a long, like %d does, saturating when it's out of range
+  char const *digits = p;
+  unsigned long whole = 0;
+  bool overflow = false;
+  while (p < end && isdigit((unsigned char)*p)) {
+    unsigned int d = *p++ - '0';
+    if (whole > (ULONG_MAX - d) / 10) {
+      overflow = true;
+    } else {
+      whole = whole * 10 + d;
+    }
+  }
+  if (p == end && p > digits) {
+    long l;
+    if (negative) {
+      l = overflow || whole > (unsigned long)LONG_MAX ? LONG_MIN : -(long)whole;
+    } else {
+      l = overflow || whole > (unsigned long)LONG_MAX ? LONG_MAX : (long)whole;
+    }
+    initInteger(v, (int)l);
+    return true;
+  }
+
+  // Otherwise it's a double, read again from the first digit
+  uint64_t mantissa = 0;
+  int kept = 0;
+  int exponent = 0;
+  bool any = false;
+  bool point = false;
+  bool tooLong = false;
+  for (p = digits; p < end; p++) {
+    if (*p == '.' && !point) {
+      point = true;
+      continue;
+    }
+    if (!isdigit((unsigned char)*p)) {
+      break;
+    }
+    any = true;
+    // Each digit after the point is another power of ten down
+    if (point) {
+      exponent--;
+    }
+    // Leading zeros aren't significant
+    if (mantissa == 0 && *p == '0') {
+      continue;
+    }
+    if (kept < FAST_DIGITS) {
+      mantissa = mantissa * 10 + (*p - '0');
+      kept++;
+    } else {
+      tooLong = true;
+    }
+  }
+  if (any && p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negativeExp = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+      p++;
+    }
+    char const *expDigits = p;
+    int e = 0;
+    while (p < end && isdigit((unsigned char)*p)) {
+      if (e < EXPONENT_LIMIT) {
+        e = e * 10 + (*p - '0');
+      }
+      p++;
+    }
+    if (p == expDigits) {
+      return parseNumberSlow(v, str, len);
+    }
+    exponent += negativeExp ? -e : e;
+  }
+  if (!any || p != end || tooLong || mantissa > FAST_MANTISSA || exponent < -FAST_POWER ||
+      exponent > FAST_POWER) {
+    return parseNumberSlow(v, str, len);
+  }
+
+  double d = (double)mantissa;
+  d = exponent < 0 ? d / powersOfTen[-exponent] : d * powersOfTen[exponent];
+  initDouble(v, negative ? -d : d);
+  return true;
+}
+
+/**
+ * Hashes the characters of a string, FNV-1a style.
+ *
+ * @param str The characters.
+ * @param len Number of characters.
+ * @return The hash.
+ */
+static size_t hashChars(char const *str, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)str[i]) * 1099511628211ULL;
+  }
+  return (size_t)h;
+}
+
+/**
+ * Counts the bytes a string block takes up, the same way for every block.
+ *
+ * @param sd The block.
+ * @return Bytes in the block.
+ */
+static long blockBytes(StringData const *sd)
+{
+  return sizeof(StringData) + sd->cap;
+}
+
+/**
+ * Puts a string in the intern table, doubling the table if it's getting full. The caller holds
+ * internLock.
+ *
+ * @param sd String to add, which isn't in the table.
+ */
+static void internInsert(StringData *sd)
+{
+  InternTable *t = &internTable;
+  // Keep the table at most half full, so probes stay short
+  if ((size_t)(t->stats.strings + 1) * 2 > t->cap) {
+    StringData **old = t->slots;
+    size_t oldCap = t->cap;
+    t->cap = oldCap ? oldCap * 2 : INTERN_START;
+    t->slots = (StringData **)calloc(t->cap, sizeof(StringData *));
+    for (size_t i = 0; i < oldCap; i++) {
+      if (old[i]) {
+        size_t j = hashChars(old[i]->text, old[i]->len) & (t->cap - 1);
+        while (t->slots[j]) {
+          j = (j + 1) & (t->cap - 1);
+        }
+        t->slots[j] = old[i];
+      }
+    }
+    free(old);
+  }
+  size_t i = hashChars(sd->text, sd->len) & (t->cap - 1);
+  while (t->slots[i]) {
+    i = (i + 1) & (t->cap - 1);
+  }
+  t->slots[i] = sd;
+  sd->interned = true;
+  t->stats.strings++;
+  t->stats.bytes += blockBytes(sd);
+}
+
+/**
+ * Takes a string out of the intern table, moving up any strings after it that belong further
+ * up. The caller holds internLock.
+ *
+ * @param sd String to remove, which is in the table.
+ */
+static void internRemove(StringData *sd)
+{
+  InternTable *t = &internTable;
+  size_t mask = t->cap - 1;
+  size_t i = hashChars(sd->text, sd->len) & mask;
+  while (t->slots[i] != sd) {
+    i = (i + 1) & mask;
+  }
+  // Each later string in the run moves into the hole if its home isn't between the hole and it
+  size_t hole = i;
+  for (size_t j = (i + 1) & mask; t->slots[j]; j = (j + 1) & mask) {
+    size_t home = hashChars(t->slots[j]->text, t->slots[j]->len) & mask;
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      t->slots[hole] = t->slots[j];
+      hole = j;
+    }
+  }
+  t->slots[hole] = NULL;
+  sd->interned = false;
+  t->stats.strings--;
+  t->stats.bytes -= blockBytes(sd);
+}
 
-  char *val;
-} StringValue;
+/**
+ * Finds a string in the intern table, or adds a new one for it, and takes a reference to it.
+ *
+ * @param str The characters.
+ * @param len Number of characters.
+ * @return The shared block for the string.
+ */
+static StringData *internChars(char const *str, size_t len)
+{
+  pthread_mutex_lock(&internLock);
+  InternTable *t = &internTable;
+  if (t->cap) {
+    size_t i = hashChars(str, len) & (t->cap - 1);
+    for (StringData *sd; (sd = t->slots[i]) != NULL; i = (i + 1) & (t->cap - 1)) {
+      if (sd->len == len && memcmp(sd->text, str, len) == 0) {
+        sd->refs++;
+        t->stats.refs++;
+        t->stats.savedBytes += blockBytes(sd);
+        pthread_mutex_unlock(&internLock);
+        return sd;
+      }
+    }
+  }
+  StringData *sd = (StringData *)malloc(sizeof(StringData) + len + 1);
+  sd->len = len;
+  sd->cap = len + 1;
+  sd->refs = 1;
+  memcpy(sd->text, str, len);
+  sd->text[len] = '\0';
+  internInsert(sd);
+  t->stats.refs++;
+  pthread_mutex_unlock(&internLock);
+  return sd;
+}
 
 /**
- * Declaration for stringToString.
+ * Gives up one reference to an interned string, taking it out of the table and freeing it
+ * when it was the last.
+ *
+ * @param sd The interned block.
+ */
+static void internRelease(StringData *sd)
+{
+  pthread_mutex_lock(&internLock);
+  internTable.stats.refs--;
+  if (--sd->refs > 0) {
+    internTable.stats.savedBytes -= blockBytes(sd);
+    pthread_mutex_unlock(&internLock);
+    return;
+  }
+  internRemove(sd);
+  pthread_mutex_unlock(&internLock);
+  free(sd);
+}
+
+/**
+ * Turns interning of new strings on or off.
+ *
+ * @param on True to share the characters of equal strings.
+ */
+void setStringInterning(bool on)
+{
+  interning = on;
+}
+
+/**
+ * Reports how many strings are interned and how much sharing them saves.
+ *
+ * @param stats Structure to fill in.
+ */
+void getInternStats(InternStats *stats)
+{
+  pthread_mutex_lock(&internLock);
+  *stats = internTable.stats;
+  stats->tableBytes = internTable.cap * sizeof(StringData *);
+  pthread_mutex_unlock(&internLock);
+}
+
+/**
+ * Declaration for stringFormat.
  *
  * @param v Pointer to the Value
- * @return Dynamically allocated string representation with quote
+ * @param buf Buffer to write to
+ * @param cap Number of bytes buf has room for
+ * @return The length of the string with its quotes
  */
-static char *stringToString(Value const *v);
+static size_t stringFormat(Value const *v, char *buf, size_t cap);
 /**
  * Declaration for stringPlus.
  *
- * @param v Pointer to the current Value 
+ * @param v Pointer to the current Value
  * @param x Pointer to the Value to concatenate
  * @return True if successful, false otherwise.
  */
@@ -256,54 +733,105 @@ static bool stringPlus(Value *v, Value const *x);
 /**
  * Declaration for stringDestroy.
  *
- * @param v Pointer to the Value to destroy.
+ * @param v Pointer to the Value whose characters to free.
  */
 static void stringDestroy(Value *v);
 
 /**
- * Converts string value to a dynamically allocated string representation with quotes
+ * Writes string value into a buffer with quotes around it
  *
  * @param v Pointer to the Value
- * @return Dynamically allocated string representation with quote
+ * @param buf Buffer to write to
+ * @param cap Number of bytes buf has room for
+ * @return The length of the string with its quotes
  */
-static char *stringToString(Value const *v) 
+static size_t stringFormat(Value const *v, char *buf, size_t cap)
 {
-  StringValue *sv = (StringValue *)v;
-  char *str = (char *)malloc(strlen(sv->val) + STR); 
-  if (str) {
-    sprintf(str, "\"%s\"", sv->val); 
+  StringData const *sd = v->as.str;
+  size_t len = sd->len + STR - 1;
+  if (len < cap) {
+    buf[0] = '\"';
+    memcpy(buf + 1, sd->text, sd->len);
+    buf[sd->len + 1] = '\"';
+    buf[len] = '\0';
+  } else if (cap > 0) {
+    buf[0] = '\0';
   }
-  return str;
+  return len;
 }
 
 /**
- * Concatenates string values
+ * Concatenates string values, growing the left one geometrically so repeated appends are cheap
  *
- * @param v Pointer to the current Value 
- * @param x Pointer to the Value to concatenate
+ * @param v Pointer to the current Value
+ * @param x Pointer to the Value to concatenate, which may be v itself
  * @return True if successful, false otherwise.
  */
-static bool stringPlus(Value *v, Value const *x) 
+static bool stringPlus(Value *v, Value const *x)
 {
-  StringValue *sv1 = (StringValue *)v;
-  StringValue *sv2 = (StringValue *)x;
-  char *newVal = realloc(sv1->val, strlen(sv1->val) + strlen(sv2->val) + 1);
-  //combine strings and vals
-  strcat(newVal, sv2->val); 
-  sv1->val = newVal;
+  if (x->tag != TAG_STRING) {
+    return false;
+  }
+  StringData *sd = v->as.str;
+  StringData const *src = x->as.str;
+  size_t add = src->len;
+  size_t need = sd->len + add + 1;
+  if (sd->interned) {
+    // A shared string is copied before it changes, and one that isn't shared leaves the table
+    pthread_mutex_lock(&internLock);
+    bool shared = sd->refs > 1;
+    if (!shared) {
+      internRemove(sd);
+      internTable.stats.refs--;
+    }
+    pthread_mutex_unlock(&internLock);
+    if (shared) {
+      size_t cap = sd->cap * 2 < need ? need : sd->cap * 2;
+      StringData *copy = (StringData *)malloc(sizeof(StringData) + cap);
+      copy->len = sd->len;
+      copy->cap = cap;
+      copy->refs = 1;
+      copy->interned = false;
+      memcpy(copy->text, sd->text, sd->len + 1);
+      v->as.str = copy;
+      // src may be the shared block, which stays alive until this reference is given up
+      memcpy(copy->text + copy->len, src->text, add);
+      copy->len += add;
+      copy->text[copy->len] = '\0';
+      internRelease(sd);
+      return true;
+    }
+  }
+  bool self = src == sd;
+  if (need > sd->cap) {
+    size_t cap = sd->cap * 2;
+    if (cap < need) {
+      cap = need;
+    }
+    sd = realloc(sd, sizeof(StringData) + cap);
+    sd->cap = cap;
+    v->as.str = sd;
+  }
+  //combine strings and vals, reading from the new block if x was v
+  src = self ? sd : src;
+  memcpy(sd->text + sd->len, src->text, add);
+  sd->len += add;
+  sd->text[sd->len] = '\0';
   return true;
 }
 
 /**
- * Frees the memory allocated for string Value
+ * Frees the characters of a string Value
  *
- * @param v Pointer to the Value to destroy.
+ * @param v Pointer to the Value whose characters to free.
  */
-static void stringDestroy(Value *v) 
+static void stringDestroy(Value *v)
 {
-  StringValue *sv = (StringValue *)v;
-  free(sv->val);
-  free(sv);
+  if (v->as.str->interned) {
+    internRelease(v->as.str);
+  } else {
+    free(v->as.str);
+  }
 }
 
 /**
@@ -312,7 +840,24 @@ static void stringDestroy(Value *v)
  * @param str The string to parse.
  * @return Pointer to a new Value or NULL if fails
  */
-Value *parseString(char const *str) 
+Value *parseString(char const *str)
+{
+  Value *v = (Value *)malloc(sizeof(Value));
+  if (!parseStringInto(v, str)) {
+    free(v);
+    return NULL;
+  }
+  return v;
+}
+
+/**
+ * Parses a string value from a given string between quotes, into a Value the caller has.
+ *
+ * @param v The Value to fill in.
+ * @param str The string to parse.
+ * @return True if the string was quoted.
+ */
+bool parseStringInto(Value *v, char const *str)
 {
   // Find the first quote
   const char *firstQuote = strchr(str, '\"');
@@ -320,33 +865,99 @@ Value *parseString(char const *str)
   // Find the second quote
   const char *secondQuote = strchr(firstQuote + 1, '\"');
   if (!secondQuote) {
-    return NULL; 
+    return false;
   }
 
   // Make sure everything after the second quote is whitespace until the end of the string
   for (const char *p = secondQuote + 1; *p; p++) {
     if (!isspace((unsigned char)*p)) {
-      return NULL; 
+      return false;
     }
   }
 
-  // memory for the string value
-  size_t len = secondQuote - firstQuote - 1;
-  char *val = (char *)malloc(len + 1);  
+  initString(v, firstQuote + 1, secondQuote - firstQuote - 1);
+  return true;
+}
 
-  // Copy the string between the quotes
-  strncpy(val, firstQuote + 1, len);
-  val[len] = '\0'; 
+/**
+ * Makes a string value from the given characters.
+ *
+ * @param str The characters to copy, not null terminated.
+ * @param len Number of characters to copy.
+ * @return Pointer to a new Value
+ */
+Value *makeString(char const *str, size_t len)
+{
+  Value *v = (Value *)malloc(sizeof(Value));
+  initString(v, str, len);
+  return v;
+}
 
-  StringValue *sv = (StringValue *)malloc(sizeof(StringValue));
+/**
+ * Stores a copy of some characters as a string in a Value.
+ *
+ * @param v The Value to fill in.
+ * @param str The characters to copy, not null terminated.
+ * @param len Number of characters to copy.
+ */
+void initString(Value *v, char const *str, size_t len)
+{
+  v->tag = TAG_STRING;
+  if (interning) {
+    v->as.str = internChars(str, len);
+    return;
+  }
 
-  // Set up the methods
-  sv->toString = stringToString;
-  sv->plus = stringPlus;
-  sv->destroy = stringDestroy;
-  sv->val = val;
+  // memory for the string value, with no room to spare until it's appended to
+  StringData *sd = (StringData *)malloc(sizeof(StringData) + len + 1);
+  sd->len = len;
+  sd->cap = len + 1;
+  sd->refs = 1;
+  sd->interned = false;
+
+  // Copy the string
+  memcpy(sd->text, str, len);
+  sd->text[len] = '\0';
+  v->as.str = sd;
+}
 
-  return (Value *)sv;
+/**
+ * Checks whether a Value holds anything.
+ *
+ * @param v Pointer to the Value.
+ * @return True if the Value is empty.
+ */
+bool valueEmpty(Value const *v)
+{
+  return v->tag == TAG_EMPTY;
+}
+
+/**
+ * Frees what a Value holds and leaves it empty.
+ *
+ * @param v Pointer to the Value to clear.
+ */
+void clearValue(Value *v)
+{
+  if (v->tag != TAG_EMPTY) {
+    valueOps[v->tag].destroy(v);
+    v->tag = TAG_EMPTY;
+  }
+}
+
+/**
+ * Moves what one Value holds into another.
+ *
+ * @param dst Pointer to the Value to move into, whose old contents are freed.
+ * @param src Pointer to the Value to move from, which is left empty.
+ */
+void moveValue(Value *dst, Value *src)
+{
+  if (dst != src) {
+    clearValue(dst);
+    *dst = *src;
+    src->tag = TAG_EMPTY;
+  }
 }
 
 /**
@@ -354,9 +965,144 @@ Value *parseString(char const *str)
  *
  * @param v Pointer to the Value to destroy.
  */
-void destroyValue(Value *v) 
+void destroyValue(Value *v)
 {
   if (v) {
-    v->destroy(v);
+    clearValue(v);
+    free(v);
+  }
+}
+
+/**
+ * Writes a value into a buffer, using the function for its type.
+ *
+ * @param v Pointer to the Value.
+ * @param buf Buffer to write to, which may be NULL if cap is zero.
+ * @param cap Number of bytes buf has room for.
+ * @return The full length of the value as a string.
+ */
+size_t formatValue(Value const *v, char *buf, size_t cap)
+{
+  return valueOps[v->tag].format(v, buf, cap);
+}
+
+/**
+ * Converts a value to a dynamically allocated string. Numbers are formatted on the stack
+ * first, so only strings are formatted twice.
+ *
+ * @param v Pointer to the Value.
+ * @return Dynamically allocated string for the value.
+ */
+char *valueToString(Value const *v)
+{
+  char small[DOUBLE_LENGTH + 1];
+  size_t len = formatValue(v, small, sizeof(small));
+  char *str = (char *)malloc(len + 1);
+  if (str && len < sizeof(small)) {
+    memcpy(str, small, len + 1);
+  } else if (str) {
+    formatValue(v, str, len + 1);
+  }
+  return str;
+}
+
+/**
+ * Adds one value to another in place. Numbers are added right here, and only strings
+ * go through the table.
+ *
+ * @param v Pointer to the Value to add to.
+ * @param x Pointer to the Value to add.
+ * @return True if the two values have the same type.
+ */
+bool valuePlus(Value *v, Value const *x)
+{
+  if (v->tag != x->tag) {
+    return false;
+  }
+  switch (v->tag) {
+  case TAG_INT:
+    v->as.i += x->as.i;
+    return true;
+  case TAG_DOUBLE:
+    v->as.d += x->as.d;
+    return true;
+  case TAG_EMPTY:
+    return false;
+  default:
+    return valueOps[v->tag].plus(v, x);
   }
-}
\ No newline at end of file
+}
+
+/**
+ * Reports the type of a value from its tag.
+ *
+ * @param v Pointer to the Value.
+ * @return VALUE_INT, VALUE_DOUBLE or VALUE_STRING.
+ */
+int valueType(Value const *v)
+{
+  return v->tag - 1;
+}
+
+/**
+ * Gets the number in an integer value.
+ *
+ * @param v Pointer to the Value, which must be an integer.
+ * @return The integer.
+ */
+int integerOf(Value const *v)
+{
+  return v->as.i;
+}
+
+/**
+ * Gets the number in a double value.
+ *
+ * @param v Pointer to the Value, which must be a double.
+ * @return The double.
+ */
+double doubleOf(Value const *v)
+{
+  return v->as.d;
+}
+
+/**
+ * Gets the characters in a string value.
+ *
+ * @param v Pointer to the Value, which must be a string.
+ * @return The string, without quotes.
+ */
+char const *stringOf(Value const *v)
+{
+  return v->as.str->text;
+}
+
+/**
+ * Gets the length of a string value.
+ *
+ * @param v Pointer to the Value, which must be a string.
+ * @return The number of characters, without quotes.
+ */
+size_t stringLength(Value const *v)
+{
+  return v->as.str->len;
+}
+
+/**
+ * Reports how much memory a value holds outside the Value itself.
+ *
+ * @param v Pointer to the Value.
+ * @return Bytes in a string's block, or zero for anything else.
+ */
+size_t valueBytes(Value const *v)
+{
+  return v->tag == TAG_STRING ? (size_t) blockBytes(v->as.str) : 0;
+}
+
+/** Functions for each type of value. An empty value has none, and valuePlus adds numbers itself. */
+static ValueOps const valueOps[ TAG_COUNT ] = {
+  [ TAG_EMPTY ] = { NULL, NULL, NULL },
+  [ TAG_INT ] = { integerFormat, NULL, integerDestroy },
+  [ TAG_DOUBLE ] = { doubleFormat, NULL, doubleDestroy },
+  [ TAG_STRING ] = { stringFormat, stringPlus, stringDestroy },
+};
@@ -8,30 +8,90 @@
 #define VALUE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/** Type reported by valueType() for an integer value. */
+#define VALUE_INT 0
+
+/** Type reported by valueType() for a double value. */
+#define VALUE_DOUBLE 1
+
+/** Type reported by valueType() for a string value. */
+#define VALUE_STRING 2
+
+/** Incomplete type for the block holding a string value's characters, along
+    with its length and how much room it has to grow. */
+typedef struct StringDataStruct StringData;
+
+/** Figures for the strings shared through interning, filled in by
+    getInternStats(). */
+typedef struct {
+  /** Number of different strings interned. */
+  long strings;
+
+  /** Number of values using those strings. */
+  long refs;
+
+  /** Bytes in the interned strings' blocks. */
+  long bytes;
+
+  /** Bytes that would have been used by separate copies for every value
+      beyond the first using each string. */
+  long savedBytes;
+
+  /** Bytes in the table used to find the strings. */
+  long tableBytes;
+} InternStats;
 
 /** Give a short name to the Value struct defined below. */
 typedef struct ValueStruct Value;   
 
-/** Abstract type used to represent an arbitrary value. All Values
-    support four basic operations. */
+/** Type used to represent an arbitrary value. All Values support four
+    basic operations, through valueToString(), valuePlus(), clearValue()
+    and destroyValue(). Every kind of value is the same size, with small
+    values stored right in the struct and only a string's characters kept
+    in a separate block, so Values can be stored inline in other structures
+    or on the stack instead of being allocated one at a time. A zeroed
+    Value is empty. */
 struct ValueStruct {
-  /** Convert the given value to a dynamically allocated string.
-      @param v Pointer to the value object to string-ify.
-      @return dynamically allocated strign representation for v. */
-  char *(*toString)( Value const *v );
-  
-  /** Subclass-specific behavior performing a += operation, adding
-      two different values of the same type.
-      @param v Pointer to the value we're modifying (adding to).
-      @param x Pointer to the value we're adding to v.
-      @return true if the types of v and x permit addition. */
-  bool (*plus)( Value *v, Value const *x );
-  
-  /** Free any memory used to store this value.
-      @param v Pointer to the value object to free. */
-  void (*destroy)( Value *v );
+  /** Which kind of value this is, only meant to be looked at by value.c.
+      The behavior for each kind lives in one shared table instead of in
+      every value. */
+  unsigned char tag;
+
+  /** What the value holds, which field depends on its type. */
+  union {
+    /** Number in an integer value. */
+    int i;
+
+    /** Number in a double value. */
+    double d;
+
+    /** Characters of a string value, without quotes. */
+    StringData *str;
+  } as;
 };
 
+/** Write the given value into a buffer, the same way valueToString()
+    does, without allocating anything.
+    @param v Pointer to the value object to string-ify.
+    @param buf Buffer to write to, which can be NULL if cap is zero.
+    @param cap Number of bytes buf has room for, including the null terminator.
+    @return length of v as a string.  If that's cap or more, it didn't fit
+    and buf is left holding an empty string. */
+size_t formatValue( Value const *v, char *buf, size_t cap );
+
+/** Convert the given value to a dynamically allocated string.
+    @param v Pointer to the value object to string-ify.
+    @return dynamically allocated strign representation for v. */
+char *valueToString( Value const *v );
+
+/** Perform a += operation, adding two values of the same type.
+    @param v Pointer to the value we're modifying (adding to).
+    @param x Pointer to the value we're adding to v.
+    @return true if the types of v and x permit addition. */
+bool valuePlus( Value *v, Value const *x );
+
 /** Parse the given strign as an integer and create a dynamically allocated
     instance of Value for it.
     @param str string to parse as an integer.
@@ -53,6 +113,133 @@ Value *parseDouble(char const *str);
  * @return Pointer to a new Value or NULL if fails
  */
 Value *parseString(char const *str);
+
+/** Make an integer value directly, without parsing it.
+    @param val integer to store.
+    @return new value. */
+Value *makeInteger( int val );
+
+/** Make a double value directly, without parsing it.
+    @param val double to store.
+    @return new value. */
+Value *makeDouble( double val );
+
+/** Make a string value from the given characters, without quotes.
+    @param str characters of the string, which don't need to be null terminated.
+    @param len number of characters.
+    @return new value. */
+Value *makeString( char const *str, size_t len );
+
+/** Store an integer in a Value the caller already has, e.g. on the stack.
+    Whatever the Value held before is overwritten, not freed.
+    @param v Value to fill in.
+    @param val integer to store. */
+void initInteger( Value *v, int val );
+
+/** Store a double in a Value the caller already has.
+    @param v Value to fill in.
+    @param val double to store. */
+void initDouble( Value *v, double val );
+
+/** Store a copy of some characters as a string in a Value the caller
+    already has.  Only the characters are dynamically allocated.
+    @param v Value to fill in.
+    @param str characters of the string, which don't need to be null terminated.
+    @param len number of characters. */
+void initString( Value *v, char const *str, size_t len );
+
+/** Parse an integer into a Value the caller already has, like parseInteger().
+    @param v Value to fill in, which is left alone if str isn't an integer.
+    @param str string to parse.
+    @return true if str was an integer. */
+bool parseIntegerInto( Value *v, char const *str );
+
+/** Parse a double into a Value the caller already has, like parseDouble().
+    @param v Value to fill in, which is left alone if str isn't a double.
+    @param str string to parse.
+    @return true if str was a double. */
+bool parseDoubleInto( Value *v, char const *str );
+
+/** Parse a quoted string into a Value the caller already has, like parseString().
+    @param v Value to fill in, which is left alone if str isn't a string.
+    @param str string to parse.
+    @return true if str was a quoted string. */
+bool parseStringInto( Value *v, char const *str );
+
+/** Parse an integer or a double from a word with no whitespace in it,
+    exactly as parseIntegerInto() and then parseDoubleInto() would, but in
+    one pass and without needing a null terminator.
+    @param v Value to fill in, which is left alone if the word isn't a number.
+    @param str characters of the word.
+    @param len number of characters in the word.
+    @return true if the word was an integer or a double. */
+bool parseNumberInto( Value *v, char const *str, size_t len );
+
+/** Turn interning of new strings on or off.  While it's on, a string
+    whose characters match one that's already interned shares the same
+    block, and the block is only freed when the last value using it goes.
+    Adding to a shared string copies it first, so other values using it
+    don't change.  Strings made while interning is off are never shared.
+    @param on true to intern new strings. */
+void setStringInterning( bool on );
+
+/** Report how many strings are interned, how many values use them and
+    how much memory sharing them saves.
+    @param stats structure to fill in. */
+void getInternStats( InternStats *stats );
+
+/** Report whether a Value is empty, i.e., holds nothing.
+    @param v value to check.
+    @return true if v is empty. */
+bool valueEmpty( Value const *v );
+
+/** Free whatever a Value holds and leave it empty, without freeing the
+    Value itself.  Does nothing to a Value that's already empty.
+    @param v value to clear. */
+void clearValue( Value *v );
+
+/** Move what one Value holds into another, freeing what the destination
+    held before.  The source is left empty.
+    @param dst Value to move into.
+    @param src Value to move from. */
+void moveValue( Value *dst, Value *src );
+
+/** Report what kind of value this is.
+    @param v value to check.
+    @return VALUE_INT, VALUE_DOUBLE or VALUE_STRING. */
+int valueType( Value const *v );
+
+/** Get the number stored in an integer value.
+    @param v value, which must be an integer.
+    @return the integer. */
+int integerOf( Value const *v );
+
+/** Get the number stored in a double value.
+    @param v value, which must be a double.
+    @return the double. */
+double doubleOf( Value const *v );
+
+/** Get the characters of a string value, without quotes.
+    @param v value, which must be a string.
+    @return the string, still owned by the value. */
+char const *stringOf( Value const *v );
+
+/** Get the length of a string value, without having to count its characters.
+    @param v value, which must be a string.
+    @return number of characters in the string, without quotes. */
+size_t stringLength( Value const *v );
+
+/** Report how much memory a value holds outside the Value struct itself,
+    which is only the block holding a string's characters.  A string
+    shared through interning counts in full for every value using it.
+    @param v value to measure.
+    @return bytes in the value's string block, or zero for a number or an
+    empty value. */
+size_t valueBytes( Value const *v );
+
+/** Free a dynamically allocated Value, like the ones the make and parse
+    functions return, along with whatever it holds.
+    @param v value to free, or NULL. */
 void destroyValue(Value *v);
 
 
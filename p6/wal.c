@@ -0,0 +1,623 @@
+/**
+ * @file wal.c
+ * @author David Mond (dmmond)
+ * Write-ahead log of the sets, removes and pluses made to a map. Each change is added to a
+ * buffer in memory as a binary record, and the buffer goes to the file in big writes, so many
+ * changes share one write and one fsync (group commit). How long a change can sit in memory
+ * depends on the log's durability level:
+ *   MAP_LOG_BUFFERED writes the buffer when it fills up and never calls fsync
+ *   MAP_LOG_GROUP has a background thread write and fsync the buffer every few milliseconds
+ *   MAP_LOG_SYNC makes every change wait for an fsync, but a thread that finds a flush already
+ *     going waits for the next one, which takes everything that piled up in the meantime
+ * When a map is started from a log, the records are read straight out of the mapped file and
+ * applied with no text parsing, with runs of sets going in together through mapSetBatch().
+ *
+ * Each record is a 4-byte payload length and a 4-byte FNV-1a checksum of the payload, then the
+ * payload: an operation byte, a 4-byte key length and the key, and for a set or plus the value's
+ * type byte followed by a 4-byte integer, an 8-byte double, or a 4-byte length and the
+ * characters of a string. A set of a key that expires has the 8-byte time it expires between
+ * the key and the value. Every number is little-endian. Replay stops at the first record that's
+ * cut short or doesn't match its checksum.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "wal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Operation byte for a set. */
+#define OP_SET 1
+/** Operation byte for a remove. */
+#define OP_REMOVE 2
+/** Operation byte for a plus. */
+#define OP_PLUS 3
+/** Operation byte for a set of a key that expires. */
+#define OP_SET_UNTIL 4
+/** Bytes in a word. */
+#define WORD 4
+/** Bytes in a record before its payload. */
+#define RECORD_HEADER 8
+/** Bytes in a stored double. */
+#define DOUBLE_BYTES 8
+/** Bytes in a stored deadline. */
+#define DEADLINE_BYTES 8
+/** Bits in a byte. */
+#define BYTE_BITS 8
+/** Starting value for the FNV-1a checksum. */
+#define FNV_OFFSET 2166136261u
+/** Multiplier for the FNV-1a checksum. */
+#define FNV_PRIME 16777619u
+/** Initial capacity of the record buffer. */
+#define BUFFER_START 4096
+/** Most sets handed to mapSetBatch() at once while replaying. */
+#define REPLAY_BATCH 1024
+/** Once this many bytes are waiting, the buffer gets written without waiting any longer. */
+#define FLUSH_BYTES ( 1 << 16 )
+/** How often the background thread flushes with MAP_LOG_GROUP, in milliseconds. */
+#define GROUP_MS 5
+/** Nanoseconds in a millisecond. */
+#define MILLI 1000000L
+/** Nanoseconds in a second. */
+#define NANOS 1000000000L
+
+/** Growable block of bytes. */
+typedef struct {
+  /** The bytes. */
+  unsigned char *data;
+
+  /** Number of bytes used, and room for. */
+  size_t len, cap;
+} Buffer;
+
+/** Representation of an open log. */
+struct WalStruct {
+  /** The log file. */
+  int fd;
+
+  /** One of the MAP_LOG_ levels. */
+  int durability;
+
+  /** Lock for everything below. */
+  pthread_mutex_t lock;
+
+  /** Signalled whenever a flush finishes. */
+  pthread_cond_t flushed;
+
+  /** Signalled to wake the background thread early, when the buffer is big or the log is closing. */
+  pthread_cond_t wake;
+
+  /** Records that haven't been written yet. */
+  Buffer pending;
+
+  /** Second buffer, swapped in while pending is being written. */
+  Buffer spare;
+
+  /** Sequence number of the last record added. */
+  uint64_t last;
+
+  /** Every record up to this sequence number has been flushed. */
+  uint64_t durable;
+
+  /** True while a thread is writing a buffer to the file. */
+  bool flushing;
+
+  /** True once the log is being closed. */
+  bool closing;
+
+  /** Zero, or the error from the first write or fsync that failed.  Nothing more is written
+      after one fails, and durable stops where it was, so no change after it is ever reported
+      as safe. */
+  int error;
+
+  /** Background thread for MAP_LOG_GROUP. */
+  pthread_t flusher;
+};
+
+/**
+* Make room for more bytes at the end of a buffer.
+* @param b buffer to grow
+* @param more number of bytes needed
+* @return returns where the new bytes go
+*/
+static unsigned char *extend(Buffer *b, size_t more)
+{
+  if (b->len + more > b->cap) {
+    while (b->len + more > b->cap)
+      b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  unsigned char *p = b->data + b->len;
+  b->len += more;
+  return p;
+}
+
+/**
+* Store a little-endian word.
+* @param p where to put it
+* @param x word to store
+*/
+static void putWord(unsigned char *p, uint32_t x)
+{
+  for (int i = 0; i < WORD; i++)
+    p[i] = x >> (i * BYTE_BITS);
+}
+
+/**
+* Read a little-endian word.
+* @param p where the word is
+* @return returns the word
+*/
+static uint32_t readWord(unsigned char const *p)
+{
+  return p[0] | (uint32_t) p[1] << BYTE_BITS | (uint32_t) p[2] << (2 * BYTE_BITS) |
+         (uint32_t) p[3] << (3 * BYTE_BITS);
+}
+
+/**
+* Compute the checksum of a record's payload.
+* @param p the payload
+* @param len length of the payload
+* @return returns the FNV-1a hash of the bytes
+*/
+static uint32_t checksum(unsigned char const *p, size_t len)
+{
+  uint32_t h = FNV_OFFSET;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+/**
+* Write a buffer to the log, then fsync it if the level calls for it. The lock is let go
+* while the write happens, so other threads can keep adding records to the other buffer.
+* If the write or the fsync fails, the error sticks to the log and the records are dropped,
+* since anything written after a torn record would never be replayed anyway.
+* Must be called with the lock held and no other flush going.
+* @param w log to flush
+*/
+static void flushLocked(Wal *w)
+{
+  //Swap buffers, so new records go in the empty one while this one is written
+  Buffer out = w->pending;
+  w->pending = w->spare;
+  w->pending.len = 0;
+  uint64_t upTo = w->last;
+  int err = w->error;
+  w->flushing = true;
+  pthread_mutex_unlock(&w->lock);
+
+  size_t done = 0;
+  while (!err && done < out.len) {
+    ssize_t n = write(w->fd, out.data + done, out.len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      err = n < 0 ? errno : EIO;
+    else
+      done += n;
+  }
+  if (!err && w->durability != MAP_LOG_BUFFERED && fsync(w->fd) != 0)
+    err = errno;
+
+  pthread_mutex_lock(&w->lock);
+  w->spare = out;
+  if (err)
+    w->error = err;
+  else
+    w->durable = upTo;
+  w->flushing = false;
+  pthread_cond_broadcast(&w->flushed);
+}
+
+/**
+* Background thread for MAP_LOG_GROUP, flushes every few milliseconds until the log closes.
+* @param arg the Wal
+* @return returns NULL
+*/
+static void *flushLoop(void *arg)
+{
+  Wal *w = arg;
+  pthread_mutex_lock(&w->lock);
+  while (!w->closing) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += GROUP_MS * MILLI;
+    if (until.tv_nsec >= NANOS) {
+      until.tv_sec++;
+      until.tv_nsec -= NANOS;
+    }
+    pthread_cond_timedwait(&w->wake, &w->lock, &until);
+    if (w->pending.len > 0 && !w->flushing)
+      flushLocked(w);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/**
+* Add a record to the log.
+* @param w log to add to
+* @param op operation byte
+* @param key key the operation is on
+* @param val value for a set or plus, or NULL for a remove
+* @param deadline time the key expires, for OP_SET_UNTIL
+* @return returns the record's sequence number
+*/
+static uint64_t addRecord(Wal *w, int op, char const *key, Value const *val, long long deadline)
+{
+  pthread_mutex_lock(&w->lock);
+  Buffer *b = &w->pending;
+  size_t start = b->len;
+  size_t keyLen = strlen(key);
+  extend(b, RECORD_HEADER);
+  *extend(b, 1) = op;
+  putWord(extend(b, WORD), keyLen);
+  memcpy(extend(b, keyLen), key, keyLen);
+  if (op == OP_SET_UNTIL) {
+    unsigned char *p = extend(b, DEADLINE_BYTES);
+    putWord(p, (uint32_t) deadline);
+    putWord(p + WORD, (uint32_t) ((uint64_t) deadline >> (WORD * BYTE_BITS)));
+  }
+  if (val) {
+    int type = valueType(val);
+    *extend(b, 1) = type;
+    if (type == VALUE_INT) {
+      putWord(extend(b, WORD), (uint32_t) integerOf(val));
+    } else if (type == VALUE_DOUBLE) {
+      double d = doubleOf(val);
+      uint64_t bits;
+      memcpy(&bits, &d, sizeof(bits));
+      unsigned char *p = extend(b, DOUBLE_BYTES);
+      putWord(p, (uint32_t) bits);
+      putWord(p + WORD, (uint32_t) (bits >> (WORD * BYTE_BITS)));
+    } else {
+      char const *str = stringOf(val);
+      size_t len = stringLength(val);
+      putWord(extend(b, WORD), len);
+      memcpy(extend(b, len), str, len);
+    }
+  }
+  size_t payload = b->len - start - RECORD_HEADER;
+  putWord(b->data + start, payload);
+  putWord(b->data + start + WORD, checksum(b->data + start + RECORD_HEADER, payload));
+  uint64_t seq = ++w->last;
+
+  //Don't let the buffer grow without bound between flushes
+  if (b->len >= FLUSH_BYTES && !w->flushing) {
+    if (w->durability == MAP_LOG_GROUP)
+      pthread_cond_signal(&w->wake);
+    else if (w->durability == MAP_LOG_BUFFERED)
+      flushLocked(w);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return seq;
+}
+
+/**
+* Log a set
+* @param w log to add to
+* @param key key being set
+* @param val new value
+* @return returns the sequence number
+*/
+uint64_t walSet(Wal *w, char const *key, Value const *val)
+{
+  return addRecord(w, OP_SET, key, val, 0);
+}
+
+/**
+* Log a set of a key that expires
+* @param w log to add to
+* @param key key being set
+* @param val new value
+* @param deadline time the key expires
+* @return returns the sequence number
+*/
+uint64_t walSetUntil(Wal *w, char const *key, Value const *val, long long deadline)
+{
+  return addRecord(w, OP_SET_UNTIL, key, val, deadline);
+}
+
+/**
+* Log a remove
+* @param w log to add to
+* @param key key being removed
+* @return returns the sequence number
+*/
+uint64_t walRemove(Wal *w, char const *key)
+{
+  return addRecord(w, OP_REMOVE, key, NULL, 0);
+}
+
+/**
+* Log a plus
+* @param w log to add to
+* @param key key being added to
+* @param x value being added
+* @return returns the sequence number
+*/
+uint64_t walPlus(Wal *w, char const *key, Value const *x)
+{
+  return addRecord(w, OP_PLUS, key, x, 0);
+}
+
+/**
+* Wait for a change to be durable. The first waiter to find no flush going does the flush
+* for everyone, and the rest wait for it.
+* @param w log the change is in
+* @param seq sequence number of the change
+* @return returns false if the log has failed
+*/
+bool walWait(Wal *w, uint64_t seq)
+{
+  pthread_mutex_lock(&w->lock);
+  while (w->durability == MAP_LOG_SYNC && w->durable < seq && !w->error) {
+    if (w->flushing)
+      pthread_cond_wait(&w->flushed, &w->lock);
+    else
+      flushLocked(w);
+  }
+  bool ok = !w->error;
+  pthread_mutex_unlock(&w->lock);
+  return ok;
+}
+
+/**
+* Report whether the log has failed
+* @param w log to check
+* @return returns zero, or the error from the first write or fsync that failed
+*/
+int walError(Wal *w)
+{
+  pthread_mutex_lock(&w->lock);
+  int err = w->error;
+  pthread_mutex_unlock(&w->lock);
+  return err;
+}
+
+/**
+* Read one value out of a record.
+* @param p where the value starts
+* @param end end of the record
+* @param v filled in with the value
+* @return returns false if the record is bad
+*/
+static bool readValue(unsigned char const *p, unsigned char const *end, Value *v)
+{
+  if (p >= end)
+    return false;
+  int type = *p++;
+  size_t left = end - p;
+  if (type == VALUE_INT && left == WORD) {
+    initInteger(v, (int32_t) readWord(p));
+  } else if (type == VALUE_DOUBLE && left == DOUBLE_BYTES) {
+    uint64_t bits = readWord(p) | (uint64_t) readWord(p + WORD) << (WORD * BYTE_BITS);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    initDouble(v, d);
+  } else if (type == VALUE_STRING && left >= WORD && readWord(p) == left - WORD) {
+    initString(v, (char const *) p + WORD, left - WORD);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/** Sets read from a log, waiting to be added to the map together. */
+typedef struct {
+  /** Characters of all the keys, one after another with null terminators. */
+  char *text;
+
+  /** Bytes used in text. */
+  size_t len;
+
+  /** Capacity of text. */
+  size_t cap;
+
+  /** Where each key starts in text. */
+  size_t start[REPLAY_BATCH];
+
+  /** Value for each key. */
+  Value vals[REPLAY_BATCH];
+
+  /** Number of sets waiting. */
+  int count;
+} Pending;
+
+/**
+* Hand the waiting sets to the map.
+* @param m map to add to
+* @param p sets to add
+*/
+static void flushPending(Map *m, Pending *p)
+{
+  char const *keys[REPLAY_BATCH];
+  for (int i = 0; i < p->count; i++)
+    keys[i] = p->text + p->start[i];
+  mapSetBatch(m, keys, p->vals, p->count);
+  p->count = 0;
+  p->len = 0;
+}
+
+/**
+* Apply the records in a log to a map. Runs of sets go in through mapSetBatch(), and anything
+* else makes the sets before it go in first, so the changes still happen in order.
+* @param data contents of the log file
+* @param size size of the file
+* @param m map to apply them to
+* @return returns the length of the log up to the end of the last good record
+*/
+static size_t replay(unsigned char const *data, size_t size, Map *m)
+{
+  Pending *pend = malloc(sizeof(Pending));
+  pend->cap = BUFFER_START;
+  pend->text = malloc(pend->cap);
+  pend->len = 0;
+  pend->count = 0;
+
+  size_t pos = 0;
+  while (size - pos >= RECORD_HEADER) {
+    size_t len = readWord(data + pos);
+    unsigned char const *p = data + pos + RECORD_HEADER;
+    if (len > size - pos - RECORD_HEADER || len < 1 + WORD ||
+        checksum(p, len) != readWord(data + pos + WORD))
+      break;
+    unsigned char const *end = p + len;
+    int op = *p++;
+    size_t keyLen = readWord(p);
+    p += WORD;
+    if (keyLen > (size_t) (end - p) || (op != OP_SET && op != OP_REMOVE && op != OP_PLUS &&
+                                             op != OP_SET_UNTIL))
+      break;
+    //An expiring set has its deadline ahead of the value
+    long long deadline = 0;
+    unsigned char const *valStart = p + keyLen;
+    if (op == OP_SET_UNTIL) {
+      if ((size_t) (end - valStart) < DEADLINE_BYTES)
+        break;
+      deadline = (long long) (readWord(valStart) | (uint64_t) readWord(valStart + WORD) << (WORD * BYTE_BITS));
+      valStart += DEADLINE_BYTES;
+    }
+    //A set's value goes straight into the waiting batch, anything else's is only needed for a moment
+    Value other;
+    Value *val = op == OP_SET ? &pend->vals[pend->count] : &other;
+    if (op != OP_REMOVE && !readValue(valStart, end, val))
+      break;
+    if (op == OP_REMOVE && p + keyLen != end)
+      break;
+
+    //The key goes on the end of the waiting keys, even if it's only needed for a moment
+    if (pend->len + keyLen + 1 > pend->cap) {
+      while (pend->len + keyLen + 1 > pend->cap)
+        pend->cap *= 2;
+      pend->text = realloc(pend->text, pend->cap);
+    }
+    char *key = pend->text + pend->len;
+    memcpy(key, p, keyLen);
+    key[keyLen] = '\0';
+    if (op == OP_SET) {
+      pend->start[pend->count++] = pend->len;
+      pend->len += keyLen + 1;
+      if (pend->count == REPLAY_BATCH)
+        flushPending(m, pend);
+    } else {
+      flushPending(m, pend);
+      //Flushing resets the text, so the key has to be copied back to the start
+      memmove(pend->text, key, keyLen + 1);
+      if (op == OP_REMOVE) {
+        mapRemove(m, pend->text);
+      } else if (op == OP_SET_UNTIL) {
+        //The key comes back with its timer, unless its time ran out while the map was down
+        mapPutUntil(m, pend->text, val, deadline);
+      } else {
+        mapPlus(m, pend->text, val);
+        clearValue(val);
+      }
+    }
+    pos = end - data;
+  }
+
+  flushPending(m, pend);
+  free(pend->text);
+  free(pend);
+  return pos;
+}
+
+/**
+* Replay a log into a map and open it for more records
+* @param path name of the log file
+* @param durability one of the MAP_LOG_ levels
+* @param m map to replay into
+* @return returns the open log, or NULL if the file can't be opened
+*/
+Wal *openWal(char const *path, int durability, Map *m)
+{
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t good = 0;
+  if (st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+    good = replay(data, st.st_size, m);
+    munmap(data, st.st_size);
+  }
+  //Cut off anything after the last good record, so new records follow right after it
+  if ((off_t) good != st.st_size && ftruncate(fd, good) != 0) {
+    close(fd);
+    return NULL;
+  }
+  lseek(fd, good, SEEK_SET);
+
+  Wal *w = malloc(sizeof(Wal));
+  w->fd = fd;
+  w->durability = durability;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->flushed, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  w->pending = (Buffer) { malloc(BUFFER_START), 0, BUFFER_START };
+  w->spare = (Buffer) { malloc(BUFFER_START), 0, BUFFER_START };
+  w->last = 0;
+  w->durable = 0;
+  w->flushing = false;
+  w->closing = false;
+  w->error = 0;
+  if (durability == MAP_LOG_GROUP)
+    pthread_create(&w->flusher, NULL, flushLoop, w);
+  return w;
+}
+
+/**
+* Flush and close a log
+* @param w log to close
+* @return returns zero, or the error from the first write or fsync that failed
+*/
+int closeWal(Wal *w)
+{
+  pthread_mutex_lock(&w->lock);
+  w->closing = true;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  if (w->durability == MAP_LOG_GROUP)
+    pthread_join(w->flusher, NULL);
+
+  //Whatever's left goes out now, whatever the level
+  pthread_mutex_lock(&w->lock);
+  while (w->flushing)
+    pthread_cond_wait(&w->flushed, &w->lock);
+  if (w->pending.len > 0)
+    flushLocked(w);
+  pthread_mutex_unlock(&w->lock);
+  if (!w->error && fsync(w->fd) != 0)
+    w->error = errno;
+  if (close(w->fd) != 0 && !w->error)
+    w->error = errno;
+  int err = w->error;
+
+  pthread_cond_destroy(&w->wake);
+  pthread_cond_destroy(&w->flushed);
+  pthread_mutex_destroy(&w->lock);
+  free(w->pending.data);
+  free(w->spare.data);
+  free(w);
+  return err;
+}
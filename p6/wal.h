@@ -0,0 +1,86 @@
+/**
+ * @file wal.h
+ * @author David Mond (dmmond)
+ * Header file for wal.c, a write-ahead log of the changes made to a map. map.c writes to the
+ * log as it changes the map, and these functions are only meant to be called from there.
+*/
+
+#ifndef WAL_H
+#define WAL_H
+
+#include "map.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Incomplete type for an open log. */
+typedef struct WalStruct Wal;
+
+/** Replay the changes in a log file into a map, then open the file to add
+    more.  A partly written change at the end of the file, left by a crash,
+    is cut off.  The map must not have a log attached while it's replayed into.
+    @param path Name of the log file, which is created if it isn't there.
+    @param durability One of the MAP_LOG_ levels.
+    @param m Map to replay the changes into.
+    @return the open log, or NULL if the file can't be opened.
+*/
+Wal *openWal( char const *path, int durability, Map *m );
+
+/** Add a set to the log.
+    @param w Log to add to.
+    @param key Key being set.
+    @param val Value it's being set to.
+    @return sequence number of the change, to pass to walWait().
+*/
+uint64_t walSet( Wal *w, char const *key, Value const *val );
+
+/** Add a set of a key that expires to the log.
+    @param w Log to add to.
+    @param key Key being set.
+    @param val Value it's being set to.
+    @param deadline Time the key expires, by the map's clock.
+    @return sequence number of the change, to pass to walWait().
+*/
+uint64_t walSetUntil( Wal *w, char const *key, Value const *val, long long deadline );
+
+/** Add a remove to the log.
+    @param w Log to add to.
+    @param key Key being removed.
+    @return sequence number of the change, to pass to walWait().
+*/
+uint64_t walRemove( Wal *w, char const *key );
+
+/** Add a plus to the log.
+    @param w Log to add to.
+    @param key Key whose value is being added to.
+    @param x Value being added.
+    @return sequence number of the change, to pass to walWait().
+*/
+uint64_t walPlus( Wal *w, char const *key, Value const *x );
+
+/** Wait until a change is as durable as the log's level promises.  With
+    MAP_LOG_SYNC this waits for the change to be flushed to disk, sharing
+    the flush with any other threads waiting at the same time.  With the
+    other levels it returns right away.
+    @param w Log the change was added to.
+    @param seq Sequence number of the change.
+    @return false if a write or fsync has failed, in which case the change
+    isn't durable and never will be.
+*/
+bool walWait( Wal *w, uint64_t seq );
+
+/** Report whether the log has failed.  Once a write or fsync fails, the
+    log stops writing and every change from then on is dropped.
+    @param w Log to check.
+    @return zero, or the errno from the first write or fsync that failed.
+*/
+int walError( Wal *w );
+
+/** Flush everything still in memory to disk and close the log.
+    @param w Log to close.
+    @return zero, or the errno from the first write, fsync or close that
+    failed, including any before this.
+*/
+int closeWal( Wal *w );
+
+#endif
@@ -0,0 +1,567 @@
+/**
+ * @file workload.c
+ * @author David Mond (dmmond)
+ * Workload generator and benchmark harness for the map. Makes a key space of random keys
+ * of a given length, loads every key, then runs a stream of gets, sets and removes on keys
+ * picked either uniformly or from a Zipfian distribution, setting integers, doubles and
+ * strings in whatever mix is asked for. The whole stream is generated before the clock
+ * starts, so only the map and value code is timed. For the load and for the run it reports
+ * operations per second, nanoseconds per operation and how many allocations, frees and
+ * reallocations map.c and value.c made, then the peak resident set size. Allocations are
+ * counted by having the linker send malloc(), calloc(), realloc() and free() through the
+ * wrappers at the bottom of this file, so it has to be linked with --wrap for each of them,
+ * the way the Makefile does.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "histogram.h"
+#include "map.h"
+#include "value.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/** Default number of keys in the key space. */
+#define KEY_COUNT 100000
+/** Default length of each key. */
+#define KEY_LENGTH 16
+/** Longest key the driver accepts. */
+#define KEY_MOST 1023
+/** Default number of operations in the run, after the keys are loaded. */
+#define OP_COUNT 1000000
+/** Default length of each string value. */
+#define STRING_LENGTH 16
+/** Default skew for the Zipfian distribution, the one YCSB uses. */
+#define ZIPF_THETA 0.99
+/** Number of nanoseconds in a second. */
+#define NANOS 1000000000L
+/** Percent scale for the operation and value mixes. */
+#define PERCENT 100
+/** Keys are made of the printable characters from here... */
+#define KEY_FIRST '!'
+/** ... to here, the same ones the driver accepts. */
+#define KEY_LAST '~'
+/** Number of different characters in a key. */
+#define KEY_SYMS (KEY_LAST - KEY_FIRST + 1)
+/** Size of the block of random characters string values are copied out of. */
+#define STRING_POOL 4096
+/** Percentiles reported for each kind of operation with -latency. */
+#define LATENCY_PERCENTILES { 50.0, 99.0, 99.9 }
+/** Number of entries in LATENCY_PERCENTILES. */
+#define LATENCY_COUNT 3
+
+#define USAGE "usage: workload [-keys n] [-keylen n] [-ops n] [-dist uniform|zipf] [-theta t] [-mix get/set/remove] [-values int/double/string] [-strlen n] [-hash] [-latency] [-seed n]\n"
+
+/** Kinds of operation in the run, used to index the names and the counters. */
+enum { OP_GET, OP_SET, OP_REMOVE, OP_KINDS };
+
+/** Names for each kind of operation. */
+static char const *opName[] = { "get", "set", "remove" };
+
+/** Names for the two kinds of map, indexed by kind. */
+static char const *kindName[] = { "trie", "hash" };
+
+/** Counts of calls made to the allocator, kept by the wrappers at the bottom. */
+typedef struct {
+  /** Calls to malloc() and calloc(). */
+  long allocs;
+
+  /** Calls to free() with a block that isn't NULL. */
+  long frees;
+
+  /** Calls to realloc(). */
+  long reallocs;
+
+  /** Bytes asked for by all of those calls. */
+  long long bytes;
+} AllocCounts;
+
+/** Allocator calls made so far by the whole program. */
+static AllocCounts allocCounts;
+
+/** Everything that describes one workload. */
+typedef struct {
+  /** Number of keys in the key space. */
+  int keys;
+
+  /** Length of every key. */
+  int keyLength;
+
+  /** Number of operations to run after loading the keys. */
+  long ops;
+
+  /** Skew for picking keys, or zero to pick them uniformly. */
+  double theta;
+
+  /** Percent of operations of each kind, indexed by OP_GET and so on. */
+  int opMix[ OP_KINDS ];
+
+  /** Percent of values set of each type, indexed by VALUE_INT and so on. */
+  int valueMix[ VALUE_STRING + 1 ];
+
+  /** Length of each string value. */
+  int stringLength;
+
+  /** MAP_TRIE or MAP_HASH. */
+  int kind;
+
+  /** True to time every operation on its own and report percentiles. */
+  bool latency;
+} Workload;
+
+/** Precomputed constants for picking ranks from a Zipfian distribution. */
+typedef struct {
+  /** Number of ranks. */
+  long n;
+
+  /** Skew, between zero and one. */
+  double theta;
+
+  /** Exponent for turning a uniform number into a rank. */
+  double alpha;
+
+  /** Sum of 1 / i^theta for every rank. */
+  double zetan;
+
+  /** Scale for turning a uniform number into a rank. */
+  double eta;
+} Zipf;
+
+/** One operation in the generated stream. */
+typedef struct {
+  /** OP_GET, OP_SET or OP_REMOVE. */
+  unsigned char op;
+
+  /** Type of value a set stores. */
+  unsigned char type;
+
+  /** Index of the key to use. */
+  int key;
+} Op;
+
+/**
+ * Get the current time from a monotonic clock.
+ * @return returns the time in nanoseconds
+ */
+static long long now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANOS + ts.tv_nsec;
+}
+
+/**
+ * Get the most memory the process has had resident so far.
+ * @return returns the peak resident set size in kilobytes
+ */
+static long peakRSS()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/**
+ * Print the time and allocations taken by one phase of the benchmark.
+ * @param name name of the phase
+ * @param ops number of map operations in the phase
+ * @param elapsed nanoseconds the phase took
+ * @param before allocator calls made before the phase started
+ */
+static void report(char const *name, long ops, long long elapsed, AllocCounts const *before)
+{
+  AllocCounts used = allocCounts;
+  used.allocs -= before->allocs;
+  used.frees -= before->frees;
+  used.reallocs -= before->reallocs;
+  used.bytes -= before->bytes;
+  printf("%-8s %10ld ops %10.1f ns/op %12.0f ops/s %8.2f allocs/op %8.2f frees/op %8.2f reallocs/op %8.1f bytes/op\n",
+         name, ops, (double) elapsed / ops, (double) ops * NANOS / elapsed,
+         (double) used.allocs / ops, (double) used.frees / ops,
+         (double) used.reallocs / ops, (double) used.bytes / ops);
+}
+
+/**
+ * Get a random number that's at least zero and less than one.
+ * @return returns the number
+ */
+static double uniform()
+{
+  return rand() / ((double) RAND_MAX + 1);
+}
+
+/**
+ * Get a random number that's at least zero and less than n, even when n is bigger than
+ * RAND_MAX.
+ * @param n number of possible results
+ * @return returns the number
+ */
+static long randomBelow(long n)
+{
+  return (long) (uniform() * n);
+}
+
+/**
+ * Work out the constants for picking from a Zipfian distribution, following Gray et al.,
+ * "Quickly Generating Billion-Record Synthetic Databases". Adding up zetan takes time in
+ * proportion to n, but after that each pick takes constant time.
+ * @param z constants to fill in
+ * @param n number of ranks
+ * @param theta skew, between zero and one
+ */
+static void initZipf(Zipf *z, long n, double theta)
+{
+  z->n = n;
+  z->theta = theta;
+  z->zetan = 0;
+  for (long i = 1; i <= n; i++)
+    z->zetan += 1 / pow(i, theta);
+  double zeta2 = 1 + 1 / pow(2, theta);
+  z->alpha = 1 / (1 - theta);
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+/**
+ * Pick a rank from a Zipfian distribution, where rank zero is the most likely.
+ * @param z constants made by initZipf
+ * @return returns the rank
+ */
+static long pickZipf(Zipf const *z)
+{
+  double u = uniform();
+  double uz = u * z->zetan;
+  if (uz < 1)
+    return 0;
+  if (uz < 1 + pow(0.5, z->theta))
+    return 1;
+  long rank = (long) (z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return rank < z->n ? rank : z->n - 1;
+}
+
+/**
+ * Pick one of several choices, given the percent for each.
+ * @param mix percent for each choice, adding up to 100
+ * @param count number of choices
+ * @return returns the index of the choice picked
+ */
+static int pickMix(int const *mix, int count)
+{
+  int roll = rand() % PERCENT;
+  for (int i = 0; i < count - 1; i++) {
+    if (roll < mix[i])
+      return i;
+    roll -= mix[i];
+  }
+  return count - 1;
+}
+
+/**
+ * Make the key space. Every key is random characters, except that the index of the key is
+ * written in base KEY_SYMS over its last few characters, so no two keys are the same.
+ * Keys are picked by index and the indexes are in no particular order in the trie, so the
+ * most popular keys under a Zipfian distribution are scattered around it.
+ * @param count number of keys to make
+ * @param len length of each key
+ * @return returns a dynamically allocated array of dynamically allocated keys, or NULL if
+ * keys of that length can't all be different
+ */
+static char **makeKeys(int count, int len)
+{
+  int digits = 1;
+  for (long room = KEY_SYMS; room < count; room *= KEY_SYMS)
+    digits++;
+  if (digits > len)
+    return NULL;
+
+  char **keys = malloc(count * sizeof(char *));
+  for (int i = 0; i < count; i++) {
+    keys[i] = malloc(len + 1);
+    for (int j = 0; j < len - digits; j++)
+      keys[i][j] = KEY_FIRST + rand() % KEY_SYMS;
+    int rest = i;
+    for (int j = len - 1; j >= len - digits; j--) {
+      keys[i][j] = KEY_FIRST + rest % KEY_SYMS;
+      rest /= KEY_SYMS;
+    }
+    keys[i][len] = '\0';
+  }
+  return keys;
+}
+
+/**
+ * Free the keys made by makeKeys.
+ * @param keys array of keys
+ * @param count number of keys
+ */
+static void freeKeys(char **keys, int count)
+{
+  for (int i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+}
+
+/**
+ * Generate the stream of operations for the run.
+ * @param w workload to generate
+ * @return returns a dynamically allocated array of w->ops operations
+ */
+static Op *makeOps(Workload const *w)
+{
+  Zipf zipf = { 0 };
+  if (w->theta > 0)
+    initZipf(&zipf, w->keys, w->theta);
+  Op *ops = malloc(w->ops * sizeof(Op));
+  for (long i = 0; i < w->ops; i++) {
+    ops[i].key = w->theta > 0 ? pickZipf(&zipf) : randomBelow(w->keys);
+    ops[i].op = pickMix(w->opMix, OP_KINDS);
+    ops[i].type = pickMix(w->valueMix, VALUE_STRING + 1);
+  }
+  return ops;
+}
+
+/**
+ * Fill in a value of the given type, the way the driver would for a set.
+ * @param v value to fill in
+ * @param type VALUE_INT, VALUE_DOUBLE or VALUE_STRING
+ * @param i index of the operation, used to vary the value
+ * @param pool random characters to copy strings out of
+ * @param len length of a string value
+ */
+static void fillValue(Value *v, int type, long i, char const *pool, int len)
+{
+  if (type == VALUE_INT)
+    initInteger(v, (int) i);
+  else if (type == VALUE_DOUBLE)
+    initDouble(v, i * 0.5);
+  else
+    initString(v, pool + i % STRING_POOL, len);
+}
+
+/**
+ * Load every key, then run the stream of operations and report on both.
+ * @param w workload to run
+ * @param keys key space
+ * @param ops stream of operations
+ * @param pool random characters to copy strings out of
+ */
+static void runWorkload(Workload const *w, char **keys, Op const *ops, char const *pool)
+{
+  Histogram *latency[ OP_KINDS ];
+  for (int k = 0; k < OP_KINDS; k++)
+    latency[k] = w->latency ? makeHistogram() : NULL;
+  Map *m = makeMapOfKind(w->kind);
+
+  AllocCounts before = allocCounts;
+  long long start = now();
+  for (int i = 0; i < w->keys; i++) {
+    Value v;
+    fillValue(&v, pickMix(w->valueMix, VALUE_STRING + 1), i, pool, w->stringLength);
+    mapPut(m, keys[i], &v);
+  }
+  report("load", w->keys, now() - start, &before);
+
+  long count[ OP_KINDS ] = { 0 };
+  long hits = 0;
+  before = allocCounts;
+  start = now();
+  for (long i = 0; i < w->ops; i++) {
+    long long opStart = w->latency ? now() : 0;
+    char const *key = keys[ops[i].key];
+    if (ops[i].op == OP_GET) {
+      hits += mapGet(m, key) != NULL;
+    } else if (ops[i].op == OP_SET) {
+      Value v;
+      fillValue(&v, ops[i].type, i, pool, w->stringLength);
+      mapPut(m, key, &v);
+    } else {
+      mapRemove(m, key);
+    }
+    count[ops[i].op]++;
+    if (w->latency)
+      histogramRecord(latency[ops[i].op], now() - opStart, 1);
+  }
+  report("run", w->ops, now() - start, &before);
+
+  for (int k = 0; k < OP_KINDS; k++) {
+    printf("  %-6s %10ld ops", opName[k], count[k]);
+    if (k == OP_GET && count[k] > 0)
+      printf(" %5.1f%% found", PERCENT * (double) hits / count[k]);
+    if (w->latency && count[k] > 0) {
+      double percentiles[] = LATENCY_PERCENTILES;
+      for (int p = 0; p < LATENCY_COUNT; p++)
+        printf(" p%g %lld ns", percentiles[p], histogramPercentile(latency[k], percentiles[p]));
+      printf(" max %lld ns", histogramMax(latency[k]));
+    }
+    printf("\n");
+  }
+
+  MapStats stats;
+  mapGetStats(m, &stats);
+  printf("%d keys left, %ld node bytes\n", mapSize(m), stats.nodeBytes);
+  freeMap(m);
+  for (int k = 0; k < OP_KINDS; k++)
+    if (latency[k])
+      freeHistogram(latency[k]);
+}
+
+/**
+ * Parse three percents separated by slashes, which have to add up to 100.
+ * @param str string to parse
+ * @param mix where to store the three percents
+ * @return returns true if str was three percents adding up to 100
+ */
+static bool parseMix(char const *str, int *mix)
+{
+  int len;
+  if (sscanf(str, "%d/%d/%d%n", &mix[0], &mix[1], &mix[2], &len) != 3 || str[len] != '\0')
+    return false;
+  for (int i = 0; i < 3; i++)
+    if (mix[i] < 0)
+      return false;
+  return mix[0] + mix[1] + mix[2] == PERCENT;
+}
+
+/**
+ * Run the benchmark.
+ * @param argc number of command-line arguments
+ * @param argv options describing the workload
+ * @return returns exit success, or exit failure if the options aren't right
+ */
+int main(int argc, char *argv[])
+{
+  Workload w = { KEY_COUNT, KEY_LENGTH, OP_COUNT, 0, { 80, 15, 5 }, { 50, 25, 25 },
+                 STRING_LENGTH, MAP_TRIE, false };
+  unsigned seed = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-keys") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      w.keys = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-keylen") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0
+               && atoi(argv[i + 1]) <= KEY_MOST) {
+      w.keyLength = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-ops") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+      w.ops = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-dist") == 0 && i + 1 < argc
+               && strcmp(argv[i + 1], "uniform") == 0) {
+      w.theta = 0;
+      i++;
+    } else if (strcmp(argv[i], "-dist") == 0 && i + 1 < argc
+               && strcmp(argv[i + 1], "zipf") == 0) {
+      w.theta = ZIPF_THETA;
+      i++;
+    } else if (strcmp(argv[i], "-theta") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0
+               && atof(argv[i + 1]) < 1) {
+      w.theta = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-mix") == 0 && i + 1 < argc && parseMix(argv[i + 1], w.opMix)) {
+      i++;
+    } else if (strcmp(argv[i], "-values") == 0 && i + 1 < argc
+               && parseMix(argv[i + 1], w.valueMix)) {
+      i++;
+    } else if (strcmp(argv[i], "-strlen") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0
+               && atoi(argv[i + 1]) <= STRING_POOL) {
+      w.stringLength = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-hash") == 0) {
+      w.kind = MAP_HASH;
+    } else if (strcmp(argv[i], "-latency") == 0) {
+      w.latency = true;
+    } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+      seed = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, USAGE);
+      return EXIT_FAILURE;
+    }
+  }
+
+  srand(seed);
+  char **keys = makeKeys(w.keys, w.keyLength);
+  if (!keys) {
+    fprintf(stderr, "keys of length %d are too short for %d different keys\n",
+            w.keyLength, w.keys);
+    return EXIT_FAILURE;
+  }
+  char *pool = malloc(STRING_POOL * 2);
+  for (int i = 0; i < STRING_POOL * 2; i++)
+    pool[i] = KEY_FIRST + rand() % KEY_SYMS;
+  Op *ops = makeOps(&w);
+
+  printf("%d keys of length %d, ", w.keys, w.keyLength);
+  if (w.theta > 0)
+    printf("zipf %g", w.theta);
+  else
+    printf("uniform");
+  printf(", %d%% get %d%% set %d%% remove, %d%% int %d%% double %d%% string of length %d, %s\n",
+         w.opMix[OP_GET], w.opMix[OP_SET], w.opMix[OP_REMOVE], w.valueMix[VALUE_INT],
+         w.valueMix[VALUE_DOUBLE], w.valueMix[VALUE_STRING], w.stringLength, kindName[w.kind]);
+  long setupRSS = peakRSS();
+  runWorkload(&w, keys, ops, pool);
+  printf("peak rss %ld KB, %ld KB before loading\n", peakRSS(), setupRSS);
+
+  free(ops);
+  free(pool);
+  freeKeys(keys, w.keys);
+  return EXIT_SUCCESS;
+}
+
+/** The real malloc(), which the linker points at the C library's. */
+void *__real_malloc(size_t size);
+
+/** The real calloc(). */
+void *__real_calloc(size_t count, size_t size);
+
+/** The real realloc(). */
+void *__real_realloc(void *p, size_t size);
+
+/** The real free(). */
+void __real_free(void *p);
+
+/**
+ * Count a call to malloc() and pass it on.
+ * @param size bytes to allocate
+ * @return returns what malloc() does
+ */
+void *__wrap_malloc(size_t size)
+{
+  allocCounts.allocs++;
+  allocCounts.bytes += size;
+  return __real_malloc(size);
+}
+
+/**
+ * Count a call to calloc() and pass it on.
+ * @param count number of elements
+ * @param size bytes in each element
+ * @return returns what calloc() does
+ */
+void *__wrap_calloc(size_t count, size_t size)
+{
+  allocCounts.allocs++;
+  allocCounts.bytes += count * size;
+  return __real_calloc(count, size);
+}
+
+/**
+ * Count a call to realloc() and pass it on.
+ * @param p block to resize, or NULL
+ * @param size bytes the block should have room for
+ * @return returns what realloc() does
+ */
+void *__wrap_realloc(void *p, size_t size)
+{
+  allocCounts.reallocs++;
+  allocCounts.bytes += size;
+  return __real_realloc(p, size);
+}
+
+/**
+ * Count a call to free() and pass it on.
+ * @param p block to free, or NULL
+ */
+void __wrap_free(void *p)
+{
+  if (p)
+    allocCounts.frees++;
+  __real_free(p);
+}